@@ -3,6 +3,28 @@
 #include "parsegen.hpp"
 
 #include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <istream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <streambuf>
+#include <string_view>
+#include <thread>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MATH_BYTECODE_HAS_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include <iostream>
 
@@ -27,6 +49,8 @@ enum token : std::size_t {
   token_void,
   token_if,
   token_else,
+  token_for,
+  token_int,
   token_identifier,
   token_statement_end,
   token_argument_separator,
@@ -41,6 +65,7 @@ enum token : std::size_t {
   token_less_or_equal,
   token_greater,
   token_greater_or_equal,
+  token_increment,
   token_count
 };
 
@@ -78,6 +103,8 @@ enum production : std::size_t {
   production_subexpression,
   production_unary_call,
   production_binary_call,
+  production_ternary_call,
+  production_select_call,
   production_sum,
   production_difference,
   production_product,
@@ -99,6 +126,11 @@ enum production : std::size_t {
   production_less_or_equal,
   production_greater,
   production_greater_or_equal,
+  production_for,
+  production_for_header,
+  production_prefix_increment,
+  production_postfix_increment,
+  production_indexed_array_entry,
   production_count
 };
 
@@ -131,6 +163,8 @@ parsegen::language build_language() {
   l.tokens[token_void] = {"void", "void" + filler_regex};
   l.tokens[token_if] = {"if", "if" + filler_regex};
   l.tokens[token_else] = {"else", "else" + filler_regex};
+  l.tokens[token_for] = {"for", "for" + filler_regex};
+  l.tokens[token_int] = {"int", "int" + filler_regex};
   l.tokens[token_identifier] = {"identifier", "[_A-Za-z][_A-Za-z0-9]*" + filler_regex};
   l.tokens[token_statement_end] = {"statement_end", ";" + filler_regex};
   l.tokens[token_argument_separator] = {"argument_separator", "," + filler_regex};
@@ -145,6 +179,7 @@ parsegen::language build_language() {
   l.tokens[token_less_or_equal] = {"less_or_equal", "<=" + filler_regex};
   l.tokens[token_greater] = {"greater", ">" + filler_regex};
   l.tokens[token_greater_or_equal] = {"greater_or_equal", ">=" + filler_regex};
+  l.tokens[token_increment] = {"increment", "\\+\\+" + filler_regex};
   l.productions.resize(production_count);
   l.productions[production_program] =
   {"program", {"function_definition"}};
@@ -212,6 +247,12 @@ parsegen::language build_language() {
   {"leaf", {"identifier", "open_parens", "immutable", "close_parens"}};
   l.productions[production_binary_call] =
   {"leaf", {"identifier", "open_parens", "immutable", "argument_separator", "immutable", "close_parens"}};
+  l.productions[production_ternary_call] =
+  {"leaf", {"identifier", "open_parens", "immutable", "argument_separator", "immutable",
+            "argument_separator", "immutable", "close_parens"}};
+  l.productions[production_select_call] =
+  {"leaf", {"identifier", "open_parens", "boolean_immutable", "argument_separator", "immutable",
+            "argument_separator", "immutable", "close_parens"}};
   l.productions[production_sum] =
   {"sum_or_difference", {"sum_or_difference", "plus", "product_or_quotient"}};
   l.productions[production_difference] =
@@ -256,177 +297,343 @@ parsegen::language build_language() {
   {"relational_expression", {"immutable", "greater", "immutable"}};
   l.productions[production_greater_or_equal] =
   {"relational_expression", {"immutable", "greater_or_equal", "immutable"}};
+  // loops only count from one integer up to another, and are unrolled
+  l.productions[production_for] =
+  {"statement", {"for_header", "block"}};
+  l.productions[production_for_header] =
+  {"for_header", {"for", "open_parens", "int", "identifier", "assign", "integer", "statement_end",
+                  "identifier", "less", "integer", "statement_end", "loop_increment", "close_parens"}};
+  l.productions[production_prefix_increment] =
+  {"loop_increment", {"increment", "identifier"}};
+  l.productions[production_postfix_increment] =
+  {"loop_increment", {"identifier", "increment"}};
+  l.productions[production_indexed_array_entry] =
+  {"mutable", {"identifier", "open_array", "identifier", "close_array"}};
   return l;
 }
 
-static inline std::string remove_leading_space(std::string s) {
-  s.erase(s.begin(), std::find_if(s.begin(), s.end(), [] (char ch) {
-    return !std::isspace(ch);
-  }));
-  return s;
-}
+// variable names are interned as small integers while compiling. Their
+// characters are kept in an arena of blocks that never move, they are found
+// through an open-addressing table of symbols that is one flat array, and
+// temporaries get a number but no characters at all, so the allocations of
+// a table grow with the logarithm of its size
+using symbol = std::int32_t;
+inline constexpr symbol no_symbol = -1;
 
-static inline std::string remove_trailing_space(std::string s) {
-  s.erase(std::find_if(s.rbegin(), s.rend(), [] (char ch) {
-    return !std::isspace(ch);
-  }).base(), s.end());
-  return s;
-}
+class symbol_table {
+ public:
+  symbol_table() = default;
+  symbol_table(symbol_table&&) = default;
+  symbol_table& operator=(symbol_table&&) = default;
+  symbol_table(symbol_table const&) = delete;
+  symbol_table& operator=(symbol_table const&) = delete;
+  symbol intern(std::string_view name)
+  {
+    if (2 * (named_count + 1) > slots.size()) grow();
+    std::size_t const slot = find_slot(name);
+    if (slots[slot] != no_symbol) return slots[slot];
+    symbol const result = symbol(entries.size());
+    entries.push_back({store(name), nullptr});
+    slots[slot] = result;
+    ++named_count;
+    return result;
+  }
+  // prefix must outlive the table, like a string literal
+  symbol temporary(char const* prefix)
+  {
+    symbol const result = symbol(entries.size());
+    entries.push_back({std::string_view(), prefix});
+    return result;
+  }
+  // empty for temporaries
+  std::string_view view(symbol s) const
+  {
+    return entries[std::size_t(s)].name;
+  }
+  std::string name(symbol s) const
+  {
+    if (s == no_symbol) return std::string();
+    auto const& e = entries[std::size_t(s)];
+    if (e.prefix == nullptr) return std::string(e.name);
+    return e.prefix + std::to_string(s);
+  }
+  int size() const { return int(entries.size()); }
+ private:
+  // the slot holding name, or the empty slot where it belongs
+  std::size_t find_slot(std::string_view name) const
+  {
+    std::size_t const mask = slots.size() - 1;
+    std::size_t slot = std::hash<std::string_view>()(name) & mask;
+    while (slots[slot] != no_symbol && entries[std::size_t(slots[slot])].name != name) {
+      slot = (slot + 1) & mask;
+    }
+    return slot;
+  }
+  void grow()
+  {
+    std::vector<symbol> old_slots(std::max(std::size_t(64), 2 * slots.size()), no_symbol);
+    old_slots.swap(slots);
+    for (symbol const s : old_slots) {
+      if (s != no_symbol) slots[find_slot(entries[std::size_t(s)].name)] = s;
+    }
+  }
+  std::string_view store(std::string_view name)
+  {
+    std::size_t const block_size = 4096;
+    if (blocks.empty() || block_used + name.size() > block_capacity) {
+      block_capacity = std::max(block_size, name.size());
+      blocks.emplace_back(new char[block_capacity]);
+      block_used = 0;
+    }
+    char* const destination = blocks.back().get() + block_used;
+    std::memcpy(destination, name.data(), name.size());
+    block_used += name.size();
+    return std::string_view(destination, name.size());
+  }
+  struct entry {
+    std::string_view name;
+    char const* prefix;
+  };
+  std::vector<std::unique_ptr<char[]>> blocks;
+  std::size_t block_used{0};
+  std::size_t block_capacity{0};
+  std::vector<entry> entries;
+  std::vector<symbol> slots;
+  std::size_t named_count{0};
+};
 
 class named_instruction {
  public:
   instruction_code code;
-  std::string result_name;
-  std::string left_name;
-  std::string right_name;
-  double constant;
+  symbol result_name{no_symbol};
+  symbol left_name{no_symbol};
+  symbol right_name{no_symbol};
+  double constant{0.0};
+  int table_index{0};
+};
+
+class printable_instruction {
+ public:
+  named_instruction const& instruction;
+  symbol_table const& symbols;
 };
 
 std::ostream& operator<<(
-    std::ostream& s, named_instruction const& op)
+    std::ostream& s, printable_instruction const& printable)
 {
+  auto const& op = printable.instruction;
+  auto const result_name = printable.symbols.name(op.result_name);
+  auto const left_name = printable.symbols.name(op.left_name);
+  auto const right_name = printable.symbols.name(op.right_name);
   switch (op.code) {
     case instruction_code::copy:
     {
-      s << op.result_name << " = " << op.left_name << '\n';
+      s << result_name << " = " << left_name << '\n';
       break;
     }
     case instruction_code::add:
     {
-      s << op.result_name << " = "
-        << op.left_name << " + "
-        << op.right_name << '\n';
+      s << result_name << " = "
+        << left_name << " + "
+        << right_name << '\n';
       break;
     }
     case instruction_code::subtract:
     {
-      s << op.result_name << " = "
-        << op.left_name << " - "
-        << op.right_name << '\n';
+      s << result_name << " = "
+        << left_name << " - "
+        << right_name << '\n';
       break;
     }
     case instruction_code::multiply:
     {
-      s << op.result_name << " = "
-        << op.left_name << " * "
-        << op.right_name << '\n';
+      s << result_name << " = "
+        << left_name << " * "
+        << right_name << '\n';
       break;
     }
     case instruction_code::divide:
     {
-      s << op.result_name << " = "
-        << op.left_name << " / "
-        << op.right_name << '\n';
+      s << result_name << " = "
+        << left_name << " / "
+        << right_name << '\n';
       break;
     }
     case instruction_code::negate:
     {
-      s << op.result_name << " = -"
-        << op.left_name << '\n';
+      s << result_name << " = -"
+        << left_name << '\n';
       break;
     }
     case instruction_code::assign_constant:
     {
-      s << op.result_name << " = "
+      s << result_name << " = "
         << op.constant << '\n';
       break;
     }
     case instruction_code::sqrt:
     {
-      s << op.result_name << " = sqrt("
-        << op.left_name << ")\n";
+      s << result_name << " = sqrt("
+        << left_name << ")\n";
+      break;
+    }
+    case instruction_code::pow_half:
+    {
+      s << result_name << " = pow("
+        << left_name << ", 0.5)\n";
       break;
     }
     case instruction_code::sin:
     {
-      s << op.result_name << " = sin("
-        << op.left_name << ")\n";
+      s << result_name << " = sin("
+        << left_name << ")\n";
       break;
     }
     case instruction_code::cos:
     {
-      s << op.result_name << " = cos("
-        << op.left_name << ")\n";
+      s << result_name << " = cos("
+        << left_name << ")\n";
       break;
     }
     case instruction_code::exp:
     {
-      s << op.result_name << " = exp("
-        << op.left_name << ")\n";
+      s << result_name << " = exp("
+        << left_name << ")\n";
+      break;
+    }
+    case instruction_code::log:
+    {
+      s << result_name << " = log("
+        << left_name << ")\n";
       break;
     }
     case instruction_code::pow:
     {
-      s << op.result_name << " = pow("
-        << op.left_name << ", "
-        << op.right_name << ")\n";
+      s << result_name << " = pow("
+        << left_name << ", "
+        << right_name << ")\n";
       break;
     }
     case instruction_code::conditional_copy:
     {
-      s << "if (" << op.left_name << ") " << op.result_name << " = " << op.right_name << "\n";
+      s << "if (" << left_name << ") " << result_name << " = " << right_name << "\n";
       break;
     }
     case instruction_code::logical_or:
     {
-      s << op.result_name << " = "
-        << op.left_name << " || "
-        << op.right_name << "\n";
+      s << result_name << " = "
+        << left_name << " || "
+        << right_name << "\n";
       break;
     }
     case instruction_code::logical_and:
     {
-      s << op.result_name << " = "
-        << op.left_name << " && "
-        << op.right_name << "\n";
+      s << result_name << " = "
+        << left_name << " && "
+        << right_name << "\n";
       break;
     }
     case instruction_code::logical_not:
     {
-      s << op.result_name << " = !"
-        << op.left_name << "\n";
+      s << result_name << " = !"
+        << left_name << "\n";
       break;
     }
     case instruction_code::equal:
     {
-      s << op.result_name << " = "
-        << op.left_name << " == "
-        << op.right_name << "\n";
+      s << result_name << " = "
+        << left_name << " == "
+        << right_name << "\n";
       break;
     }
     case instruction_code::not_equal:
     {
-      s << op.result_name << " = "
-        << op.left_name << " != "
-        << op.right_name << "\n";
+      s << result_name << " = "
+        << left_name << " != "
+        << right_name << "\n";
       break;
     }
     case instruction_code::less:
     {
-      s << op.result_name << " = "
-        << op.left_name << " < "
-        << op.right_name << "\n";
+      s << result_name << " = "
+        << left_name << " < "
+        << right_name << "\n";
       break;
     }
     case instruction_code::less_or_equal:
     {
-      s << op.result_name << " = "
-        << op.left_name << " <= "
-        << op.right_name << "\n";
+      s << result_name << " = "
+        << left_name << " <= "
+        << right_name << "\n";
       break;
     }
     case instruction_code::greater:
     {
-      s << op.result_name << " = "
-        << op.left_name << " > "
-        << op.right_name << "\n";
+      s << result_name << " = "
+        << left_name << " > "
+        << right_name << "\n";
       break;
     }
     case instruction_code::greater_or_equal:
     {
-      s << op.result_name << " = "
-        << op.left_name << " >= "
-        << op.right_name << "\n";
+      s << result_name << " = "
+        << left_name << " >= "
+        << right_name << "\n";
+      break;
+    }
+    case instruction_code::min:
+    case instruction_code::max:
+    {
+      s << result_name << " = " << (op.code == instruction_code::min ? "min" : "max")
+        << "(" << left_name << ", " << right_name << ")\n";
+      break;
+    }
+    case instruction_code::abs:
+    {
+      s << result_name << " = abs("
+        << left_name << ")\n";
+      break;
+    }
+    case instruction_code::clamp:
+    {
+      s << result_name << " = clamp("
+        << left_name << ", "
+        << right_name << ", "
+        << result_name << ")\n";
+      break;
+    }
+    case instruction_code::table1d:
+    {
+      s << result_name << " = table1d(#"
+        << op.table_index << ", "
+        << left_name << ")\n";
+      break;
+    }
+    case instruction_code::table2d:
+    {
+      s << result_name << " = table2d(#"
+        << op.table_index << ", "
+        << left_name << ", "
+        << result_name << ")\n";
+      break;
+    }
+    case instruction_code::dot:
+    case instruction_code::cross:
+    {
+      s << result_name << " = " << (op.code == instruction_code::dot ? "dot" : "cross")
+        << "(" << left_name << ", " << right_name << ")\n";
+      break;
+    }
+    case instruction_code::norm:
+    case instruction_code::normalize:
+    {
+      s << result_name << " = " << (op.code == instruction_code::norm ? "norm" : "normalize")
+        << "(" << left_name << ")\n";
+      break;
+    }
+    case instruction_code::operands:
+    {
+      s << "  " << result_name << " (" << left_name << ", " << right_name << ")\n";
       break;
     }
   }
@@ -436,7 +643,7 @@ std::ostream& operator<<(
 std::ostream& operator<<(
     std::ostream& s, instruction const& op)
 {
-  switch (op.code) {
+  switch (primitive_code(op.code)) {
     case instruction_code::copy:
     {
       s << "$" << op.result_register << " = $" << op.input_registers.left << '\n';
@@ -488,6 +695,12 @@ std::ostream& operator<<(
         << op.input_registers.left << ")\n";
       break;
     }
+    case instruction_code::pow_half:
+    {
+      s << "$" << op.result_register << " = pow($"
+        << op.input_registers.left << ", 0.5)\n";
+      break;
+    }
     case instruction_code::sin:
     {
       s << "$" << op.result_register << " = sin($"
@@ -506,6 +719,12 @@ std::ostream& operator<<(
         << op.input_registers.left << ")\n";
       break;
     }
+    case instruction_code::log:
+    {
+      s << "$" << op.result_register << " = log($"
+        << op.input_registers.left << ")\n";
+      break;
+    }
     case instruction_code::pow:
     {
       s << "$" << op.result_register << " = pow($"
@@ -582,6 +801,69 @@ std::ostream& operator<<(
         << op.input_registers.right << "\n";
       break;
     }
+    case instruction_code::min:
+    case instruction_code::max:
+    {
+      s << "$" << op.result_register << " = "
+        << (op.code == instruction_code::min ? "min" : "max") << "($"
+        << op.input_registers.left << ", $"
+        << op.input_registers.right << ")\n";
+      break;
+    }
+    case instruction_code::abs:
+    {
+      s << "$" << op.result_register << " = abs($"
+        << op.input_registers.left << ")\n";
+      break;
+    }
+    case instruction_code::clamp:
+    {
+      s << "$" << op.result_register << " = clamp($"
+        << op.input_registers.left << ", $"
+        << op.input_registers.right << ", $"
+        << op.result_register << ")\n";
+      break;
+    }
+    case instruction_code::table1d:
+    {
+      s << "$" << op.result_register << " = table1d(#"
+        << op.input_registers.right << ", $"
+        << op.input_registers.left << ")\n";
+      break;
+    }
+    case instruction_code::table2d:
+    {
+      s << "$" << op.result_register << " = table2d(#"
+        << op.input_registers.right << ", $"
+        << op.input_registers.left << ", $"
+        << op.result_register << ")\n";
+      break;
+    }
+    case instruction_code::dot:
+    case instruction_code::cross:
+    {
+      s << "$" << op.result_register << " = "
+        << (op.code == instruction_code::dot ? "dot" : "cross") << "($"
+        << op.input_registers.left << ", $"
+        << op.input_registers.right << ")\n";
+      break;
+    }
+    case instruction_code::norm:
+    case instruction_code::normalize:
+    {
+      s << "$" << op.result_register << " = "
+        << (op.code == instruction_code::norm ? "norm" : "normalize") << "($"
+        << op.input_registers.left << ")\n";
+      break;
+    }
+    // -1 marks an operand or result that the instruction does not have
+    case instruction_code::operands:
+    {
+      s << "  $" << op.result_register << " ($"
+        << op.input_registers.left << ", $"
+        << op.input_registers.right << ")\n";
+      break;
+    }
   }
   return s;
 }
@@ -606,159 +888,617 @@ instruction_code binary_operator_code(int p)
   throw parsegen::parse_error("BUG: unexpected binary production");
 }
 
-class parser : public parsegen::parser
+bool is_table_lookup(instruction_code code)
+{
+  return code == instruction_code::table1d || code == instruction_code::table2d;
+}
+
+class named_function {
+ public:
+  symbol_table symbols;
+  std::vector<named_instruction> named_instructions;
+  std::vector<symbol> input_variable_names;
+  std::vector<symbol> output_variable_names;
+  std::vector<table_descriptor> tables;
+  std::vector<double> table_data;
+};
+
+class superinstruction_definition {
+ public:
+  superinstruction fused;
+  std::vector<instruction_code> codes;
+};
+
+#define MATH_BYTECODE_SUPERINSTRUCTION_DEFINITION(name, ...) \
+  {superinstruction::name, {__VA_ARGS__}},
+static std::vector<superinstruction_definition> const superinstruction_definitions = {
+  MATH_BYTECODE_SUPERINSTRUCTIONS(MATH_BYTECODE_SUPERINSTRUCTION_DEFINITION)
+};
+#undef MATH_BYTECODE_SUPERINSTRUCTION_DEFINITION
+
+// gives the first instruction of each sequence that a superinstruction
+// covers the superinstruction's code, trying them in the order listed
+static void fuse_superinstructions(std::vector<instruction>& instructions)
+{
+  std::size_t i = 0;
+  while (i < instructions.size()) {
+    std::size_t covered = 1;
+    for (auto& definition : superinstruction_definitions) {
+      auto const& codes = definition.codes;
+      if (i + codes.size() > instructions.size()) continue;
+      bool matches = true;
+      for (std::size_t j = 0; j < codes.size(); ++j) {
+        matches = matches && instructions[i + j].code == codes[j];
+      }
+      if (matches) {
+        instructions[i].code = superinstruction_code(definition.fused);
+        covered = codes.size();
+        break;
+      }
+    }
+    i += covered;
+  }
+}
+
+class code_generator
 {
  public:
-  parser(bool verbose)
-    :parsegen::parser(
-        parsegen::build_parser_tables(
-          math_bytecode::build_language()))
+  code_generator(named_function&& function, bool verbose, bool pin_inputs_in = false)
+    :symbols(std::move(function.symbols))
+    ,named_instructions(std::move(function.named_instructions))
+    ,input_variable_names(std::move(function.input_variable_names))
+    ,output_variable_names(std::move(function.output_variable_names))
+    ,tables(std::move(function.tables))
+    ,table_data(std::move(function.table_data))
     ,is_verbose(verbose)
+    ,pin_inputs(pin_inputs_in)
   {
   }
-  virtual std::any shift(int token, std::string& text) override
+  host_function generate()
   {
-    switch (token) {
-      case token_identifier: return remove_trailing_space(std::move(text));
-      case token_integer: return std::stoi(text);
-      case token_floating_point: return std::stod(text);
-      case token_else:
-      {
-        named_instruction op;
-        op.code = instruction_code::logical_not;
-        op.result_name = condition_name;
-        op.left_name = condition_name;
-        named_instructions.push_back(op);
-        break;
+    coalesce_copies();
+    if (is_verbose) {
+      for (std::size_t i = 0; i < named_instructions.size(); ++i) {
+        std::cout << i << ": " << printable_instruction{named_instructions[i], symbols};
       }
     }
-    return std::any();
-  }
-  virtual std::any reduce(
-      int production, std::vector<std::any>& rhs) override
-  {
-    switch (production) {
-      case production_program:
-      {
-        if (is_verbose) {
-          for (std::size_t i = 0; i < named_instructions.size(); ++i) {
-            std::cout << i << ": " << named_instructions[i];
-          }
-        }
-        compute_live_ranges();
-        if (is_verbose) {
-          for (auto& lr : live_ranges) {
-            std::cout << lr.name << " at register " << lr.register_assigned
-              << " from " << lr.when_written_to << " to " << lr.when_last_read << '\n';
-          }
-        }
-        generate_instructions();
-        if (is_verbose) {
-          for (std::size_t i = 0; i < instructions.size(); ++i) {
-            std::cout << i << ": " << instructions[i];
-          }
-        }
-        lookup_registers();
-        if (is_verbose) {
-          for (std::size_t i = 0; i < input_registers.size(); ++i) {
-            std::cout << "input variable " << input_variable_names[i] << " at register " << input_registers[i] << '\n';
-          }
-          for (std::size_t i = 0; i < output_registers.size(); ++i) {
-            std::cout << "output variable " << output_variable_names[i] << " at register " << output_registers[i] << '\n';
-          }
-        }
-        break;
+    compute_live_ranges();
+    if (is_verbose) {
+      for (auto& lr : live_ranges) {
+        std::cout << symbols.name(lr.name) << " at register " << lr.register_assigned
+          << " from " << lr.when_written_to << " to " << lr.when_last_read << '\n';
       }
-      case production_input_scalar_parameter:
-      {
-        input_variable_names.push_back(std::any_cast<std::string&&>(std::move(rhs.at(1))));
-        break;
+    }
+    generate_instructions();
+    fuse_superinstructions(instructions);
+    if (is_verbose) {
+      for (std::size_t i = 0; i < instructions.size(); ++i) {
+        std::cout << i << ": " << instructions[i];
       }
-      case production_output_scalar_parameter:
-      {
-        output_variable_names.push_back(std::any_cast<std::string&&>(std::move(rhs.at(2))));
-        break;
+    }
+    lookup_registers();
+    if (is_verbose) {
+      for (std::size_t i = 0; i < input_registers.size(); ++i) {
+        std::cout << "input variable " << symbols.name(input_variable_names[i])
+          << " at register " << input_registers[i] << '\n';
       }
-      case production_array_parameter:
-      {
-        bool const is_const = std::any_cast<bool>(rhs.at(0));
-        int const n = std::any_cast<int>(rhs.at(3));
-        std::string const name(std::any_cast<std::string&&>(std::move(rhs.at(1))));
-        for (int i = 0; i < n; ++i) {
-          if (is_const) {
-            input_variable_names.push_back(name + "[" + std::to_string(i) + "]");
-          } else {
-            output_variable_names.push_back(name + "[" + std::to_string(i) + "]");
-          }
-        }
-        break;
+      for (std::size_t i = 0; i < output_registers.size(); ++i) {
+        std::cout << "output variable " << symbols.name(output_variable_names[i])
+          << " at register " << output_registers[i] << '\n';
       }
-      case production_assign:
-      {
-        handle_assign(
-          std::any_cast<std::string&&>(std::move(rhs.at(0))),
-          std::any_cast<std::string&&>(std::move(rhs.at(2))));
-        break;
+    }
+    return host_function(
+        std::move(instructions),
+        std::move(input_registers),
+        std::move(output_registers),
+        register_count,
+        tables,
+        table_data);
+  }
+ private:
+  // "tmp = a + b; c = tmp;" becomes "c = a + b;" when nothing else reads tmp,
+  // which puts tmp and c in the same register and removes the copy
+  void coalesce_copies()
+  {
+    std::vector<int> read_counts(std::size_t(symbols.size()), 0);
+    for (auto& op : named_instructions) {
+      if (op.left_name != no_symbol) ++read_counts[std::size_t(op.left_name)];
+      if (op.right_name != no_symbol) ++read_counts[std::size_t(op.right_name)];
+      if (reads_result(op.code)) ++read_counts[std::size_t(op.result_name)];
+    }
+    std::vector<bool> is_interface_variable(std::size_t(symbols.size()), false);
+    for (symbol name : input_variable_names) is_interface_variable[std::size_t(name)] = true;
+    for (symbol name : output_variable_names) is_interface_variable[std::size_t(name)] = true;
+    std::vector<named_instruction> coalesced;
+    coalesced.reserve(named_instructions.size());
+    for (auto& op : named_instructions) {
+      if (op.code == instruction_code::copy &&
+          read_counts[std::size_t(op.left_name)] == 1 &&
+          !is_interface_variable[std::size_t(op.left_name)] &&
+          coalesce_copy(coalesced, op)) {
+        continue;
       }
-      case production_declare_assign:
-      {
-        handle_assign(
-          std::any_cast<std::string&&>(std::move(rhs.at(1))),
-          std::any_cast<std::string&&>(std::move(rhs.at(3))));
-        break;
+      coalesced.push_back(op);
+    }
+    named_instructions = std::move(coalesced);
+  }
+  // the writer of the copied value may be up to a vector3 instruction's
+  // width back (one vector component per instruction), as long as the
+  // instructions after it do not touch the destination
+  static bool coalesce_copy(std::vector<named_instruction>& coalesced, named_instruction const& copy)
+  {
+    std::size_t const window = std::min(coalesced.size(), std::size_t(3));
+    for (std::size_t back = 1; back <= window; ++back) {
+      auto& writer = coalesced[coalesced.size() - back];
+      if (writer.result_name == copy.left_name) {
+        if (reads_result(writer.code)) return false;
+        writer.result_name = copy.result_name;
+        return true;
       }
-      case production_if:
-      case production_if_else:
-      {
-        is_inside_conditional = false;
-        break;
+      if (writer.result_name == copy.result_name ||
+          writer.left_name == copy.result_name ||
+          writer.right_name == copy.result_name) {
+        return false;
       }
-      case production_if_header:
-      {
-        if (is_inside_conditional) {
-          throw parsegen::parse_error(
-              "nested if/else blocks are not supported");
-        }
-        condition_name =
-          std::any_cast<std::string&&>(std::move(rhs.at(2)));
-        is_inside_conditional = true;
-        break;
+    }
+    return false;
+  }
+  struct live_range {
+    symbol name;
+    int when_written_to;
+    int when_last_read;
+    int register_assigned;
+  };
+  // ranges are created in the order they are written, so the latest range
+  // of a name is the one a read extends
+  int update_live_ranges_for_read(std::size_t i, symbol name)
+  {
+    int& latest = latest_live_range[std::size_t(name)];
+    if (latest < 0) {
+      latest = int(live_ranges.size());
+      live_range lr;
+      lr.name = name;
+      lr.when_written_to = -1;
+      lr.when_last_read = int(i);
+      live_ranges.push_back(lr);
+    } else {
+      live_ranges[std::size_t(latest)].when_last_read = int(i);
+    }
+    return latest;
+  }
+  void compute_live_ranges()
+  {
+    latest_live_range.assign(std::size_t(symbols.size()), -1);
+    live_ranges.reserve(named_instructions.size() + input_variable_names.size());
+    operand_ranges.resize(named_instructions.size());
+    for (std::size_t i = 0; i < named_instructions.size(); ++i) {
+      auto& op = named_instructions[i];
+      auto& ranges = operand_ranges[i];
+      if (op.left_name != no_symbol) {
+        ranges.left = update_live_ranges_for_read(i, op.left_name);
       }
-      case production_variable:
-      {
-        return std::move(rhs.at(0));
+      if (op.right_name != no_symbol) {
+        ranges.right = update_live_ranges_for_read(i, op.right_name);
       }
-      case production_array_entry:
-      {
-        auto array_name = std::any_cast<std::string&&>(std::move(rhs.at(0)));
-        auto index = std::any_cast<int>(rhs.at(2));
-        auto entry_name = array_name + "[" + std::to_string(index) + "]";
-        return entry_name;
+      // the operands of a vector3 instruction with a scalar result
+      if (op.result_name == no_symbol) continue;
+      bool const is_conditional_assign_to_existing =
+        reads_result(op.code) && latest_live_range[std::size_t(op.result_name)] >= 0;
+      if (is_conditional_assign_to_existing) {
+        // the old value survives when the condition is false
+        // (or is the y coordinate of a table2d lookup)
+        ranges.result = update_live_ranges_for_read(i, op.result_name);
+        continue;
       }
-      case production_sum_or_difference:
-      case production_product_or_quotient:
-      case production_decay_to_negation:
-      case production_decay_to_exponentiation:
-      case production_decay_to_leaf:
-      case production_decay_to_or:
-      case production_decay_to_and:
-      case production_decay_to_not:
-      case production_decay_to_relational:
-      case production_read:
-      {
-        return std::move(rhs.at(0));
+      ranges.result = int(live_ranges.size());
+      latest_live_range[std::size_t(op.result_name)] = int(live_ranges.size());
+      live_range result_live_range;
+      result_live_range.name = op.result_name;
+      result_live_range.when_written_to = int(i);
+      result_live_range.when_last_read = -2;
+      live_ranges.push_back(result_live_range);
+    }
+    // only the last value written to an output lives to the end
+    for (symbol output_variable_name : output_variable_names) {
+      int const last_range = latest_live_range[std::size_t(output_variable_name)];
+      if (last_range >= 0 && live_ranges[std::size_t(last_range)].when_written_to >= 0) {
+        live_ranges[std::size_t(last_range)].when_last_read = int(named_instructions.size());
       }
-      case production_subexpression:
-      {
+    }
+    assign_registers();
+  }
+  void assign_registers()
+  {
+    std::vector<live_range*> by_write;
+    by_write.reserve(live_ranges.size());
+    for (auto& lr : live_ranges) by_write.push_back(&lr);
+    std::stable_sort(by_write.begin(), by_write.end(),
+        [] (live_range const* a, live_range const* b) {
+          return a->when_written_to < b->when_written_to;
+        });
+    std::vector<live_range*> active;
+    std::vector<int> free_registers;
+    // pinned inputs take the first registers in declaration order, and
+    // those of inputs that are never read are free from the start
+    std::vector<int> pinned_registers(std::size_t(symbols.size()), -1);
+    if (pin_inputs) {
+      std::vector<bool> is_read_on_entry(std::size_t(symbols.size()), false);
+      for (auto& lr : live_ranges) {
+        if (lr.when_written_to == -1) is_read_on_entry[std::size_t(lr.name)] = true;
+      }
+      register_count = int(input_variable_names.size());
+      for (int r = register_count - 1; r >= 0; --r) {
+        symbol const name = input_variable_names[std::size_t(r)];
+        pinned_registers[std::size_t(name)] = r;
+        if (!is_read_on_entry[std::size_t(name)]) free_registers.push_back(r);
+      }
+    }
+    for (live_range* range : by_write) {
+      auto& i = *range;
+      for (std::size_t j = 0; j < active.size();) {
+        if (i.when_written_to >= 0 && i.when_written_to < int(named_instructions.size())
+            && reads_result(named_instructions.at(i.when_written_to).code)) {
+          if (active[j]->when_last_read == i.when_written_to) {
+            ++j;
+            continue;
+          }
+        }
+        if (active[j]->when_last_read > i.when_written_to) {
+          ++j;
+          continue;
+        }
+        free_registers.push_back(active[j]->register_assigned);
+        active.erase(active.begin() + j);
+      }
+      if (i.when_written_to == -1 && pinned_registers[std::size_t(i.name)] >= 0) {
+        i.register_assigned = pinned_registers[std::size_t(i.name)];
+      } else {
+        if (free_registers.empty()) {
+          free_registers.push_back(register_count++);
+        }
+        i.register_assigned = free_registers.back();
+        free_registers.pop_back();
+      }
+      active.insert(
+          std::upper_bound(
+            active.begin(),
+            active.end(),
+            &i,
+            [] (live_range* a, live_range* b) {
+              return a->when_last_read < b->when_last_read;
+            }),
+          &i);
+    }
+  }
+  void generate_instructions()
+  {
+    instructions.resize(named_instructions.size());
+    for (std::size_t i = 0; i < instructions.size(); ++i) {
+      instructions[i].code = named_instructions[i].code;
+      if (named_instructions[i].code == instruction_code::assign_constant) {
+        instructions[i].constant = named_instructions[i].constant;
+      }
+      if (is_table_lookup(named_instructions[i].code)) {
+        instructions[i].input_registers.right = named_instructions[i].table_index;
+      }
+    }
+    for (std::size_t i = 0; i < instructions.size(); ++i) {
+      auto const& ranges = operand_ranges[i];
+      if (instructions[i].code == instruction_code::operands) {
+        instructions[i].result_register = -1;
+        instructions[i].input_registers.left = -1;
+        instructions[i].input_registers.right = -1;
+      }
+      if (ranges.result >= 0) {
+        instructions[i].result_register = live_ranges[std::size_t(ranges.result)].register_assigned;
+      }
+      if (ranges.left >= 0) {
+        instructions[i].input_registers.left = live_ranges[std::size_t(ranges.left)].register_assigned;
+      }
+      if (ranges.right >= 0) {
+        instructions[i].input_registers.right = live_ranges[std::size_t(ranges.right)].register_assigned;
+      }
+    }
+  }
+  int get_input_register(symbol name) const
+  {
+    for (auto& lr : live_ranges) {
+      if (lr.name == name && lr.when_written_to == -1) {
+        return lr.register_assigned;
+      }
+    }
+    if (pin_inputs) {
+      auto const it = std::find(input_variable_names.cbegin(), input_variable_names.cend(), name);
+      return int(it - input_variable_names.cbegin());
+    }
+    return -1;
+  }
+  int get_output_register(symbol name) const
+  {
+    for (auto& lr : live_ranges) {
+      if (lr.name == name && lr.when_last_read == int(instructions.size())) {
+        return lr.register_assigned;
+      }
+    }
+    throw parsegen::parse_error(
+        "function does not set required output variable " +
+        symbols.name(name));
+  }
+  void lookup_registers()
+  {
+    for (symbol input_name : input_variable_names) {
+      input_registers.push_back(get_input_register(input_name));
+    }
+    for (symbol output_name : output_variable_names) {
+      output_registers.push_back(get_output_register(output_name));
+    }
+  }
+  symbol_table symbols;
+  std::vector<named_instruction> named_instructions;
+  std::vector<symbol> input_variable_names;
+  std::vector<symbol> output_variable_names;
+  std::vector<table_descriptor> tables;
+  std::vector<double> table_data;
+  std::vector<instruction> instructions;
+  std::vector<live_range> live_ranges;
+  std::vector<int> latest_live_range;
+  // the live range each instruction writes and reads
+  struct instruction_ranges {
+    int result{-1};
+    int left{-1};
+    int right{-1};
+  };
+  std::vector<instruction_ranges> operand_ranges;
+  int register_count{0};
+  std::vector<int> input_registers;
+  std::vector<int> output_registers;
+  bool is_verbose;
+  bool pin_inputs;
+};
+
+static double evaluate_constant(
+    named_instruction const& op,
+    double left,
+    double right,
+    double old_result,
+    execution_context<double> const& context)
+{
+  instruction in;
+  in.code = op.code;
+  in.result_register = 0;
+  in.input_registers.left = 1;
+  in.input_registers.right = is_table_lookup(op.code) ? op.table_index : 2;
+  double registers[3] = {old_result, left, right};
+  in.execute(registers, context);
+  return registers[0];
+}
+
+// codes whose constant value does not depend on the math_accuracy or the
+// tables of a function, so they can be folded before either is known
+static bool is_exact_arithmetic(instruction_code code)
+{
+  switch (code) {
+    case instruction_code::copy:
+    case instruction_code::negate:
+    case instruction_code::add:
+    case instruction_code::subtract:
+    case instruction_code::multiply:
+    case instruction_code::divide:
+    case instruction_code::logical_or:
+    case instruction_code::logical_and:
+    case instruction_code::logical_not:
+    case instruction_code::equal:
+    case instruction_code::not_equal:
+    case instruction_code::less:
+    case instruction_code::less_or_equal:
+    case instruction_code::greater:
+    case instruction_code::greater_or_equal:
+    case instruction_code::min:
+    case instruction_code::max:
+    case instruction_code::abs:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// the tables are built once and only read afterwards, so parsers on
+// different threads can share them
+static parsegen::parser_tables_ptr get_parser_tables()
+{
+  static parsegen::parser_tables_ptr const tables =
+    parsegen::build_parser_tables(math_bytecode::build_language());
+  return tables;
+}
+
+class parser : public parsegen::parser
+{
+ public:
+  parser(compile_options const& options)
+    :parsegen::parser(get_parser_tables())
+    ,available_tables(options.tables)
+    ,is_verbose(options.verbose)
+    ,pin_inputs(options.pin_inputs)
+  {
+  }
+  virtual std::any shift(int token, std::string& text) override
+  {
+    switch (token) {
+      case token_identifier:
+      {
+        auto const end = std::find_if(text.begin(), text.end(), [] (char ch) {
+          return !(std::isalnum(static_cast<unsigned char>(ch)) || ch == '_');
+        });
+        return symbols.intern(std::string_view(text.data(), std::size_t(end - text.begin())));
+      }
+      case token_integer: return std::stoi(text);
+      case token_floating_point: return std::stod(text);
+      case token_else:
+      {
+        named_instruction op;
+        op.code = instruction_code::logical_not;
+        op.result_name = condition_name;
+        op.left_name = condition_name;
+        named_instructions.push_back(op);
+        break;
+      }
+    }
+    return std::any();
+  }
+  virtual std::any reduce(
+      int production, std::vector<std::any>& rhs) override
+  {
+    switch (production) {
+      case production_program:
+      {
+        named_function result;
+        result.symbols = std::move(symbols);
+        result.named_instructions = std::move(named_instructions);
+        result.input_variable_names = std::move(input_variable_names);
+        result.output_variable_names = std::move(output_variable_names);
+        result.tables = std::move(tables);
+        result.table_data = std::move(table_data);
+        function = code_generator(std::move(result), is_verbose, pin_inputs).generate();
+        break;
+      }
+      case production_input_scalar_parameter:
+      {
+        input_variable_names.push_back(std::any_cast<symbol>(rhs.at(1)));
+        break;
+      }
+      case production_output_scalar_parameter:
+      {
+        output_variable_names.push_back(std::any_cast<symbol>(rhs.at(2)));
+        break;
+      }
+      case production_array_parameter:
+      {
+        bool const is_const = std::any_cast<bool>(rhs.at(0));
+        int const n = std::any_cast<int>(rhs.at(3));
+        symbol const name = std::any_cast<symbol>(rhs.at(1));
+        for (int i = 0; i < n; ++i) {
+          if (is_const) {
+            input_variable_names.push_back(array_entry(name, i));
+          } else {
+            output_variable_names.push_back(array_entry(name, i));
+          }
+        }
+        break;
+      }
+      case production_assign:
+      {
+        handle_assign(
+          std::any_cast<symbol>(rhs.at(0)),
+          std::any_cast<symbol>(rhs.at(2)));
+        break;
+      }
+      case production_declare_assign:
+      {
+        handle_assign(
+          std::any_cast<symbol>(rhs.at(1)),
+          std::any_cast<symbol>(rhs.at(3)));
+        break;
+      }
+      case production_if:
+      case production_if_else:
+      {
+        is_inside_conditional = false;
+        break;
+      }
+      case production_if_header:
+      {
+        if (is_inside_conditional) {
+          throw parsegen::parse_error(
+              "nested if/else blocks are not supported");
+        }
+        condition_name =
+          std::any_cast<symbol>(rhs.at(2));
+        is_inside_conditional = true;
+        break;
+      }
+      case production_for_header:
+      {
+        symbol const variable = std::any_cast<symbol>(rhs.at(3));
+        if (std::any_cast<symbol>(rhs.at(7)) != variable ||
+            std::any_cast<symbol>(rhs.at(11)) != variable) {
+          throw parsegen::parse_error("a for loop has to test and increment its own variable");
+        }
+        for (auto const& enclosing : loops) {
+          if (enclosing.variable == variable) {
+            throw parsegen::parse_error("nested for loops need different variables");
+          }
+        }
+        loops.push_back({variable, std::any_cast<int>(rhs.at(5)),
+            std::any_cast<int>(rhs.at(9)), named_instructions.size()});
+        break;
+      }
+      case production_for:
+      {
+        unroll(loops.back());
+        loops.pop_back();
+        break;
+      }
+      case production_prefix_increment:
+      {
+        return std::move(rhs.at(1));
+      }
+      case production_postfix_increment:
+      {
+        return std::move(rhs.at(0));
+      }
+      // named like "x[i]" until the loop over i is unrolled
+      case production_indexed_array_entry:
+      {
+        symbol const array = std::any_cast<symbol>(rhs.at(0));
+        symbol const index = std::any_cast<symbol>(rhs.at(2));
+        if (std::none_of(loops.begin(), loops.end(),
+              [&] (loop const& enclosing) { return enclosing.variable == index; })) {
+          throw parsegen::parse_error(
+              "arrays can only be indexed by integers or the variables of enclosing for loops");
+        }
+        entry_name.assign(symbols.view(array));
+        entry_name.append("[").append(symbols.view(index)).append("]");
+        return symbols.intern(entry_name);
+      }
+      case production_variable:
+      {
+        return std::move(rhs.at(0));
+      }
+      case production_array_entry:
+      {
+        return array_entry(
+            std::any_cast<symbol>(rhs.at(0)),
+            std::any_cast<int>(rhs.at(2)));
+      }
+      case production_sum_or_difference:
+      case production_product_or_quotient:
+      case production_decay_to_negation:
+      case production_decay_to_exponentiation:
+      case production_decay_to_leaf:
+      case production_decay_to_or:
+      case production_decay_to_and:
+      case production_decay_to_not:
+      case production_decay_to_relational:
+      case production_read:
+      {
+        return std::move(rhs.at(0));
+      }
+      case production_subexpression:
+      {
         return std::move(rhs.at(1));
       }
       case production_unary_call:
       {
+        auto const function_name = symbols.view(std::any_cast<symbol>(rhs.at(0)));
+        if (function_name == "norm" || function_name == "normalize") {
+          bool const is_norm = function_name == "norm";
+          auto const result = is_norm ? get_temporary() : get_vector_temporary();
+          handle_vector_call(
+              is_norm ? instruction_code::norm : instruction_code::normalize,
+              result, vector_argument(rhs.at(2)), no_symbol);
+          return result;
+        }
         auto result = get_temporary();
-        auto function_name =
-          remove_trailing_space(
-              std::any_cast<std::string&&>(
-                std::move(rhs.at(0))));
         named_instruction op;
         op.result_name = result;
         if (function_name == "sqrt") {
@@ -769,35 +1509,101 @@ class parser : public parsegen::parser
           op.code = instruction_code::cos;
         } else if (function_name == "exp") {
           op.code = instruction_code::exp;
+        } else if (function_name == "log") {
+          op.code = instruction_code::log;
+        } else if (function_name == "abs") {
+          op.code = instruction_code::abs;
         } else {
           throw parsegen::parse_error("unknown unary function name");
         }
         op.left_name =
-          std::any_cast<std::string&&>(
-              std::move(rhs.at(2)));
+          std::any_cast<symbol>(rhs.at(2));
         named_instructions.push_back(op);
         return result;
       }
       case production_binary_call:
       {
+        auto const function_name = symbols.view(std::any_cast<symbol>(rhs.at(0)));
+        if (function_name == "dot" || function_name == "cross") {
+          bool const is_dot = function_name == "dot";
+          auto const result = is_dot ? get_temporary() : get_vector_temporary();
+          handle_vector_call(
+              is_dot ? instruction_code::dot : instruction_code::cross,
+              result, vector_argument(rhs.at(2)), vector_argument(rhs.at(4)));
+          return result;
+        }
         auto result = get_temporary();
-        auto function_name =
-          remove_trailing_space(
-              std::any_cast<std::string&&>(
-                std::move(rhs.at(0))));
         named_instruction op;
         op.result_name = result;
+        if (function_name == "table1d") {
+          op.code = instruction_code::table1d;
+          op.table_index = get_table_index(
+              std::any_cast<symbol>(rhs.at(2)), false);
+          op.left_name =
+            std::any_cast<symbol>(rhs.at(4));
+          named_instructions.push_back(op);
+          return result;
+        }
         if (function_name == "pow") {
           op.code = instruction_code::pow;
+        } else if (function_name == "min") {
+          op.code = instruction_code::min;
+        } else if (function_name == "max") {
+          op.code = instruction_code::max;
         } else {
           throw parsegen::parse_error("unknown binary function name");
         }
         op.left_name =
-          std::any_cast<std::string&&>(
-              std::move(rhs.at(2)));
+          std::any_cast<symbol>(rhs.at(2));
         op.right_name =
-          std::any_cast<std::string&&>(
-              std::move(rhs.at(4)));
+          std::any_cast<symbol>(rhs.at(4));
+        named_instructions.push_back(op);
+        return result;
+      }
+      case production_ternary_call:
+      {
+        auto result = get_temporary();
+        auto const function_name = symbols.view(std::any_cast<symbol>(rhs.at(0)));
+        if (function_name == "clamp") {
+          // the upper bound goes into the result register, which clamp reads
+          handle_copy(result, std::any_cast<symbol>(rhs.at(6)));
+          named_instruction op;
+          op.code = instruction_code::clamp;
+          op.result_name = result;
+          op.left_name = std::any_cast<symbol>(rhs.at(2));
+          op.right_name = std::any_cast<symbol>(rhs.at(4));
+          named_instructions.push_back(op);
+          return result;
+        }
+        if (function_name != "table2d") {
+          throw parsegen::parse_error("unknown ternary function name");
+        }
+        // y goes into the result register, which table2d reads
+        handle_copy(result, std::any_cast<symbol>(rhs.at(6)));
+        named_instruction op;
+        op.code = instruction_code::table2d;
+        op.result_name = result;
+        op.table_index = get_table_index(
+            std::any_cast<symbol>(rhs.at(2)), true);
+        op.left_name =
+          std::any_cast<symbol>(rhs.at(4));
+        named_instructions.push_back(op);
+        return result;
+      }
+      // select(c, a, b) is c ? a : b, a blend of b with a
+      case production_select_call:
+      {
+        auto const function_name = symbols.view(std::any_cast<symbol>(rhs.at(0)));
+        if (function_name != "select") {
+          throw parsegen::parse_error("only select takes a condition as an argument");
+        }
+        auto result = get_temporary();
+        handle_copy(result, std::any_cast<symbol>(rhs.at(6)));
+        named_instruction op;
+        op.code = instruction_code::conditional_copy;
+        op.result_name = result;
+        op.left_name = std::any_cast<symbol>(rhs.at(2));
+        op.right_name = std::any_cast<symbol>(rhs.at(4));
         named_instructions.push_back(op);
         return result;
       }
@@ -819,8 +1625,8 @@ class parser : public parsegen::parser
         named_instruction op;
         op.code = binary_operator_code(production);
         op.result_name = result;
-        op.left_name = std::any_cast<std::string&&>(std::move(rhs.at(0)));
-        op.right_name = std::any_cast<std::string&&>(std::move(rhs.at(2)));
+        op.left_name = std::any_cast<symbol>(rhs.at(0));
+        op.right_name = std::any_cast<symbol>(rhs.at(2));
         named_instructions.push_back(op);
         return result;
       }
@@ -830,7 +1636,7 @@ class parser : public parsegen::parser
         named_instruction op;
         op.code = instruction_code::negate;
         op.result_name = result;
-        op.left_name = std::any_cast<std::string&&>(std::move(rhs.at(1)));
+        op.left_name = std::any_cast<symbol>(rhs.at(1));
         named_instructions.push_back(op);
         return result;
       }
@@ -840,7 +1646,7 @@ class parser : public parsegen::parser
         named_instruction op;
         op.code = instruction_code::logical_not;
         op.result_name = result;
-        op.left_name = std::any_cast<std::string&&>(std::move(rhs.at(1)));
+        op.left_name = std::any_cast<symbol>(rhs.at(1));
         named_instructions.push_back(op);
         return result;
       }
@@ -885,210 +1691,1903 @@ class parser : public parsegen::parser
   }
   host_function get_function()
   {
-    return host_function(
-        std::move(instructions),
-        std::move(input_registers),
-        std::move(output_registers),
-        register_count);
+    return std::move(function);
   }
  private:
-  std::string get_temporary()
+  // the body of a for loop starts at first_instruction
+  class loop {
+   public:
+    symbol variable;
+    int first;
+    int last;
+    std::size_t first_instruction;
+  };
+  symbol get_temporary()
+  {
+    return symbols.temporary("tmp");
+  }
+  // the name of entry i of an array, like "x[1]"
+  symbol array_entry(symbol array, int i)
   {
-    return std::string("tmp") + std::to_string(++next_temporary);
+    auto const array_name = symbols.view(array);
+    char buffer[32];
+    int const suffix_length = std::snprintf(buffer, sizeof(buffer), "[%d]", i);
+    entry_name.assign(array_name.data(), array_name.size());
+    entry_name.append(buffer, std::size_t(suffix_length));
+    return symbols.intern(entry_name);
   }
-  void handle_assign(std::string const& destination, std::string const& source)
+  void handle_copy(symbol destination, symbol source)
   {
     named_instruction op;
-    if (is_inside_conditional) {
-      op.code = instruction_code::conditional_copy;
-      op.result_name = destination;
-      op.left_name = condition_name;
-      op.right_name = source;
-    } else {
-      op.code = instruction_code::copy;
-      op.result_name = destination;
-      op.left_name = source;
-    }
+    op.code = instruction_code::copy;
+    op.result_name = destination;
+    op.left_name = source;
     named_instructions.push_back(op);
   }
-  struct live_range {
-    std::string name;
-    int when_written_to;
-    int when_last_read;
-    int register_assigned;
-  };
-  void update_live_ranges_for_read(std::size_t i, std::string const& name)
+  // the arguments of the vector3 functions name arrays of three values,
+  // which may be the results of cross or normalize
+  symbol vector_argument(std::any const& argument)
   {
-    live_range* found_range = nullptr;
-    for (auto& lr : live_ranges) {
-      if (lr.name == name) {
-        if (found_range == nullptr ||
-            found_range->when_written_to < lr.when_written_to) {
-          found_range = &lr;
-        }
+    symbol const name = std::any_cast<symbol>(argument);
+    auto const view = symbols.view(name);
+    if (view.empty() || view.back() == ']') {
+      throw parsegen::parse_error("vector3 functions take the names of arrays of three values");
+    }
+    return name;
+  }
+  // names no identifier can have, for the arrays that cross and normalize return
+  symbol get_vector_temporary()
+  {
+    char buffer[32];
+    int const length = std::snprintf(buffer, sizeof(buffer), "$vector%d", ++vector_temporary_count);
+    return symbols.intern(std::string_view(buffer, std::size_t(length)));
+  }
+  bool is_vector_temporary(symbol name) const
+  {
+    auto const view = symbols.view(name);
+    return !view.empty() && view.front() == '$' && view.back() != ']';
+  }
+  void handle_vector_call(instruction_code code, symbol result, symbol left, symbol right)
+  {
+    bool const has_vector_result =
+      code == instruction_code::cross || code == instruction_code::normalize;
+    for (int k = 0; k < 3; ++k) {
+      named_instruction op;
+      op.code = k == 0 ? code : instruction_code::operands;
+      if (has_vector_result) {
+        op.result_name = array_entry(result, k);
+      } else if (k == 0) {
+        op.result_name = result;
       }
+      op.left_name = array_entry(left, k);
+      if (right != no_symbol) op.right_name = array_entry(right, k);
+      named_instructions.push_back(op);
     }
-    if (found_range == nullptr) {
-      live_range lr;
-      lr.name = name;
-      lr.when_written_to = -1;
-      lr.when_last_read = int(i);
-      live_ranges.push_back(lr);
-    } else {
-      found_range->when_last_read = int(i);
+  }
+  void handle_assign(symbol destination, symbol source)
+  {
+    if (is_vector_temporary(source)) {
+      if (symbols.view(destination).empty() || symbols.view(destination).back() == ']') {
+        throw parsegen::parse_error("the result of a vector3 function needs an array of three values");
+      }
+      for (int k = 0; k < 3; ++k) {
+        handle_assign(array_entry(destination, k), array_entry(source, k));
+      }
+      return;
+    }
+    if (!is_inside_conditional) {
+      handle_copy(destination, source);
+      return;
     }
+    named_instruction op;
+    op.code = instruction_code::conditional_copy;
+    op.result_name = destination;
+    op.left_name = condition_name;
+    op.right_name = source;
+    named_instructions.push_back(op);
   }
-  void compute_live_ranges()
+  // the body is repeated once per value of the variable, whose reads become
+  // reads of a constant. Temporaries written in the body get new names in
+  // each repetition, and entries indexed by the variable become real entries.
+  // Arithmetic on the index and literals is folded in each repetition, and
+  // the constants left unread are dropped
+  void unroll(loop const& unrolled)
   {
-    for (std::size_t i = 0; i < named_instructions.size(); ++i) {
-      auto& op = named_instructions[i];
-      if (!op.left_name.empty()) {
-        update_live_ranges_for_read(i, op.left_name);
+    auto const body_begin = named_instructions.begin() + std::ptrdiff_t(unrolled.first_instruction);
+    std::vector<named_instruction> const body(body_begin, named_instructions.end());
+    named_instructions.erase(body_begin, named_instructions.end());
+    std::size_t const symbol_count = std::size_t(symbols.size());
+    std::vector<bool> is_local(symbol_count, false);
+    for (auto const& op : body) {
+      if (op.result_name == unrolled.variable) {
+        throw parsegen::parse_error("the variable of a for loop cannot be assigned to");
       }
-      if (!op.right_name.empty()) {
-        update_live_ranges_for_read(i, op.right_name);
+      if (op.result_name != no_symbol && symbols.view(op.result_name).empty()) {
+        is_local[std::size_t(op.result_name)] = true;
       }
-      bool is_conditional_assign_to_existing = false;
-      if (op.code == instruction_code::conditional_copy) {
-        for (auto& lr : live_ranges) {
-          if (lr.name == op.result_name) {
-            is_conditional_assign_to_existing = true;
-          }
+    }
+    std::string const suffix = "[" + std::string(symbols.view(unrolled.variable)) + "]";
+    std::vector<symbol> renamed(symbol_count);
+    std::vector<named_instruction> repetition;
+    for (int value = unrolled.first; value < unrolled.last; ++value) {
+      std::fill(renamed.begin(), renamed.end(), no_symbol);
+      repetition.clear();
+      auto const index = get_temporary();
+      named_instruction assign_index;
+      assign_index.code = instruction_code::assign_constant;
+      assign_index.result_name = index;
+      assign_index.constant = double(value);
+      repetition.push_back(assign_index);
+      renamed[std::size_t(unrolled.variable)] = index;
+      auto rename = [&] (symbol name) {
+        if (name == no_symbol) return name;
+        symbol& new_name = renamed[std::size_t(name)];
+        if (new_name != no_symbol) return new_name;
+        new_name = name;
+        auto const view = symbols.view(name);
+        if (is_local[std::size_t(name)]) {
+          new_name = get_temporary();
+        } else if (view.size() > suffix.size() &&
+            view.substr(view.size() - suffix.size()) == suffix) {
+          new_name = array_entry(symbols.intern(view.substr(0, view.size() - suffix.size())), value);
         }
+        return new_name;
+      };
+      for (auto op : body) {
+        op.result_name = rename(op.result_name);
+        op.left_name = rename(op.left_name);
+        op.right_name = rename(op.right_name);
+        repetition.push_back(op);
       }
-      if (is_conditional_assign_to_existing) continue;
-      live_range result_live_range;
-      result_live_range.name = op.result_name;
-      result_live_range.when_written_to = int(i);
-      result_live_range.when_last_read = -2;
-      for (auto& output_variable_name : output_variable_names) {
-        if (op.result_name == output_variable_name) {
-          result_live_range.when_last_read = int(named_instructions.size());
-          break;
-        }
+      fold_repetition(repetition, index);
+    }
+  }
+  // the temporaries created from first_temporary on belong to this
+  // repetition, so nothing outside of it reads them
+  void fold_repetition(std::vector<named_instruction>& repetition, symbol first_temporary)
+  {
+    std::size_t const symbol_count = std::size_t(symbols.size());
+    std::vector<bool> known(symbol_count, false);
+    std::vector<double> values(symbol_count, 0.0);
+    auto const is_known = [&] (symbol name) {
+      return name == no_symbol || known[std::size_t(name)];
+    };
+    auto const value = [&] (symbol name) {
+      return name == no_symbol ? 0.0 : values[std::size_t(name)];
+    };
+    execution_context<double> const context;
+    for (std::size_t i = 0; i < repetition.size();) {
+      auto& op = repetition[i];
+      std::size_t const width = std::size_t(instruction_width(op.code));
+      if (width == 1 && is_exact_arithmetic(op.code) &&
+          is_known(op.left_name) && is_known(op.right_name)) {
+        op.constant = evaluate_constant(op, value(op.left_name), value(op.right_name), 0.0, context);
+        op.code = instruction_code::assign_constant;
+        op.left_name = no_symbol;
+        op.right_name = no_symbol;
       }
-      live_ranges.push_back(result_live_range);
+      for (std::size_t j = i; j < i + width; ++j) {
+        auto const& written = repetition[j];
+        if (written.result_name == no_symbol) continue;
+        known[std::size_t(written.result_name)] =
+          written.code == instruction_code::assign_constant;
+        values[std::size_t(written.result_name)] = written.constant;
+      }
+      i += width;
     }
-    std::sort(live_ranges.begin(), live_ranges.end(),
-        [] (live_range const& a, live_range const& b) {
-          return a.when_written_to < b.when_written_to;
-        });
-    assign_registers();
+    std::vector<bool> is_read(symbol_count, false);
+    std::vector<named_instruction> kept;
+    for (auto it = repetition.rbegin(); it != repetition.rend(); ++it) {
+      if (it->code == instruction_code::assign_constant &&
+          it->result_name >= first_temporary && symbols.view(it->result_name).empty() &&
+          !is_read[std::size_t(it->result_name)]) {
+        continue;
+      }
+      if (it->left_name != no_symbol) is_read[std::size_t(it->left_name)] = true;
+      if (it->right_name != no_symbol) is_read[std::size_t(it->right_name)] = true;
+      if (reads_result(it->code)) is_read[std::size_t(it->result_name)] = true;
+      kept.push_back(*it);
+    }
+    named_instructions.insert(named_instructions.end(), kept.rbegin(), kept.rend());
   }
-  void assign_registers()
+  // appends the table to the data pool the first time it is used
+  int get_table_index(symbol table_symbol, bool is_two_dimensional)
   {
-    std::vector<live_range*> active;
-    std::vector<int> free_registers;
-    for (auto& i : live_ranges) {
-      for (std::size_t j = 0; j < active.size();) {
-        if (i.when_written_to >= 0 && i.when_written_to < int(named_instructions.size())
-            && named_instructions.at(i.when_written_to).code == instruction_code::conditional_copy) {
-          if (active[j]->when_last_read == i.when_written_to) {
-            ++j;
-            continue;
-          }
-        }
-        if (active[j]->when_last_read > i.when_written_to) {
-          ++j;
-          continue;
-        }
-        free_registers.push_back(active[j]->register_assigned);
-        active.erase(active.begin() + j);
+    auto const found_index = table_indices.find(table_symbol);
+    if (found_index != table_indices.end()) {
+      if ((tables[std::size_t(found_index->second)].y_count > 0) != is_two_dimensional) {
+        throw parsegen::parse_error(
+            "table " + std::string(symbols.view(table_symbol)) + " used with the wrong dimension");
+      }
+      return found_index->second;
+    }
+    std::string const name(symbols.view(table_symbol));
+    auto const found_table = available_tables.find(name);
+    if (found_table == available_tables.end()) {
+      throw parsegen::parse_error("unknown table " + name);
+    }
+    auto const& data = found_table->second;
+    if (data.y.empty() == is_two_dimensional) {
+      throw parsegen::parse_error("table " + name + " used with the wrong dimension");
+    }
+    std::size_t const y_count = is_two_dimensional ? data.y.size() : 1;
+    if (data.values.size() != data.x.size() * y_count) {
+      throw parsegen::parse_error("table " + name + " has the wrong number of values");
+    }
+    table_descriptor descriptor;
+    descriptor.offset = std::int32_t(table_data.size());
+    descriptor.x_count = std::int32_t(data.x.size());
+    descriptor.y_count = is_two_dimensional ? std::int32_t(data.y.size()) : 0;
+    descriptor.method = data.method;
+    append_table_axis(name, data.x);
+    if (is_two_dimensional) append_table_axis(name, data.y);
+    table_data.insert(table_data.end(), data.values.begin(), data.values.end());
+    int const index = int(tables.size());
+    tables.push_back(descriptor);
+    table_indices[table_symbol] = index;
+    return index;
+  }
+  void append_table_axis(std::string const& name, std::vector<double> const& axis)
+  {
+    if (axis.size() < 2) {
+      throw parsegen::parse_error("table " + name + " needs at least two points per axis");
+    }
+    for (std::size_t i = 1; i < axis.size(); ++i) {
+      if (!(axis[i] > axis[i - 1])) {
+        throw parsegen::parse_error("table " + name + " abscissas must be increasing");
       }
-      if (free_registers.empty()) {
-        free_registers.push_back(register_count++);
+    }
+    double const first = axis.front();
+    double const spacing = (axis.back() - first) / double(axis.size() - 1);
+    bool is_uniform = true;
+    for (std::size_t i = 0; i < axis.size(); ++i) {
+      if (std::abs(axis[i] - (first + spacing * double(i))) > 1.0e-12 * (axis.back() - first)) {
+        is_uniform = false;
       }
-      i.register_assigned = free_registers.back();
-      free_registers.pop_back();
-      active.insert(
-          std::upper_bound(
-            active.begin(),
-            active.end(),
-            &i,
-            [] (live_range* a, live_range* b) {
-              return a->when_last_read < b->when_last_read;
-            }),
-          &i);
     }
+    table_data.insert(table_data.end(), axis.begin(), axis.end());
+    table_data.push_back(is_uniform ? 1.0 / spacing : 0.0);
   }
-  void generate_instructions()
+  symbol_table symbols;
+  std::string entry_name;
+  std::vector<named_instruction> named_instructions;
+  std::vector<symbol> input_variable_names;
+  std::vector<symbol> output_variable_names;
+  std::map<std::string, table> const& available_tables;
+  std::map<symbol, int> table_indices;
+  std::vector<table_descriptor> tables;
+  std::vector<double> table_data;
+  host_function function;
+  std::vector<loop> loops;
+  symbol condition_name{no_symbol};
+  int vector_temporary_count{0};
+  bool is_inside_conditional{false};
+  bool is_verbose;
+  bool pin_inputs;
+};
+
+named_function lift(host_function const& function)
+{
+  named_function result;
+  std::vector<symbol> register_names;
+  for (int i = 0; i < function.register_count(); ++i) {
+    register_names.push_back(result.symbols.temporary("$"));
+  }
+  auto const entry_names = register_names;
+  auto const& instructions = function.instructions();
+  result.named_instructions.resize(instructions.size());
+  std::size_t i = 0;
+  while (i < instructions.size()) {
+    // a vector3 instruction reads all of its operands before it writes
+    std::size_t const width = std::min(
+        std::size_t(instruction_width(primitive_code(instructions[i].code))),
+        instructions.size() - i);
+    for (std::size_t j = i; j < i + width; ++j) {
+      auto const& in = instructions[j];
+      auto& op = result.named_instructions[j];
+      op.code = primitive_code(in.code);
+      if (op.code == instruction_code::assign_constant) {
+        op.constant = in.constant;
+        continue;
+      }
+      if (in.input_registers.left >= 0) {
+        op.left_name = register_names.at(std::size_t(in.input_registers.left));
+      }
+      if (has_right_operand(op.code) && in.input_registers.right >= 0) {
+        op.right_name = register_names.at(std::size_t(in.input_registers.right));
+      }
+      if (is_table_lookup(op.code)) {
+        op.table_index = in.input_registers.right;
+      }
+    }
+    for (std::size_t j = i; j < i + width; ++j) {
+      auto const& in = instructions[j];
+      auto& op = result.named_instructions[j];
+      if (in.result_register < 0) continue;
+      // every write except one that reads the old value starts a new value
+      if (!reads_result(op.code)) {
+        register_names.at(std::size_t(in.result_register)) = result.symbols.temporary("$");
+      }
+      op.result_name = register_names.at(std::size_t(in.result_register));
+    }
+    i += width;
+  }
+  // unused inputs share registers whose value on entry is never read
+  auto const is_live_on_entry = find_live_on_entry(
+      std::vector<instruction>(instructions.cbegin(), instructions.cend()),
+      std::vector<int>(function.output_registers().cbegin(), function.output_registers().cend()),
+      function.register_count());
+  for (std::size_t i = 0; i < function.input_registers().size(); ++i) {
+    int const input_register = function.input_registers()[i];
+    if (is_live_on_entry[std::size_t(input_register)]) {
+      result.input_variable_names.push_back(entry_names[std::size_t(input_register)]);
+    } else {
+      result.input_variable_names.push_back(result.symbols.temporary("$unused"));
+    }
+  }
+  for (int output_register : function.output_registers()) {
+    result.output_variable_names.push_back(register_names.at(std::size_t(output_register)));
+  }
+  result.tables.assign(function.tables().cbegin(), function.tables().cend());
+  result.table_data.assign(function.table_data().cbegin(), function.table_data().cend());
+  return result;
+}
+
+class differentiator
+{
+ public:
+  differentiator(named_function&& function_in, std::vector<int> const& wrt_in)
+    :function(std::move(function_in))
+    ,wrt(wrt_in)
+    ,tangents(std::size_t(function.symbols.size()) * wrt.size(), no_symbol)
   {
-    instructions.resize(named_instructions.size());
-    for (std::size_t i = 0; i < instructions.size(); ++i) {
-      instructions[i].code = named_instructions[i].code;
-      if (named_instructions[i].code == instruction_code::assign_constant) {
-        instructions[i].constant = named_instructions[i].constant;
+  }
+  named_function differentiate()
+  {
+    for (std::size_t k = 0; k < wrt.size(); ++k) {
+      auto const input_name = function.input_variable_names.at(std::size_t(wrt[k]));
+      assign_constant(tangent_name(input_name, k), 1.0);
+      set_active(tangent_name(input_name, k), true);
+    }
+    auto const& ops = function.named_instructions;
+    for (std::size_t i = 0; i < ops.size();) {
+      std::size_t const width = std::size_t(instruction_width(ops[i].code));
+      result.named_instructions.insert(result.named_instructions.end(),
+          ops.begin() + std::ptrdiff_t(i), ops.begin() + std::ptrdiff_t(i + width));
+      for (std::size_t k = 0; k < wrt.size(); ++k) {
+        if (width == 1) differentiate(ops[i], k);
+        else differentiate_vector(ops.data() + i, k);
       }
+      i += width;
     }
-    for (auto& lr : live_ranges) {
-      auto first = std::size_t(std::max(lr.when_written_to, 0));
-      auto last = std::size_t(std::max(lr.when_last_read + 1, lr.when_written_to));
-      last = std::min(last, named_instructions.size());
-      for (std::size_t i = first; i < last; ++i) {
-        if (named_instructions[i].result_name == lr.name) {
-          instructions[i].result_register = lr.register_assigned;
-        }
-        if (named_instructions[i].left_name == lr.name) {
-          instructions[i].input_registers.left = lr.register_assigned;
-        }
-        if (named_instructions[i].right_name == lr.name) {
-          instructions[i].input_registers.right = lr.register_assigned;
+    result.input_variable_names = function.input_variable_names;
+    result.output_variable_names = function.output_variable_names;
+    result.tables = function.tables;
+    result.table_data = function.table_data;
+    for (symbol output_name : function.output_variable_names) {
+      for (std::size_t k = 0; k < wrt.size(); ++k) {
+        if (is_active(output_name, k)) {
+          result.output_variable_names.push_back(tangent_name(output_name, k));
+        } else {
+          auto zero = get_temporary();
+          assign_constant(zero, 0.0);
+          result.output_variable_names.push_back(zero);
         }
       }
     }
+    result.symbols = std::move(function.symbols);
+    return std::move(result);
+  }
+ private:
+  // tangents are only needed for the names of the original function
+  symbol tangent_name(symbol name, std::size_t k)
+  {
+    if (name == no_symbol) return no_symbol;
+    symbol& tangent = tangents[std::size_t(name) * wrt.size() + k];
+    if (tangent == no_symbol) tangent = function.symbols.temporary("$t");
+    return tangent;
+  }
+  bool is_active(symbol name, std::size_t k) const
+  {
+    if (name == no_symbol) return false;
+    symbol const tangent = tangents[std::size_t(name) * wrt.size() + k];
+    return tangent != no_symbol &&
+      std::size_t(tangent) < active.size() && active[std::size_t(tangent)];
+  }
+  void set_active(symbol tangent, bool is_active_tangent)
+  {
+    if (std::size_t(tangent) >= active.size()) active.resize(std::size_t(function.symbols.size()), false);
+    active[std::size_t(tangent)] = is_active_tangent;
+  }
+  symbol get_temporary()
+  {
+    return function.symbols.temporary("$d");
+  }
+  void emit(
+      instruction_code code,
+      symbol result_name,
+      symbol left_name,
+      symbol right_name = no_symbol)
+  {
+    named_instruction op;
+    op.code = code;
+    op.result_name = result_name;
+    op.left_name = left_name;
+    op.right_name = right_name;
+    result.named_instructions.push_back(op);
+  }
+  symbol compute(
+      instruction_code code,
+      symbol left_name,
+      symbol right_name = no_symbol)
+  {
+    auto result_name = get_temporary();
+    emit(code, result_name, left_name, right_name);
+    return result_name;
+  }
+  void assign_constant(symbol result_name, double constant)
+  {
+    named_instruction op;
+    op.code = instruction_code::assign_constant;
+    op.result_name = result_name;
+    op.constant = constant;
+    result.named_instructions.push_back(op);
+  }
+  symbol constant(double value)
+  {
+    auto result_name = get_temporary();
+    assign_constant(result_name, value);
+    return result_name;
+  }
+  // sum + term or sum - term, where either may be absent (no_symbol)
+  symbol accumulate(symbol sum, symbol term, instruction_code code = instruction_code::add)
+  {
+    if (term == no_symbol) return sum;
+    if (sum == no_symbol) {
+      return code == instruction_code::add ? term : compute(instruction_code::negate, term);
+    }
+    return compute(code, sum, term);
   }
-  int get_input_register(std::string const& name) const
+  // d(x * y), or no_symbol if neither is active
+  symbol product_tangent(symbol x, symbol y, std::size_t k)
   {
-    for (auto& lr : live_ranges) {
-      if (lr.name == name && lr.when_written_to == -1) {
-        return lr.register_assigned;
-      }
+    symbol result_name = no_symbol;
+    if (is_active(x, k)) {
+      result_name = compute(instruction_code::multiply, tangent_name(x, k), y);
     }
-    return -1;
+    if (is_active(y, k)) {
+      result_name = accumulate(result_name,
+          compute(instruction_code::multiply, x, tangent_name(y, k)));
+    }
+    return result_name;
   }
-  int get_output_register(std::string const& name) const
+  void set_tangent(symbol name, symbol value, std::size_t k)
   {
-    for (auto& lr : live_ranges) {
-      if (lr.name == name && lr.when_last_read == int(instructions.size())) {
-        return lr.register_assigned;
+    auto const tangent = tangent_name(name, k);
+    if (value == no_symbol) {
+      set_active(tangent, false);
+      return;
+    }
+    emit(instruction_code::copy, tangent, value);
+    set_active(tangent, true);
+  }
+  // the vector3 instructions are differentiated one component at a time
+  void differentiate_vector(named_instruction const* group, std::size_t k)
+  {
+    symbol a[3];
+    symbol b[3];
+    symbol r[3];
+    for (int j = 0; j < 3; ++j) {
+      a[j] = group[j].left_name;
+      b[j] = group[j].right_name;
+      r[j] = group[j].result_name;
+    }
+    switch (group[0].code) {
+      case instruction_code::dot:
+      {
+        symbol sum = no_symbol;
+        for (int j = 0; j < 3; ++j) sum = accumulate(sum, product_tangent(a[j], b[j], k));
+        set_tangent(r[0], sum, k);
+        break;
+      }
+      case instruction_code::norm:
+      {
+        // d|a| = (a . da) / |a|
+        symbol sum = no_symbol;
+        for (int j = 0; j < 3; ++j) {
+          if (is_active(a[j], k)) {
+            sum = accumulate(sum, compute(instruction_code::multiply, a[j], tangent_name(a[j], k)));
+          }
+        }
+        set_tangent(r[0], sum == no_symbol ? no_symbol :
+            compute(instruction_code::divide, sum, r[0]), k);
+        break;
+      }
+      case instruction_code::cross:
+      {
+        // r[j] = a[p] * b[q] - a[q] * b[p]
+        for (int j = 0; j < 3; ++j) {
+          int const p = (j + 1) % 3;
+          int const q = (j + 2) % 3;
+          set_tangent(r[j], accumulate(product_tangent(a[p], b[q], k),
+                product_tangent(a[q], b[p], k), instruction_code::subtract), k);
+        }
+        break;
+      }
+      case instruction_code::normalize:
+      {
+        // dr = (da - r (r . da)) / |a|
+        symbol projection = no_symbol;
+        for (int j = 0; j < 3; ++j) {
+          if (is_active(a[j], k)) {
+            projection = accumulate(projection,
+                compute(instruction_code::multiply, r[j], tangent_name(a[j], k)));
+          }
+        }
+        if (projection == no_symbol) {
+          for (int j = 0; j < 3; ++j) set_tangent(r[j], no_symbol, k);
+          break;
+        }
+        auto const length = get_temporary();
+        for (int j = 0; j < 3; ++j) {
+          emit(j == 0 ? instruction_code::norm : instruction_code::operands,
+              j == 0 ? length : no_symbol, a[j]);
+        }
+        for (int j = 0; j < 3; ++j) {
+          auto numerator = compute(instruction_code::multiply, r[j], projection);
+          numerator = is_active(a[j], k) ?
+            compute(instruction_code::subtract, tangent_name(a[j], k), numerator) :
+            compute(instruction_code::negate, numerator);
+          set_tangent(r[j], compute(instruction_code::divide, numerator, length), k);
+        }
+        break;
       }
+      default:
+        throw parsegen::parse_error("BUG: unexpected vector3 instruction");
     }
-    throw parsegen::parse_error(
-        "function does not set required output variable" +
-        name);
   }
-  void lookup_registers()
+  // computes the tangent of op.result_name in direction k
+  // after op itself has been emitted
+  void differentiate(named_instruction const& op, std::size_t k)
   {
-    for (auto& input_name : input_variable_names) {
-      input_registers.push_back(get_input_register(input_name));
+    symbol const r = op.result_name;
+    symbol const u = op.left_name;
+    symbol const v = op.right_name;
+    auto const dr = tangent_name(r, k);
+    auto const du = tangent_name(u, k);
+    auto const dv = tangent_name(v, k);
+    bool const u_active = is_active(u, k);
+    bool const v_active = is_active(v, k);
+    if (op.code == instruction_code::conditional_copy) {
+      bool const r_active = is_active(r, k);
+      if (!r_active && !v_active) return;
+      if (!r_active) assign_constant(dr, 0.0);
+      emit(instruction_code::conditional_copy, dr, u, v_active ? dv : constant(0.0));
+      set_active(dr, true);
+      return;
     }
-    for (auto& output_name : output_variable_names) {
-      output_registers.push_back(get_output_register(output_name));
+    if (op.code == instruction_code::clamp) {
+      // dr still holds the tangent of the upper bound, which is kept where
+      // the result is below x. Where it is above x the lower bound was taken
+      bool const r_active = is_active(r, k);
+      if (!r_active && !u_active && !v_active) return;
+      auto const inside = u_active ? compute(instruction_code::copy, du) : constant(0.0);
+      emit(instruction_code::conditional_copy, inside,
+          compute(instruction_code::less, u, r), v_active ? dv : constant(0.0));
+      if (!r_active) assign_constant(dr, 0.0);
+      emit(instruction_code::conditional_copy, dr,
+          compute(instruction_code::less_or_equal, u, r), inside);
+      set_active(dr, true);
+      return;
+    }
+    if (is_table_lookup(op.code)) {
+      bool const y_active = op.code == instruction_code::table2d && is_active(r, k);
+      if (u_active || y_active) {
+        throw std::invalid_argument("differentiate: table lookups are not differentiable");
+      }
+    }
+    bool const is_differentiable =
+      !is_table_lookup(op.code) &&
+      op.code != instruction_code::assign_constant &&
+      op.code != instruction_code::logical_or &&
+      op.code != instruction_code::logical_and &&
+      op.code != instruction_code::logical_not &&
+      op.code != instruction_code::equal &&
+      op.code != instruction_code::not_equal &&
+      op.code != instruction_code::less &&
+      op.code != instruction_code::less_or_equal &&
+      op.code != instruction_code::greater &&
+      op.code != instruction_code::greater_or_equal;
+    if (!is_differentiable || (!u_active && !v_active)) {
+      set_active(dr, false);
+      return;
+    }
+    switch (op.code) {
+      case instruction_code::copy:
+      {
+        emit(instruction_code::copy, dr, du);
+        break;
+      }
+      case instruction_code::add:
+      {
+        if (u_active && v_active) emit(instruction_code::add, dr, du, dv);
+        else emit(instruction_code::copy, dr, u_active ? du : dv);
+        break;
+      }
+      case instruction_code::subtract:
+      {
+        if (u_active && v_active) emit(instruction_code::subtract, dr, du, dv);
+        else if (u_active) emit(instruction_code::copy, dr, du);
+        else emit(instruction_code::negate, dr, dv);
+        break;
+      }
+      case instruction_code::multiply:
+      {
+        // d(u * v) = du * v + u * dv
+        if (u_active && v_active) {
+          emit(instruction_code::add, dr,
+              compute(instruction_code::multiply, du, v),
+              compute(instruction_code::multiply, u, dv));
+        } else if (u_active) {
+          emit(instruction_code::multiply, dr, du, v);
+        } else {
+          emit(instruction_code::multiply, dr, u, dv);
+        }
+        break;
+      }
+      case instruction_code::divide:
+      {
+        // d(u / v) = (du - r * dv) / v
+        if (v_active) {
+          auto numerator = compute(instruction_code::multiply, r, dv);
+          numerator = u_active ?
+            compute(instruction_code::subtract, du, numerator) :
+            compute(instruction_code::negate, numerator);
+          emit(instruction_code::divide, dr, numerator, v);
+        } else {
+          emit(instruction_code::divide, dr, du, v);
+        }
+        break;
+      }
+      case instruction_code::negate:
+      {
+        emit(instruction_code::negate, dr, du);
+        break;
+      }
+      case instruction_code::sqrt:
+      case instruction_code::pow_half:
+      {
+        // d(sqrt(u)) = du * (0.5 / r)
+        emit(instruction_code::multiply, dr, du,
+            compute(instruction_code::divide, constant(0.5), r));
+        break;
+      }
+      case instruction_code::sin:
+      {
+        emit(instruction_code::multiply, dr, du,
+            compute(instruction_code::cos, u));
+        break;
+      }
+      case instruction_code::cos:
+      {
+        emit(instruction_code::multiply, dr, du,
+            compute(instruction_code::negate,
+              compute(instruction_code::sin, u)));
+        break;
+      }
+      case instruction_code::exp:
+      {
+        emit(instruction_code::multiply, dr, du, r);
+        break;
+      }
+      case instruction_code::log:
+      {
+        emit(instruction_code::divide, dr, du, u);
+        break;
+      }
+      case instruction_code::pow:
+      {
+        // d(u ^ v) = v * u ^ (v - 1) * du + r * log(u) * dv
+        symbol du_term = no_symbol;
+        symbol dv_term = no_symbol;
+        if (u_active) {
+          auto const power = compute(instruction_code::pow, u,
+              compute(instruction_code::subtract, v, constant(1.0)));
+          du_term = compute(instruction_code::multiply, du,
+              compute(instruction_code::multiply, v, power));
+        }
+        if (v_active) {
+          dv_term = compute(instruction_code::multiply, dv,
+              compute(instruction_code::multiply, r,
+                compute(instruction_code::log, u)));
+        }
+        if (u_active && v_active) emit(instruction_code::add, dr, du_term, dv_term);
+        else emit(instruction_code::copy, dr, u_active ? du_term : dv_term);
+        break;
+      }
+      case instruction_code::min:
+      case instruction_code::max:
+      {
+        // the tangent of whichever operand was taken, with ties going to u
+        emit(instruction_code::copy, dr, u_active ? du : constant(0.0));
+        emit(instruction_code::conditional_copy, dr,
+            op.code == instruction_code::min ?
+            compute(instruction_code::less, v, u) :
+            compute(instruction_code::less, u, v),
+            v_active ? dv : constant(0.0));
+        break;
+      }
+      case instruction_code::abs:
+      {
+        emit(instruction_code::copy, dr, du);
+        emit(instruction_code::conditional_copy, dr,
+            compute(instruction_code::less, u, constant(0.0)),
+            compute(instruction_code::negate, du));
+        break;
+      }
+      default:
+        throw parsegen::parse_error("BUG: unexpected differentiable instruction");
     }
+    set_active(dr, true);
   }
-  int next_temporary{0};
-  std::vector<named_instruction> named_instructions;
-  std::vector<instruction> instructions;
-  std::vector<live_range> live_ranges;
-  int register_count{0};
-  std::vector<std::string> input_variable_names;
-  std::vector<std::string> output_variable_names;
-  std::vector<int> input_registers;
-  std::vector<int> output_registers;
-  std::string condition_name;
-  bool is_inside_conditional{false};
-  bool is_verbose;
+  named_function function;
+  std::vector<int> wrt;
+  // the tangent of name in direction k is tangents[name * wrt.size() + k]
+  std::vector<symbol> tangents;
+  std::vector<bool> active;
+  named_function result;
 };
 
 host_function compile(
     std::string const& source_code,
     bool verbose)
 {
-  math_bytecode::parser parser(verbose);
-  parser.parse_string(
-    math_bytecode::remove_leading_space(source_code),
-    "runtime math function");
-  return parser.get_function();
+  compile_options options;
+  options.verbose = verbose;
+  return compile(source_code, options);
+}
+
+// lets the lexer read characters in place instead of from a copy
+class memory_buffer : public std::streambuf {
+ public:
+  memory_buffer(char const* first, char const* last)
+  {
+    // the language has no token for leading space
+    first = std::find_if(first, last, [] (char ch) {
+      return !std::isspace(static_cast<unsigned char>(ch));
+    });
+    setg(const_cast<char*>(first), const_cast<char*>(first), const_cast<char*>(last));
+  }
+};
+
+static host_function compile_stream(
+    std::istream& stream,
+    std::string const& stream_name,
+    compile_options const& options)
+{
+  math_bytecode::parser parser(options);
+  parser.parse_stream(stream, stream_name);
+  auto function = parser.get_function();
+  function.set_accuracy(options.accuracy);
+  if (options.reduce_strength) {
+    function = reduce_strength(function, options.reciprocal_division, options.verbose);
+  }
+  return function;
 }
 
+host_function compile(
+    std::string const& source_code,
+    compile_options const& options)
+{
+  memory_buffer buffer(source_code.data(), source_code.data() + source_code.size());
+  std::istream stream(&buffer);
+  return compile_stream(stream, "runtime math function", options);
+}
+
+#ifdef MATH_BYTECODE_HAS_MMAP
+
+class mapped_file {
+ public:
+  mapped_file(std::string const& path)
+  {
+    int const descriptor = ::open(path.c_str(), O_RDONLY);
+    if (descriptor < 0) {
+      throw std::runtime_error("compile_file: could not open " + path);
+    }
+    struct stat status;
+    if (::fstat(descriptor, &status) == 0) size = std::size_t(status.st_size);
+    if (size > 0) {
+      void* const mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+      if (mapping != MAP_FAILED) {
+        data = static_cast<char const*>(mapping);
+        ::madvise(mapping, size, MADV_SEQUENTIAL);
+      }
+    }
+    ::close(descriptor);
+    if (size > 0 && data == nullptr) {
+      throw std::runtime_error("compile_file: could not map " + path);
+    }
+  }
+  ~mapped_file()
+  {
+    if (data != nullptr) ::munmap(const_cast<char*>(data), size);
+  }
+  mapped_file(mapped_file const&) = delete;
+  mapped_file& operator=(mapped_file const&) = delete;
+  char const* begin() const { return data; }
+  char const* end() const { return data + size; }
+ private:
+  char const* data{nullptr};
+  std::size_t size{0};
+};
+
+host_function compile_file(
+    std::string const& path,
+    compile_options const& options)
+{
+  mapped_file file(path);
+  memory_buffer buffer(file.begin(), file.end());
+  std::istream stream(&buffer);
+  return compile_stream(stream, path, options);
+}
+
+#else
+
+host_function compile_file(
+    std::string const& path,
+    compile_options const& options)
+{
+  std::ifstream stream(path);
+  if (!stream) {
+    throw std::runtime_error("compile_file: could not open " + path);
+  }
+  stream >> std::ws;
+  return compile_stream(stream, path, options);
+}
+
+#endif
+
+std::vector<compile_result> compile_many(
+    std::vector<std::string> const& source_codes,
+    compile_options const& options,
+    int thread_count)
+{
+  std::vector<compile_result> results(source_codes.size());
+  std::atomic<std::size_t> next_source{0};
+  auto const work = [&] () {
+    for (std::size_t i = next_source++; i < source_codes.size(); i = next_source++) {
+      try {
+        results[i].function = compile(source_codes[i], options);
+      } catch (std::exception const& error) {
+        results[i].error = error.what();
+      }
+    }
+  };
+  if (thread_count <= 0) {
+    thread_count = std::max(int(std::thread::hardware_concurrency()), 1);
+  }
+  thread_count = std::min(thread_count, int(source_codes.size()));
+  std::vector<std::thread> threads;
+  for (int i = 1; i < thread_count; ++i) threads.emplace_back(work);
+  work();
+  for (auto& thread : threads) thread.join();
+  return results;
+}
+
+function_schedule schedule_by_function(
+    int function_count,
+    int element_count,
+    int const* function_ids,
+    int batch_size)
+{
+  if (batch_size < 1) {
+    throw std::invalid_argument("schedule_by_function: batch size must be positive");
+  }
+  function_schedule schedule;
+  schedule.offsets.assign(std::size_t(function_count) + 1, 0);
+  for (int e = 0; e < element_count; ++e) {
+    int const f = function_ids[e];
+    if (f < 0 || f >= function_count) {
+      throw std::invalid_argument("schedule_by_function: function ID out of range");
+    }
+    ++schedule.offsets[std::size_t(f) + 1];
+  }
+  for (int f = 0; f < function_count; ++f) {
+    schedule.offsets[std::size_t(f) + 1] += schedule.offsets[std::size_t(f)];
+  }
+  schedule.order.resize(std::size_t(element_count));
+  std::vector<int> next(schedule.offsets.begin(), schedule.offsets.end() - 1);
+  for (int e = 0; e < element_count; ++e) {
+    schedule.order[std::size_t(next[std::size_t(function_ids[e])]++)] = e;
+  }
+  for (int f = 0; f < function_count; ++f) {
+    int const last = schedule.offsets[std::size_t(f) + 1];
+    for (int first = schedule.offsets[std::size_t(f)]; first < last; first += batch_size) {
+      function_work_item item;
+      item.function = std::int32_t(f);
+      item.first = std::int32_t(first);
+      item.count = std::int32_t(std::min(batch_size, last - first));
+      schedule.work_items.push_back(item);
+    }
+  }
+  return schedule;
+}
+
+char const* strategy_name(evaluation_strategy strategy)
+{
+  switch (strategy) {
+    case evaluation_strategy::scalar: return "scalar";
+    case evaluation_strategy::batch: return "batch";
+  }
+  return "unknown";
+}
+
+std::ostream& operator<<(std::ostream& stream, evaluation_plan const& plan)
+{
+  stream << strategy_name(plan.strategy);
+  if (plan.strategy == evaluation_strategy::batch) stream << " of " << plan.batch_size;
+  return stream << " (" << plan.nanoseconds_per_point << " ns per point)";
+}
+
+auto_function::auto_function(host_function function_in, int calibration_points_in)
+  :wrapped(std::move(function_in))
+  ,calibration_points(std::max(calibration_points_in, 1))
+{
+  registers.resize(std::size_t(wrapped.register_count()));
+}
+
+void auto_function::evaluate(int count, double const* inputs, double* outputs)
+{
+  if (!calibrated && count >= calibration_points) {
+    calibrate(count, inputs, outputs);
+    evaluate_with(chosen_plan, count, calibration_points, count, inputs, outputs);
+    return;
+  }
+  evaluate_with(chosen_plan, count, 0, count, inputs, outputs);
+}
+
+// evaluates points first through first + size - 1 of inputs and outputs
+// laid out as in evaluate_batch, in place
+static void evaluate_range(
+    host_function const& function,
+    int count,
+    int first,
+    int size,
+    double const* inputs,
+    double* outputs,
+    double* registers)
+{
+  function.executable().evaluate_batch(
+      registers, size, inputs + first, count, outputs + first, count);
+}
+
+void auto_function::evaluate_with(
+    evaluation_plan const& plan,
+    int count,
+    int first,
+    int last,
+    double const* inputs,
+    double* outputs)
+{
+  if (plan.strategy == evaluation_strategy::scalar) {
+    auto const executable = wrapped.executable();
+    for (int p = first; p < last; ++p) {
+      executable.evaluate_point(registers.data(), count, p, inputs, outputs);
+    }
+    return;
+  }
+  for (int start = first; start < last; start += plan.batch_size) {
+    evaluate_range(wrapped, count, start, std::min(plan.batch_size, last - start),
+        inputs, outputs, registers.data());
+  }
+}
+
+// every candidate evaluates the first calibration_points points, the best
+// of a few repetitions being its time
+void auto_function::calibrate(int count, double const* inputs, double* outputs)
+{
+  int const largest_batch = std::min(calibration_points, 512);
+  std::vector<evaluation_plan> plans(1);
+  for (int batch_size = 8; batch_size <= largest_batch; batch_size *= 4) {
+    evaluation_plan plan;
+    plan.strategy = evaluation_strategy::batch;
+    plan.batch_size = batch_size;
+    plans.push_back(plan);
+  }
+  registers.resize(std::size_t(wrapped.register_count()) * std::size_t(largest_batch));
+  int const repetitions = 3;
+  for (auto& plan : plans) {
+    auto best = std::chrono::steady_clock::duration::max();
+    for (int r = 0; r < repetitions; ++r) {
+      auto const start = std::chrono::steady_clock::now();
+      evaluate_with(plan, count, 0, calibration_points, inputs, outputs);
+      best = std::min(best, std::chrono::steady_clock::now() - start);
+    }
+    plan.nanoseconds_per_point =
+      double(std::chrono::duration_cast<std::chrono::nanoseconds>(best).count()) /
+      double(calibration_points);
+  }
+  timed_plans = plans;
+  chosen_plan = *std::min_element(plans.begin(), plans.end(),
+      [] (evaluation_plan const& a, evaluation_plan const& b) {
+        return a.nanoseconds_per_point < b.nanoseconds_per_point;
+      });
+  calibrated = true;
+}
+
+class thread_pool::state {
+ public:
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  // held for the whole of run, so that callers on different threads take turns
+  std::mutex run_mutex;
+  std::condition_variable task_posted;
+  std::condition_variable task_finished;
+  std::function<void(int)> const* task{nullptr};
+  std::uint64_t generation{0};
+  int unfinished_count{0};
+  bool is_stopping{false};
+  void work(int thread_index)
+  {
+    std::uint64_t seen_generation = 0;
+    while (true) {
+      std::function<void(int)> const* current_task;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        task_posted.wait(lock, [&] { return is_stopping || generation != seen_generation; });
+        if (is_stopping) return;
+        seen_generation = generation;
+        current_task = task;
+      }
+      (*current_task)(thread_index);
+      std::lock_guard<std::mutex> lock(mutex);
+      if (--unfinished_count == 0) task_finished.notify_one();
+    }
+  }
+};
+
+thread_pool::thread_pool(int thread_count)
+  :m_state(std::make_unique<state>())
+{
+  if (thread_count <= 0) {
+    thread_count = std::max(int(std::thread::hardware_concurrency()), 1);
+  }
+  for (int i = 1; i < thread_count; ++i) {
+    m_state->threads.emplace_back([this, i] { m_state->work(i); });
+  }
+}
+
+thread_pool::~thread_pool()
+{
+  {
+    std::lock_guard<std::mutex> lock(m_state->mutex);
+    m_state->is_stopping = true;
+  }
+  m_state->task_posted.notify_all();
+  for (auto& thread : m_state->threads) thread.join();
+}
+
+int thread_pool::size() const
+{
+  return int(m_state->threads.size()) + 1;
+}
+
+void thread_pool::run(std::function<void(int)> const& task)
+{
+  std::lock_guard<std::mutex> run_lock(m_state->run_mutex);
+  {
+    std::lock_guard<std::mutex> lock(m_state->mutex);
+    m_state->task = &task;
+    m_state->unfinished_count = int(m_state->threads.size());
+    ++m_state->generation;
+  }
+  m_state->task_posted.notify_all();
+  task(0);
+  std::unique_lock<std::mutex> lock(m_state->mutex);
+  m_state->task_finished.wait(lock, [&] { return m_state->unfinished_count == 0; });
+}
+
+// the chunks a thread has left, first in the high half and end in the low
+// half so that the owner and thieves can both take from it with one
+// compare-and-swap. The bounds can return to a value another thread read
+// earlier (an owner that has run out stores whatever it steals), but that
+// is harmless: a compare-and-swap that succeeds has seen the bounds as they
+// are now, and the new bounds and the chunks taken depend on nothing else
+class alignas(64) chunk_range {
+ public:
+  std::atomic<std::uint64_t> bounds{0};
+  static std::uint64_t pack(std::uint32_t first, std::uint32_t end)
+  {
+    return (std::uint64_t(first) << 32) | std::uint64_t(end);
+  }
+  // the owner takes chunks from the front
+  bool pop(std::uint32_t& chunk)
+  {
+    std::uint64_t old_bounds = bounds.load(std::memory_order_relaxed);
+    while (true) {
+      std::uint32_t const first = std::uint32_t(old_bounds >> 32);
+      std::uint32_t const end = std::uint32_t(old_bounds);
+      if (first >= end) return false;
+      if (bounds.compare_exchange_weak(old_bounds, pack(first + 1, end),
+            std::memory_order_acq_rel, std::memory_order_relaxed)) {
+        chunk = first;
+        return true;
+      }
+    }
+  }
+  // thieves take the back half
+  bool steal(std::uint32_t& stolen_first, std::uint32_t& stolen_end)
+  {
+    std::uint64_t old_bounds = bounds.load(std::memory_order_relaxed);
+    while (true) {
+      std::uint32_t const first = std::uint32_t(old_bounds >> 32);
+      std::uint32_t const end = std::uint32_t(old_bounds);
+      if (first >= end) return false;
+      std::uint32_t const middle = first + (end - first) / 2;
+      if (bounds.compare_exchange_weak(old_bounds, pack(first, middle),
+            std::memory_order_acq_rel, std::memory_order_relaxed)) {
+        stolen_first = middle;
+        stolen_end = end;
+        return true;
+      }
+    }
+  }
+};
+
+void evaluate_parallel(
+    host_function const& function,
+    thread_pool& pool,
+    int count,
+    double const* inputs,
+    double* outputs,
+    int chunk_size)
+{
+  if (count <= 0) return;
+  int const register_count = std::max(function.register_count(), 1);
+  if (chunk_size <= 0) {
+    int const level_one_bytes = 32 * 1024;
+    chunk_size = std::clamp(level_one_bytes / int(sizeof(double)) / register_count, 8, 1024);
+  }
+  int const chunk_count = (count + chunk_size - 1) / chunk_size;
+  int const thread_count = pool.size();
+  std::vector<chunk_range> ranges(static_cast<std::size_t>(thread_count));
+  for (int t = 0; t < thread_count; ++t) {
+    ranges[std::size_t(t)].bounds.store(chunk_range::pack(
+          std::uint32_t(std::int64_t(chunk_count) * t / thread_count),
+          std::uint32_t(std::int64_t(chunk_count) * (t + 1) / thread_count)),
+        std::memory_order_relaxed);
+  }
+  pool.run([&] (int t) {
+    std::vector<double> registers(std::size_t(register_count) * std::size_t(chunk_size));
+    chunk_range& own = ranges[std::size_t(t)];
+    while (true) {
+      std::uint32_t chunk;
+      while (own.pop(chunk)) {
+        int const first = int(chunk) * chunk_size;
+        evaluate_range(function, count, first, std::min(chunk_size, count - first),
+            inputs, outputs, registers.data());
+      }
+      // nothing is lost if every range looks empty while a steal is under
+      // way, since the thief will run what it took
+      bool has_stolen = false;
+      for (int k = 1; k < thread_count && !has_stolen; ++k) {
+        std::uint32_t stolen_first, stolen_end;
+        if (ranges[std::size_t((t + k) % thread_count)].steal(stolen_first, stolen_end)) {
+          own.bounds.store(chunk_range::pack(stolen_first, stolen_end), std::memory_order_release);
+          has_stolen = true;
+        }
+      }
+      if (!has_stolen) return;
+    }
+  });
+}
+
+host_function differentiate(
+    host_function const& function,
+    std::vector<int> const& wrt,
+    bool verbose)
+{
+  for (int input : wrt) {
+    if (input < 0 || input >= int(function.input_registers().size())) {
+      throw std::invalid_argument(
+          "differentiate: input index " + std::to_string(input) + " out of range");
+    }
+  }
+  auto result = code_generator(
+      differentiator(lift(function), wrt).differentiate(),
+      verbose, function.has_pinned_inputs()).generate();
+  result.set_accuracy(function.accuracy());
+  return result;
+}
+
+// moves each instruction that only reads uniform values ahead of the
+// others, unless it overwrites a value that a varying instruction before
+// it still has to read
+static named_function hoist_uniform(
+    named_function&& function,
+    std::vector<int> const& uniform_inputs)
+{
+  std::size_t const symbol_count = std::size_t(function.symbols.size());
+  std::vector<bool> uniform(symbol_count, false);
+  for (int input : uniform_inputs) {
+    uniform[std::size_t(function.input_variable_names.at(std::size_t(input)))] = true;
+  }
+  auto const is_uniform = [&] (symbol name) {
+    return name == no_symbol || uniform[std::size_t(name)];
+  };
+  std::vector<bool> read_by_varying(symbol_count, false);
+  auto const read_varying = [&] (symbol name) {
+    if (name != no_symbol) read_by_varying[std::size_t(name)] = true;
+  };
+  std::vector<named_instruction> prologue;
+  std::vector<named_instruction> body;
+  auto const& ops = function.named_instructions;
+  for (std::size_t i = 0; i < ops.size();) {
+    // the instructions of a vector3 operation move together
+    auto const first = ops.begin() + std::ptrdiff_t(i);
+    auto const last = first + instruction_width(ops[i].code);
+    bool op_is_uniform = true;
+    for (auto it = first; it != last; ++it) {
+      auto const& op = *it;
+      op_is_uniform = op_is_uniform && is_uniform(op.left_name) && is_uniform(op.right_name);
+      if (reads_result(op.code)) {
+        op_is_uniform = op_is_uniform &&
+          is_uniform(op.result_name) && !read_by_varying[std::size_t(op.result_name)];
+      }
+    }
+    for (auto it = first; it != last; ++it) {
+      auto const& op = *it;
+      if (op.result_name != no_symbol) uniform[std::size_t(op.result_name)] = op_is_uniform;
+      if (!op_is_uniform) {
+        read_varying(op.left_name);
+        read_varying(op.right_name);
+        if (reads_result(op.code)) read_varying(op.result_name);
+      }
+    }
+    (op_is_uniform ? prologue : body).insert(
+        (op_is_uniform ? prologue : body).end(), first, last);
+    i += std::size_t(last - first);
+  }
+  function.named_instructions = std::move(prologue);
+  function.named_instructions.insert(function.named_instructions.end(), body.begin(), body.end());
+  return std::move(function);
+}
+
+host_function hoist_uniform(
+    host_function const& function,
+    std::vector<int> const& uniform_inputs,
+    bool verbose)
+{
+  for (int input : uniform_inputs) {
+    if (input < 0 || input >= int(function.input_registers().size())) {
+      throw std::invalid_argument(
+          "hoist_uniform: input index " + std::to_string(input) + " out of range");
+    }
+  }
+  auto result = code_generator(
+      hoist_uniform(lift(function), uniform_inputs),
+      verbose, function.has_pinned_inputs()).generate();
+  result.set_accuracy(function.accuracy());
+  // register allocation may merge copies, so the prologue is found again
+  // in the generated instructions
+  std::vector<bool> is_uniform(std::size_t(result.register_count()), false);
+  for (int input : uniform_inputs) {
+    is_uniform[std::size_t(result.input_registers()[std::size_t(input)])] = true;
+  }
+  auto const& instructions = result.instructions();
+  // operands instructions use -1 for the registers they lack
+  auto const is_uniform_read = [&] (int r) {
+    return r < 0 || is_uniform[std::size_t(r)];
+  };
+  std::size_t prologue_count = 0;
+  while (prologue_count < instructions.size()) {
+    std::size_t const width =
+      std::size_t(instruction_width(primitive_code(instructions[prologue_count].code)));
+    bool group_is_uniform = true;
+    for (std::size_t i = prologue_count; i < prologue_count + width; ++i) {
+      auto const& in = instructions[i];
+      instruction_code const code = primitive_code(in.code);
+      if (code != instruction_code::assign_constant &&
+          (!is_uniform_read(in.input_registers.left) ||
+           (has_right_operand(code) && !is_uniform_read(in.input_registers.right)) ||
+           (reads_result(code) && !is_uniform_read(in.result_register)))) {
+        group_is_uniform = false;
+      }
+    }
+    if (!group_is_uniform) break;
+    for (std::size_t i = prologue_count; i < prologue_count + width; ++i) {
+      int const r = instructions[i].result_register;
+      if (r >= 0) is_uniform[std::size_t(r)] = true;
+    }
+    prologue_count += width;
+  }
+  // the prologue results that are read (or output) before being overwritten
+  std::vector<bool> is_written_by_prologue(std::size_t(result.register_count()), false);
+  for (std::size_t i = 0; i < prologue_count; ++i) {
+    int const r = instructions[i].result_register;
+    if (r >= 0) is_written_by_prologue[std::size_t(r)] = true;
+  }
+  std::vector<bool> is_needed(std::size_t(result.register_count()), false);
+  std::vector<bool> is_overwritten(std::size_t(result.register_count()), false);
+  auto const read = [&] (int r) {
+    if (r >= 0 && !is_overwritten[std::size_t(r)]) is_needed[std::size_t(r)] = true;
+  };
+  std::size_t i = prologue_count;
+  while (i < instructions.size()) {
+    // a vector3 instruction reads all of its operands before writing
+    std::size_t const width = std::size_t(instruction_width(primitive_code(instructions[i].code)));
+    for (std::size_t j = i; j < i + width; ++j) {
+      auto const& in = instructions[j];
+      instruction_code const code = primitive_code(in.code);
+      if (code != instruction_code::assign_constant) {
+        read(in.input_registers.left);
+        if (has_right_operand(code)) read(in.input_registers.right);
+      }
+      if (reads_result(code)) read(in.result_register);
+    }
+    for (std::size_t j = i; j < i + width; ++j) {
+      int const r = instructions[j].result_register;
+      if (r >= 0) is_overwritten[std::size_t(r)] = true;
+    }
+    i += width;
+  }
+  for (int output_register : result.output_registers()) read(output_register);
+  std::vector<int> uniform_registers;
+  for (int r = 0; r < result.register_count(); ++r) {
+    if (is_written_by_prologue[std::size_t(r)] && is_needed[std::size_t(r)]) {
+      uniform_registers.push_back(r);
+    }
+  }
+  result.set_prologue(int(prologue_count), uniform_registers);
+  return result;
+}
+
+static void evaluate_vector_constant(
+    named_instruction const* group,
+    double const (&left)[3],
+    double const (&right)[3],
+    double (&result)[3],
+    execution_context<double> const& context)
+{
+  instruction in[3];
+  double registers[9] = {};
+  for (int j = 0; j < 3; ++j) {
+    in[j].code = group[j].code;
+    in[j].result_register = j;
+    in[j].input_registers.left = 3 + j;
+    in[j].input_registers.right = 6 + j;
+    registers[3 + j] = left[j];
+    registers[6 + j] = right[j];
+  }
+  in[0].execute(registers, context);
+  for (int j = 0; j < 3; ++j) result[j] = registers[j];
+}
+
+// replaces every instruction whose inputs are all known by its value,
+// and resolves conditional copies whose condition is known
+static named_function propagate_constants(
+    named_function&& function,
+    execution_context<double> const& context)
+{
+  std::size_t const symbol_count = std::size_t(function.symbols.size());
+  std::vector<bool> known(symbol_count, false);
+  std::vector<double> values(symbol_count, 0.0);
+  auto const is_known = [&] (symbol name) {
+    return name == no_symbol || known[std::size_t(name)];
+  };
+  auto const value = [&] (symbol name) {
+    return name == no_symbol ? 0.0 : values[std::size_t(name)];
+  };
+  auto const set_known = [&] (symbol name, double constant) {
+    known[std::size_t(name)] = true;
+    values[std::size_t(name)] = constant;
+  };
+  std::vector<named_instruction> propagated;
+  auto const& ops = function.named_instructions;
+  for (std::size_t i = 0; i < ops.size(); ++i) {
+    if (instruction_width(ops[i].code) > 1) {
+      named_instruction const* const group = ops.data() + i;
+      double left[3];
+      double right[3];
+      bool is_foldable = true;
+      for (int j = 0; j < 3; ++j) {
+        is_foldable = is_foldable &&
+          is_known(group[j].left_name) && is_known(group[j].right_name);
+        left[j] = value(group[j].left_name);
+        right[j] = value(group[j].right_name);
+      }
+      double result[3];
+      if (is_foldable) evaluate_vector_constant(group, left, right, result, context);
+      for (int j = 0; j < 3; ++j) {
+        symbol const result_name = group[j].result_name;
+        if (!is_foldable) {
+          if (result_name != no_symbol) known[std::size_t(result_name)] = false;
+          propagated.push_back(group[j]);
+        } else if (result_name != no_symbol) {
+          named_instruction folded;
+          folded.code = instruction_code::assign_constant;
+          folded.result_name = result_name;
+          folded.constant = result[j];
+          set_known(result_name, result[j]);
+          propagated.push_back(folded);
+        }
+      }
+      i += 2;
+      continue;
+    }
+    auto op = ops[i];
+    if (op.code == instruction_code::assign_constant) {
+      set_known(op.result_name, op.constant);
+      propagated.push_back(op);
+      continue;
+    }
+    if (op.code == instruction_code::conditional_copy && is_known(op.left_name)) {
+      if (value(op.left_name) == 0.0) continue;
+      op.code = instruction_code::copy;
+      op.left_name = op.right_name;
+      op.right_name = no_symbol;
+    }
+    bool const is_foldable = is_known(op.left_name) && is_known(op.right_name) &&
+      (!reads_result(op.code) || is_known(op.result_name));
+    if (is_foldable) {
+      double const result = evaluate_constant(op,
+          value(op.left_name),
+          value(op.right_name),
+          reads_result(op.code) ? value(op.result_name) : 0.0,
+          context);
+      named_instruction folded;
+      folded.code = instruction_code::assign_constant;
+      folded.result_name = op.result_name;
+      folded.constant = result;
+      set_known(op.result_name, result);
+      propagated.push_back(folded);
+      continue;
+    }
+    known[std::size_t(op.result_name)] = false;
+    propagated.push_back(op);
+  }
+  function.named_instructions = std::move(propagated);
+  return std::move(function);
+}
+
+// removes instructions that the outputs do not depend on
+static named_function eliminate_dead_code(named_function&& function)
+{
+  std::vector<bool> live(std::size_t(function.symbols.size()), false);
+  for (symbol output_name : function.output_variable_names) {
+    live[std::size_t(output_name)] = true;
+  }
+  auto const& ops = function.named_instructions;
+  // the instructions of a vector3 operation are kept or removed together
+  std::vector<std::size_t> group_starts;
+  for (std::size_t i = 0; i < ops.size(); i += std::size_t(instruction_width(ops[i].code))) {
+    group_starts.push_back(i);
+  }
+  std::vector<named_instruction> needed;
+  for (auto it = group_starts.rbegin(); it != group_starts.rend(); ++it) {
+    auto const first = ops.begin() + std::ptrdiff_t(*it);
+    auto const last = first + instruction_width(first->code);
+    bool is_needed = false;
+    for (auto op = first; op != last; ++op) {
+      is_needed = is_needed || (op->result_name != no_symbol && live[std::size_t(op->result_name)]);
+    }
+    if (!is_needed) continue;
+    for (auto op = first; op != last; ++op) {
+      if (op->result_name != no_symbol && !reads_result(op->code)) {
+        live[std::size_t(op->result_name)] = false;
+      }
+    }
+    for (auto op = last; op != first;) {
+      --op;
+      if (op->left_name != no_symbol) live[std::size_t(op->left_name)] = true;
+      if (op->right_name != no_symbol) live[std::size_t(op->right_name)] = true;
+      needed.push_back(*op);
+    }
+  }
+  function.named_instructions.assign(needed.rbegin(), needed.rend());
+  return std::move(function);
+}
+
+host_function specialize(
+    host_function const& function,
+    std::map<int, double> const& bound_inputs,
+    bool verbose)
+{
+  auto lifted = lift(function);
+  std::vector<named_instruction> constants;
+  for (auto& bound_input : bound_inputs) {
+    if (bound_input.first < 0 || bound_input.first >= int(lifted.input_variable_names.size())) {
+      throw std::invalid_argument(
+          "specialize: input index " + std::to_string(bound_input.first) + " out of range");
+    }
+    // reads of the input become reads of a constant, leaving the input unused
+    symbol const input_name = lifted.input_variable_names[std::size_t(bound_input.first)];
+    symbol const constant_name = lifted.symbols.temporary("$bound");
+    for (auto& op : lifted.named_instructions) {
+      if (op.left_name == input_name) op.left_name = constant_name;
+      if (op.right_name == input_name) op.right_name = constant_name;
+    }
+    for (symbol& output_name : lifted.output_variable_names) {
+      if (output_name == input_name) output_name = constant_name;
+    }
+    named_instruction op;
+    op.code = instruction_code::assign_constant;
+    op.result_name = constant_name;
+    op.constant = bound_input.second;
+    constants.push_back(op);
+  }
+  lifted.named_instructions.insert(lifted.named_instructions.begin(),
+      constants.begin(), constants.end());
+  execution_context<double> context;
+  context.accuracy = function.accuracy();
+  context.tables = lifted.tables.data();
+  context.table_data = lifted.table_data.data();
+  auto result = code_generator(
+      eliminate_dead_code(propagate_constants(std::move(lifted), context)),
+      verbose, function.has_pinned_inputs()).generate();
+  result.set_accuracy(function.accuracy());
+  return result;
+}
+
+// whether x / divisor == x * (1 / divisor) for every x, which holds when
+// the divisor is a power of two whose reciprocal is a normal number
+static bool has_exact_reciprocal(double divisor)
+{
+  int exponent;
+  return std::isnormal(divisor) && std::isnormal(1.0 / divisor) &&
+    std::abs(std::frexp(divisor, &exponent)) == 0.5;
+}
+
+// a chain of multiplications for x^n is within about |n| - 1 roundings of
+// the exact result (one more for the reciprocal of a negative n), which
+// must fit the error the accuracy tier allows
+static bool fits_accuracy(int n, math_accuracy accuracy)
+{
+  int const roundings = std::abs(n) - 1 + (n < 0 ? 1 : 0);
+  return roundings <= (accuracy == math_accuracy::four_ulp ? 4 : 1);
+}
+
+// see the public reduce_strength. Constants are the names last written by
+// assign_constant, as after propagate_constants
+static named_function reduce_strength(
+    named_function&& function,
+    bool reciprocal_division,
+    math_accuracy accuracy)
+{
+  std::size_t const symbol_count = std::size_t(function.symbols.size());
+  std::vector<bool> known(symbol_count, false);
+  std::vector<double> values(symbol_count, 0.0);
+  std::vector<named_instruction> reduced;
+  auto const emit = [&] (instruction_code code, symbol left, symbol right) {
+    named_instruction op;
+    op.code = code;
+    op.result_name = function.symbols.temporary("$");
+    op.left_name = left;
+    op.right_name = right;
+    reduced.push_back(op);
+    return op.result_name;
+  };
+  auto const emit_constant = [&] (double constant) {
+    named_instruction op;
+    op.code = instruction_code::assign_constant;
+    op.result_name = function.symbols.temporary("$");
+    op.constant = constant;
+    reduced.push_back(op);
+    return op.result_name;
+  };
+  auto const& ops = function.named_instructions;
+  for (std::size_t i = 0; i < ops.size(); ++i) {
+    auto op = ops[i];
+    if (op.code == instruction_code::assign_constant) {
+      known[std::size_t(op.result_name)] = true;
+      values[std::size_t(op.result_name)] = op.constant;
+      reduced.push_back(op);
+      continue;
+    }
+    bool const has_known_right = has_right_operand(op.code) &&
+      op.right_name != no_symbol && known[std::size_t(op.right_name)];
+    double const right = has_known_right ? values[std::size_t(op.right_name)] : 0.0;
+    if (op.code == instruction_code::pow && has_known_right) {
+      if (right == 0.5) {
+        // sqrt is correctly rounded, so this is within every accuracy
+        op.code = instruction_code::pow_half;
+        op.right_name = no_symbol;
+      } else if (right == std::trunc(right) && std::abs(right) <= 64.0 &&
+          fits_accuracy(int(right), accuracy)) {
+        // the last instruction of the chain writes the result
+        int n = int(std::abs(right));
+        if (n == 0) {
+          op.code = instruction_code::assign_constant;
+          op.left_name = no_symbol;
+          op.right_name = no_symbol;
+          op.constant = 1.0;
+        } else {
+          symbol power = op.left_name;
+          symbol accumulated = no_symbol;
+          while (true) {
+            if (n % 2 == 1) {
+              accumulated = (accumulated == no_symbol) ? power :
+                emit(instruction_code::multiply, accumulated, power);
+            }
+            n /= 2;
+            if (n == 0) break;
+            power = emit(instruction_code::multiply, power, power);
+          }
+          if (right < 0.0) {
+            op.code = instruction_code::divide;
+            op.left_name = emit_constant(1.0);
+            op.right_name = accumulated;
+          } else if (accumulated == op.left_name) {
+            op.code = instruction_code::copy;
+            op.right_name = no_symbol;
+          } else {
+            reduced.back().result_name = op.result_name;
+            known[std::size_t(op.result_name)] = false;
+            continue;
+          }
+        }
+      }
+    } else if (op.code == instruction_code::divide && has_known_right &&
+        (has_exact_reciprocal(right) ||
+         (reciprocal_division && std::isnormal(right) && std::isnormal(1.0 / right)))) {
+      op.code = instruction_code::multiply;
+      op.right_name = emit_constant(1.0 / right);
+    }
+    if (op.code == instruction_code::assign_constant) {
+      known[std::size_t(op.result_name)] = true;
+      values[std::size_t(op.result_name)] = op.constant;
+    } else if (op.result_name != no_symbol) {
+      known[std::size_t(op.result_name)] = false;
+    }
+    reduced.push_back(op);
+  }
+  function.named_instructions = std::move(reduced);
+  return std::move(function);
+}
+
+host_function reduce_strength(
+    host_function const& function,
+    bool reciprocal_division,
+    bool verbose)
+{
+  bool const has_candidates = std::any_of(
+      function.instructions().cbegin(), function.instructions().cend(),
+      [] (instruction const& in) {
+        instruction_code const code = primitive_code(in.code);
+        return code == instruction_code::pow || code == instruction_code::divide;
+      });
+  if (!has_candidates) return function;
+  auto lifted = lift(function);
+  execution_context<double> context;
+  context.accuracy = function.accuracy();
+  context.tables = lifted.tables.data();
+  context.table_data = lifted.table_data.data();
+  auto result = code_generator(
+      eliminate_dead_code(reduce_strength(
+          propagate_constants(std::move(lifted), context), reciprocal_division,
+          function.accuracy())),
+      verbose, function.has_pinned_inputs()).generate();
+  result.set_accuracy(function.accuracy());
+  return result;
+}
+
+template <class Function>
+Function convert_precision(host_function const& function)
+{
+  using instruction_type = typename Function::instruction_type;
+  using constant_type = typename instruction_type::constant_type;
+  std::vector<instruction_type> instructions;
+  for (auto& in : function.instructions()) {
+    instruction_type converted;
+    converted.result_register = in.result_register;
+    converted.code = in.code;
+    if (primitive_code(in.code) == instruction_code::assign_constant) {
+      converted.constant = constant_type(in.constant);
+    } else {
+      converted.input_registers.left = in.input_registers.left;
+      converted.input_registers.right = in.input_registers.right;
+    }
+    instructions.push_back(converted);
+  }
+  std::vector<constant_type> table_data;
+  for (double value : function.table_data()) {
+    table_data.push_back(constant_type(value));
+  }
+  Function result(
+      instructions,
+      std::vector<int>(function.input_registers().cbegin(), function.input_registers().cend()),
+      std::vector<int>(function.output_registers().cbegin(), function.output_registers().cend()),
+      function.register_count(),
+      std::vector<table_descriptor>(function.tables().cbegin(), function.tables().cend()),
+      table_data);
+  result.set_accuracy(function.accuracy());
+  result.set_prologue(function.prologue_count(),
+      std::vector<int>(function.uniform_registers().cbegin(), function.uniform_registers().cend()));
+  return result;
+}
+
+host_single_function to_single_precision(host_function const& function)
+{
+  return convert_precision<host_single_function>(function);
+}
+
+host_mixed_function to_mixed_precision(host_function const& function)
+{
+  return convert_precision<host_mixed_function>(function);
+}
+
+static char const* instruction_name(instruction_code code)
+{
+  switch (code) {
+    case instruction_code::copy: return "copy";
+    case instruction_code::add: return "add";
+    case instruction_code::subtract: return "subtract";
+    case instruction_code::multiply: return "multiply";
+    case instruction_code::divide: return "divide";
+    case instruction_code::negate: return "negate";
+    case instruction_code::assign_constant: return "assign_constant";
+    case instruction_code::sqrt: return "sqrt";
+    case instruction_code::pow_half: return "pow_half";
+    case instruction_code::sin: return "sin";
+    case instruction_code::cos: return "cos";
+    case instruction_code::exp: return "exp";
+    case instruction_code::log: return "log";
+    case instruction_code::pow: return "pow";
+    case instruction_code::conditional_copy: return "conditional_copy";
+    case instruction_code::logical_or: return "logical_or";
+    case instruction_code::logical_and: return "logical_and";
+    case instruction_code::logical_not: return "logical_not";
+    case instruction_code::equal: return "equal";
+    case instruction_code::not_equal: return "not_equal";
+    case instruction_code::less: return "less";
+    case instruction_code::less_or_equal: return "less_or_equal";
+    case instruction_code::greater: return "greater";
+    case instruction_code::greater_or_equal: return "greater_or_equal";
+    case instruction_code::min: return "min";
+    case instruction_code::max: return "max";
+    case instruction_code::abs: return "abs";
+    case instruction_code::clamp: return "clamp";
+    case instruction_code::table1d: return "table1d";
+    case instruction_code::table2d: return "table2d";
+    case instruction_code::dot: return "dot";
+    case instruction_code::norm: return "norm";
+    case instruction_code::cross: return "cross";
+    case instruction_code::normalize: return "normalize";
+    case instruction_code::operands: return "operands";
+  }
+#define MATH_BYTECODE_SUPERINSTRUCTION_NAME(name, ...) \
+    case instruction_code_count + int(superinstruction::name): return #name;
+  switch (int(code)) {
+    MATH_BYTECODE_SUPERINSTRUCTIONS(MATH_BYTECODE_SUPERINSTRUCTION_NAME)
+  }
+#undef MATH_BYTECODE_SUPERINSTRUCTION_NAME
+  return "unknown";
+}
+
+static void add_sequences(
+    std::map<std::vector<instruction_code>, std::uint64_t>& counts,
+    std::vector<instruction_code> const& codes,
+    std::uint64_t evaluation_count)
+{
+  // vector3 instructions already cover several instructions per dispatch
+  auto const is_fusable = [] (instruction_code code) {
+    return instruction_width(code) == 1 && code != instruction_code::operands;
+  };
+  for (std::size_t length = 2; length <= 3; ++length) {
+    for (std::size_t i = 0; i + length <= codes.size(); ++i) {
+      auto const first = codes.begin() + std::ptrdiff_t(i);
+      auto const last = first + std::ptrdiff_t(length);
+      if (!std::all_of(first, last, is_fusable)) continue;
+      counts[std::vector<instruction_code>(first, last)] += evaluation_count;
+    }
+  }
+}
+
+void sequence_profile::add(host_function const& function, std::uint64_t evaluation_count)
+{
+  std::vector<instruction_code> codes;
+  for (auto& in : function.instructions()) codes.push_back(primitive_code(in.code));
+  add_sequences(counts, codes, evaluation_count);
+}
+
+void write_superinstructions(
+    std::ostream& stream,
+    sequence_profile const& profile,
+    int count)
+{
+  std::vector<std::pair<std::uint64_t, std::vector<instruction_code>>> candidates;
+  for (auto& entry : profile.counts) {
+    candidates.push_back({entry.second * (entry.first.size() - 1), entry.first});
+  }
+  std::stable_sort(candidates.begin(), candidates.end(),
+      [] (auto const& a, auto const& b) { return a.first > b.first; });
+  candidates.resize(std::min(candidates.size(), std::size_t(std::max(count, 0))));
+  // the compiler tries them in order, so longer sequences come first
+  std::stable_sort(candidates.begin(), candidates.end(),
+      [] (auto const& a, auto const& b) { return a.second.size() > b.second.size(); });
+  stream << "#pragma once\n\n"
+    << "// generated by math_bytecode::write_superinstructions from an opcode\n"
+    << "// sequence profile; regenerate it from the profile of another workload\n"
+    << "#define MATH_BYTECODE_SUPERINSTRUCTIONS(X)";
+  for (auto& candidate : candidates) {
+    stream << " \\\n  X(";
+    for (std::size_t i = 0; i < candidate.second.size(); ++i) {
+      stream << (i == 0 ? "" : "_") << instruction_name(candidate.second[i]);
+    }
+    for (instruction_code code : candidate.second) {
+      stream << ", instruction_code::" << instruction_name(code);
+    }
+    stream << ")";
+  }
+  stream << '\n';
+}
+
+#ifdef MATH_BYTECODE_ENABLE_COUNTERS
+
+static std::mutex registered_counters_mutex;
+static std::vector<std::weak_ptr<function_counters>> registered_counters;
+
+std::shared_ptr<function_counters> make_function_counters()
+{
+  auto counters = std::make_shared<function_counters>();
+  std::lock_guard<std::mutex> lock(registered_counters_mutex);
+  registered_counters.erase(
+      std::remove_if(registered_counters.begin(), registered_counters.end(),
+        [] (std::weak_ptr<function_counters> const& registered) {
+          return registered.expired();
+        }),
+      registered_counters.end());
+  registered_counters.push_back(counters);
+  return counters;
+}
+
+void dump_counters(std::ostream& stream)
+{
+  std::lock_guard<std::mutex> lock(registered_counters_mutex);
+  std::uint64_t dispatch_counts[dispatch_code_count] = {};
+  std::uint64_t dispatch_cycles[dispatch_code_count] = {};
+  for (std::size_t i = 0; i < registered_counters.size(); ++i) {
+    auto const counters = registered_counters[i].lock();
+    if (counters == nullptr || counters->evaluation_count == 0) continue;
+    stream << (counters->name.empty() ? "function " + std::to_string(i) : counters->name)
+      << ": " << counters->evaluation_count << " evaluations in "
+      << counters->total_nanoseconds << " ns\n";
+    for (int j = 0; j < dispatch_code_count; ++j) {
+      dispatch_counts[j] += counters->dispatch_counts[j];
+      dispatch_cycles[j] += counters->dispatch_cycles[j];
+    }
+  }
+  for (int j = 0; j < dispatch_code_count; ++j) {
+    if (dispatch_counts[j] == 0) continue;
+    stream << instruction_name(instruction_code(j))
+      << ": " << dispatch_counts[j] << " dispatches";
+    if (dispatch_cycles[j] != 0) {
+      stream << " in " << dispatch_cycles[j] << " cycles";
+    }
+    stream << '\n';
+  }
+}
+
+sequence_profile profile_counters()
+{
+  std::lock_guard<std::mutex> lock(registered_counters_mutex);
+  sequence_profile profile;
+  for (auto& registered : registered_counters) {
+    auto const counters = registered.lock();
+    if (counters == nullptr || counters->evaluation_count == 0) continue;
+    add_sequences(profile.counts, counters->instruction_codes, counters->evaluation_count);
+  }
+  return profile;
+}
+
+void reset_counters()
+{
+  std::lock_guard<std::mutex> lock(registered_counters_mutex);
+  for (auto& registered : registered_counters) {
+    if (auto const counters = registered.lock()) counters->reset();
+  }
+}
+
+#endif
+
 }
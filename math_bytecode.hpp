@@ -1,14 +1,38 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
 #include <cmath>
+#include <cstring>
+#include <functional>
+#include <iosfwd>
+#include <limits>
+#include <map>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #include "p3a_macros.hpp"
 #include "p3a_dynamic_array.hpp"
 #include "p3a_quantity.hpp"
 
+#include "math_bytecode_superinstructions.hpp"
+
+#ifdef MATH_BYTECODE_ENABLE_COUNTERS
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#if defined(MATH_BYTECODE_ENABLE_CYCLE_COUNTERS) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+// counters live in host memory, so device code skips them
+#if !defined(__CUDA_ARCH__) && !defined(__HIP_DEVICE_COMPILE__) && !defined(__SYCL_DEVICE_ONLY__)
+#define MATH_BYTECODE_COUNT_ON_HOST
+#endif
+#endif
+
 namespace math_bytecode {
 
 enum class instruction_code : std::int32_t {
@@ -23,7 +47,10 @@ enum class instruction_code : std::int32_t {
   sin,
   cos,
   exp,
+  log,
   pow,
+  // pow(x, 0.5): sqrt(x), except that -0 and -infinity give +0 and +infinity
+  pow_half,
   conditional_copy,
   logical_or,
   logical_and,
@@ -33,11 +60,873 @@ enum class instruction_code : std::int32_t {
   less,
   less_or_equal,
   greater,
-  greater_or_equal
+  greater_or_equal,
+  min,
+  max,
+  abs,
+  clamp,
+  table1d,
+  table2d,
+  dot,
+  norm,
+  cross,
+  normalize,
+  operands
+};
+
+inline constexpr int instruction_code_count = int(instruction_code::operands) + 1;
+
+// the vector3 instructions take their operands one component per
+// instruction: component 0 in the instruction itself and components 1 and 2
+// in the two operands instructions that follow it. Results that are
+// vectors are spread the same way, scalar results are in the first one
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline constexpr int instruction_width(instruction_code code)
+{
+  return (code == instruction_code::dot || code == instruction_code::norm ||
+      code == instruction_code::cross || code == instruction_code::normalize) ? 3 : 1;
+}
+
+inline constexpr bool has_right_operand(instruction_code code)
+{
+  switch (code) {
+    case instruction_code::copy:
+    case instruction_code::negate:
+    case instruction_code::assign_constant:
+    case instruction_code::sqrt:
+    case instruction_code::pow_half:
+    case instruction_code::sin:
+    case instruction_code::cos:
+    case instruction_code::exp:
+    case instruction_code::log:
+    case instruction_code::logical_not:
+    case instruction_code::abs:
+    // the right operand of a table lookup is the table index
+    case instruction_code::table1d:
+    case instruction_code::table2d:
+    case instruction_code::norm:
+    case instruction_code::normalize:
+      return false;
+    case instruction_code::add:
+    case instruction_code::subtract:
+    case instruction_code::multiply:
+    case instruction_code::divide:
+    case instruction_code::pow:
+    case instruction_code::conditional_copy:
+    case instruction_code::logical_or:
+    case instruction_code::logical_and:
+    case instruction_code::equal:
+    case instruction_code::not_equal:
+    case instruction_code::less:
+    case instruction_code::less_or_equal:
+    case instruction_code::greater:
+    case instruction_code::greater_or_equal:
+    case instruction_code::min:
+    case instruction_code::max:
+    case instruction_code::clamp:
+    case instruction_code::dot:
+    case instruction_code::cross:
+    // either operand may be -1 (absent)
+    case instruction_code::operands:
+      return true;
+  }
+  return false;
+}
+
+// instructions whose result register holds one of their inputs
+inline constexpr bool reads_result(instruction_code code)
+{
+  return code == instruction_code::conditional_copy || code == instruction_code::clamp ||
+    code == instruction_code::table2d;
+}
+
+// a superinstruction executes a fixed sequence of consecutive instructions
+// in one dispatch. The first instruction of the sequence carries the code
+// of the superinstruction and the others keep their own
+#define MATH_BYTECODE_SUPERINSTRUCTION_ENUMERATOR(name, ...) name,
+enum class superinstruction : std::int32_t {
+  MATH_BYTECODE_SUPERINSTRUCTIONS(MATH_BYTECODE_SUPERINSTRUCTION_ENUMERATOR)
+};
+#undef MATH_BYTECODE_SUPERINSTRUCTION_ENUMERATOR
+
+#define MATH_BYTECODE_SUPERINSTRUCTION_ONE(name, ...) + 1
+inline constexpr int superinstruction_count =
+  0 MATH_BYTECODE_SUPERINSTRUCTIONS(MATH_BYTECODE_SUPERINSTRUCTION_ONE);
+#undef MATH_BYTECODE_SUPERINSTRUCTION_ONE
+
+inline constexpr int dispatch_code_count = instruction_code_count + superinstruction_count;
+
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline constexpr instruction_code superinstruction_code(superinstruction s)
+{
+  return instruction_code(instruction_code_count + int(s));
+}
+
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline constexpr bool is_superinstruction(instruction_code code)
+{
+  return int(code) >= instruction_code_count;
+}
+
+template <class... Rest>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline constexpr instruction_code first_instruction_code(instruction_code first, Rest...)
+{
+  return first;
+}
+
+// the code of the instruction that a superinstruction starts with
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline constexpr instruction_code primitive_code(instruction_code code)
+{
+#define MATH_BYTECODE_SUPERINSTRUCTION_FIRST(name, ...) \
+  case instruction_code_count + int(superinstruction::name): \
+    return first_instruction_code(__VA_ARGS__);
+  switch (int(code)) {
+    MATH_BYTECODE_SUPERINSTRUCTIONS(MATH_BYTECODE_SUPERINSTRUCTION_FIRST)
+  }
+#undef MATH_BYTECODE_SUPERINSTRUCTION_FIRST
+  return code;
+}
+
+// library calls p3a's math functions. The others select the branch-free
+// polynomial kernels below, which vectorize in execute_batch and are
+// accurate to about one or four ulps. sin and cos of arguments too large to
+// reduce accurately fall back to the library
+enum class math_accuracy : std::int32_t {
+  library,
+  one_ulp,
+  four_ulp
+};
+
+template <class ScalarType>
+class polynomial_traits;
+
+template <>
+class polynomial_traits<double> {
+ public:
+  using integer_type = std::int64_t;
+  static constexpr int mantissa_bits = 52;
+  static constexpr int exponent_bias = 1023;
+  static constexpr integer_type log_offset = 0x3fe6a09e667f3bcd;
+  static constexpr integer_type exponent_mask = integer_type(0xfff) << 52;
+  static constexpr double min_normal = 2.2250738585072014e-308;
+  static constexpr double subnormal_scale = 4503599627370496.0;
+  static constexpr double log2_e = 1.4426950408889634;
+  static constexpr double two_over_pi = 0.6366197723675814;
+  static constexpr double ln2_high = 0.6931471806019545;
+  static constexpr double ln2_low = -4.2009150726810846e-11;
+  static constexpr double pi_over_two_high = 1.5707963267341256;
+  static constexpr double pi_over_two_middle = 6.077100506303966e-11;
+  static constexpr double pi_over_two_low = 2.0222662487959506e-21;
+  static constexpr double exp_argument_limit = 746.0;
+  static constexpr double split_factor = 134217729.0;
+  static constexpr double round_shifter = 6755399441055744.0;
+  static constexpr double integer_threshold = 4503599627370496.0;
+  static constexpr integer_type round_shifter_bits = 0x4338000000000000;
+  // number of series terms, indexed by math_accuracy
+  static constexpr int exp_terms[3] = {0, 13, 12};
+  static constexpr int log_terms[3] = {0, 10, 9};
+  static constexpr int sin_terms[3] = {0, 8, 7};
+  static constexpr int cos_terms[3] = {0, 9, 8};
+  static constexpr double trigonometric_argument_limit[3] = {0.0, 262144.0, 1048576.0};
+};
+
+template <>
+class polynomial_traits<float> {
+ public:
+  using integer_type = std::int32_t;
+  static constexpr int mantissa_bits = 23;
+  static constexpr int exponent_bias = 127;
+  static constexpr integer_type log_offset = 0x3f330000;
+  static constexpr integer_type exponent_mask = integer_type(0xff800000);
+  static constexpr float min_normal = 1.17549435e-38f;
+  static constexpr float subnormal_scale = 8388608.0f;
+  static constexpr float log2_e = 1.44269504f;
+  static constexpr float two_over_pi = 0.636619772f;
+  static constexpr float ln2_high = 0.693115234375f;
+  static constexpr float ln2_low = 3.19461849e-05f;
+  static constexpr float pi_over_two_high = 1.57080078125f;
+  static constexpr float pi_over_two_middle = -4.45358455e-06f;
+  static constexpr float pi_over_two_low = -8.70551570e-10f;
+  static constexpr float exp_argument_limit = 104.0f;
+  static constexpr float split_factor = 4097.0f;
+  static constexpr float round_shifter = 12582912.0f;
+  static constexpr float integer_threshold = 8388608.0f;
+  static constexpr integer_type round_shifter_bits = 0x4b400000;
+  static constexpr int exp_terms[3] = {0, 7, 6};
+  static constexpr int log_terms[3] = {0, 5, 4};
+  static constexpr int sin_terms[3] = {0, 4, 4};
+  static constexpr int cos_terms[3] = {0, 5, 4};
+  static constexpr float trigonometric_argument_limit[3] = {0.0f, 128.0f, 2048.0f};
+};
+
+template <int N>
+inline constexpr double inverse_factorial = inverse_factorial<N - 1> / double(N);
+template <>
+inline constexpr double inverse_factorial<0> = 1.0;
+
+// sum over n from First to Last of x^(n - First) / n!
+template <int First, int Last, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType exp_series(ScalarType x)
+{
+  if constexpr (First == Last) {
+    return ScalarType(inverse_factorial<First>);
+  } else {
+    return ScalarType(inverse_factorial<First>) + x * exp_series<First + 1, Last>(x);
+  }
+}
+
+// sum over k from First to Last of (-1)^k z^(k - First) / (2k + Offset)!
+template <int First, int Last, int Offset, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType alternating_series(ScalarType z)
+{
+  constexpr double coefficient =
+    (First % 2 == 0 ? 1.0 : -1.0) * inverse_factorial<2 * First + Offset>;
+  if constexpr (First == Last) {
+    return ScalarType(coefficient);
+  } else {
+    return ScalarType(coefficient) + z * alternating_series<First + 1, Last, Offset>(z);
+  }
+}
+
+// sum over k from First to Last of 2 z^(k - First) / (2k + 1)
+template <int First, int Last, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType atanh_series(ScalarType z)
+{
+  constexpr double coefficient = 2.0 / double(2 * First + 1);
+  if constexpr (First == Last) {
+    return ScalarType(coefficient);
+  } else {
+    return ScalarType(coefficient) + z * atanh_series<First + 1, Last>(z);
+  }
+}
+
+// The polynomial kernels below avoid libm rounding functions and
+// float-int conversions, which GCC either calls out of line or refuses to
+// if-convert, and need value-safe floating point (no -ffast-math).
+
+// rounds x to the nearest integer, also returned as n, for
+// |x| < 2^(mantissa_bits - 1)
+template <class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType round_to_integer(
+    ScalarType x, typename polynomial_traits<ScalarType>::integer_type& n)
+{
+  using traits = polynomial_traits<ScalarType>;
+  ScalarType const shifted = x + traits::round_shifter;
+  std::memcpy(&n, &shifted, sizeof(n));
+  n -= traits::round_shifter_bits;
+  return shifted - traits::round_shifter;
+}
+
+// the inverse for |n| < 2^(mantissa_bits - 1)
+template <class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType integer_to_scalar(typename polynomial_traits<ScalarType>::integer_type n)
+{
+  using traits = polynomial_traits<ScalarType>;
+  auto const bits = n + traits::round_shifter_bits;
+  ScalarType shifted;
+  std::memcpy(&shifted, &bits, sizeof(shifted));
+  return shifted - traits::round_shifter;
+}
+
+// condition ? a : b with bit operations, since with -ftrapping-math GCC
+// would otherwise sink the computation of a and b into branches
+template <class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType blend(bool condition, ScalarType a, ScalarType b)
+{
+  using integer_type = typename polynomial_traits<ScalarType>::integer_type;
+  integer_type const mask = -integer_type(condition);
+  integer_type a_bits, b_bits;
+  std::memcpy(&a_bits, &a, sizeof(a_bits));
+  std::memcpy(&b_bits, &b, sizeof(b_bits));
+  integer_type const bits = (a_bits & mask) | (b_bits & ~mask);
+  ScalarType result;
+  std::memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+// 2^n for n in the normal exponent range
+template <class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType power_of_two(typename polynomial_traits<ScalarType>::integer_type n)
+{
+  using traits = polynomial_traits<ScalarType>;
+  using unsigned_type = std::make_unsigned_t<typename traits::integer_type>;
+  auto const bits = unsigned_type(n + traits::exponent_bias) << traits::mantissa_bits;
+  ScalarType result;
+  std::memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+template <math_accuracy Accuracy, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType polynomial_exp(ScalarType x)
+{
+  using traits = polynomial_traits<ScalarType>;
+  constexpr int terms = traits::exp_terms[int(Accuracy)];
+  // past this limit the scaling below overflows to inf or underflows to 0
+  ScalarType const limit = traits::exp_argument_limit;
+  ScalarType const y = blend(x < -limit, -limit, blend(x > limit, limit, x));
+  typename traits::integer_type n;
+  ScalarType const k = round_to_integer(y * traits::log2_e, n);
+  ScalarType const r_high = y - k * traits::ln2_high;
+  ScalarType const r_low = k * traits::ln2_low;
+  ScalarType const r = r_high - r_low;
+  ScalarType const series = ScalarType(1) +
+    (r + (((r_high - r) - r_low) + r * r * exp_series<2, terms>(r)));
+  auto const half_n = n >> 1;
+  return series * power_of_two<ScalarType>(half_n) * power_of_two<ScalarType>(n - half_n);
+}
+
+// splits positive finite x into 2^k m with m in [sqrt(1/2), sqrt(2))
+template <class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType split_logarithm_argument(ScalarType x, ScalarType& k)
+{
+  using traits = polynomial_traits<ScalarType>;
+  using integer_type = typename traits::integer_type;
+  bool const is_subnormal = x < traits::min_normal;
+  ScalarType const normal_x = blend(is_subnormal, x * traits::subnormal_scale, x);
+  integer_type bits;
+  std::memcpy(&bits, &normal_x, sizeof(bits));
+  integer_type const offset_bits = bits - traits::log_offset;
+  integer_type const mantissa_bits = bits - (offset_bits & traits::exponent_mask);
+  ScalarType m;
+  std::memcpy(&m, &mantissa_bits, sizeof(m));
+  k = integer_to_scalar<ScalarType>(offset_bits >> traits::mantissa_bits) -
+    blend(is_subnormal, ScalarType(traits::mantissa_bits), ScalarType(0));
+  return m;
+}
+
+template <math_accuracy Accuracy, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType polynomial_log(ScalarType x)
+{
+  using traits = polynomial_traits<ScalarType>;
+  constexpr int terms = traits::log_terms[int(Accuracy)];
+  ScalarType k;
+  ScalarType const m = split_logarithm_argument(x, k);
+  // log(m) = 2 atanh(s) = f - (f^2/2 - s (f^2/2 + R))
+  ScalarType const f = m - ScalarType(1);
+  ScalarType const s = f / (ScalarType(2) + f);
+  ScalarType const z = s * s;
+  ScalarType const R = z * atanh_series<1, terms>(z);
+  ScalarType const half_f_squared = ScalarType(0.5) * f * f;
+  ScalarType const result = k * traits::ln2_high -
+    ((half_f_squared - (s * (half_f_squared + R) + k * traits::ln2_low)) - f);
+  ScalarType const finite_result = blend(
+      x < std::numeric_limits<ScalarType>::infinity(), result, x);
+  ScalarType const nonzero_result = blend(
+      x == ScalarType(0), -std::numeric_limits<ScalarType>::infinity(), finite_result);
+  return blend(
+      x < ScalarType(0), std::numeric_limits<ScalarType>::quiet_NaN(), nonzero_result);
+}
+
+// reduces x to r + r_low in [-pi/4, pi/4] with x = r + k pi/2, and the
+// quadrant being k mod 4. k pi_over_two_high is exact for magnitudes below
+// about 1.6e6 (6.4e3 in single precision), but the rounding of the other
+// two products grows with k, so polynomial_sin and polynomial_cos keep
+// their accuracy only below trigonometric_argument_limit
+template <class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline void reduce_trigonometric_argument(
+    ScalarType x,
+    ScalarType& r,
+    ScalarType& r_low,
+    typename polynomial_traits<ScalarType>::integer_type& quadrant)
+{
+  using traits = polynomial_traits<ScalarType>;
+  typename traits::integer_type n;
+  ScalarType const k = round_to_integer(x * traits::two_over_pi, n);
+  ScalarType const a = x - k * traits::pi_over_two_high;
+  ScalarType const b = k * traits::pi_over_two_middle;
+  r = a - b;
+  r_low = ((a - r) - b) - k * traits::pi_over_two_low;
+  quadrant = n & 3;
+}
+
+template <math_accuracy Accuracy, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType sin_kernel(ScalarType r, ScalarType r_low)
+{
+  constexpr int terms = polynomial_traits<ScalarType>::sin_terms[int(Accuracy)];
+  ScalarType const z = r * r;
+  return r + (r_low * (ScalarType(1) - ScalarType(0.5) * z) +
+      r * z * alternating_series<1, terms, 1>(z));
+}
+
+template <math_accuracy Accuracy, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType cos_kernel(ScalarType r, ScalarType r_low)
+{
+  constexpr int terms = polynomial_traits<ScalarType>::cos_terms[int(Accuracy)];
+  ScalarType const z = r * r;
+  ScalarType const half_z = ScalarType(0.5) * z;
+  // w + ((1 - w) - half_z) recovers the rounding error of 1 - half_z
+  ScalarType const w = ScalarType(1) - half_z;
+  return w + (((ScalarType(1) - w) - half_z) +
+      (z * z * alternating_series<2, terms, 0>(z) - r * r_low));
+}
+
+// whether polynomial_sin and polynomial_cos are within Accuracy at x,
+// which is false for infinities and NaN
+template <math_accuracy Accuracy, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline bool is_reducible_trigonometric_argument(ScalarType x)
+{
+  constexpr ScalarType limit =
+    polynomial_traits<ScalarType>::trigonometric_argument_limit[int(Accuracy)];
+  return -limit < x && x < limit;
+}
+
+template <math_accuracy Accuracy, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType polynomial_sin(ScalarType x)
+{
+  ScalarType r, r_low;
+  typename polynomial_traits<ScalarType>::integer_type quadrant;
+  reduce_trigonometric_argument(x, r, r_low, quadrant);
+  ScalarType const s = sin_kernel<Accuracy>(r, r_low);
+  ScalarType const c = cos_kernel<Accuracy>(r, r_low);
+  // quadrants 1 and 3 swap sin and cos, quadrants 2 and 3 negate
+  return blend((quadrant & 1) == 0, s, c) *
+    integer_to_scalar<ScalarType>(1 - (quadrant & 2));
+}
+
+template <math_accuracy Accuracy, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType polynomial_cos(ScalarType x)
+{
+  ScalarType r, r_low;
+  typename polynomial_traits<ScalarType>::integer_type quadrant;
+  reduce_trigonometric_argument(x, r, r_low, quadrant);
+  ScalarType const s = sin_kernel<Accuracy>(r, r_low);
+  ScalarType const c = cos_kernel<Accuracy>(r, r_low);
+  // quadrants 1 and 3 swap sin and cos, quadrants 1 and 2 negate
+  return blend((quadrant & 1) == 0, c, s) *
+    integer_to_scalar<ScalarType>(1 - ((quadrant + 1) & 2));
+}
+
+// exact a * b = high + low by Veltkamp splitting, which unlike fma
+// vectorizes on every target
+template <class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline void two_product(ScalarType a, ScalarType b, ScalarType& high, ScalarType& low)
+{
+  ScalarType const split = polynomial_traits<ScalarType>::split_factor;
+  ScalarType const a_split = split * a;
+  ScalarType const a_high = a_split - (a_split - a);
+  ScalarType const a_low = a - a_high;
+  ScalarType const b_split = split * b;
+  ScalarType const b_high = b_split - (b_split - b);
+  ScalarType const b_low = b - b_high;
+  high = a * b;
+  low = ((a_high * b_high - high) + a_high * b_low + a_low * b_high) + a_low * b_low;
+}
+
+// log(x) = high + low to about twice the working precision, for pow.
+// x must be positive and finite
+template <math_accuracy Accuracy, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline void extended_log(ScalarType x, ScalarType& high, ScalarType& low)
+{
+  using traits = polynomial_traits<ScalarType>;
+  constexpr int terms = traits::log_terms[int(Accuracy)];
+  ScalarType k;
+  ScalarType const m = split_logarithm_argument(x, k);
+  // s = f / (2 + f) to double the working precision
+  ScalarType const f = m - ScalarType(1);
+  ScalarType const t = ScalarType(2) + f;
+  ScalarType const t_low = f - (t - ScalarType(2));
+  ScalarType const s = f / t;
+  ScalarType st_high, st_low;
+  two_product(s, t, st_high, st_low);
+  ScalarType const s_low = (((f - st_high) - st_low) - s * t_low) / t;
+  // log(m) = 2 s + 2 s^3 / 3 + ...
+  ScalarType const z = s * s;
+  ScalarType const tail = ScalarType(2) * s_low + s * z * atanh_series<1, terms>(z);
+  ScalarType const k_high = k * traits::ln2_high;
+  ScalarType const two_s = ScalarType(2) * s;
+  ScalarType const sum = k_high + two_s;
+  ScalarType const rest = ((k_high - sum) + two_s) + (tail + k * traits::ln2_low);
+  high = sum + rest;
+  low = (sum - high) + rest;
+}
+
+// computed as exp(y log(x)) with log(x) and the product carried to about
+// twice the working precision
+template <math_accuracy Accuracy, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType polynomial_pow(ScalarType x, ScalarType y)
+{
+  ScalarType const abs_x = blend(x < ScalarType(0), -x, x);
+  bool const is_finite_nonzero =
+    (abs_x > ScalarType(0)) & (abs_x < std::numeric_limits<ScalarType>::infinity());
+  ScalarType log_high, log_low;
+  extended_log<Accuracy>(blend(is_finite_nonzero, abs_x, ScalarType(1)), log_high, log_low);
+  // log(abs_x) is +-inf when abs_x is not finite and nonzero
+  log_high = blend(is_finite_nonzero, log_high, polynomial_log<Accuracy>(abs_x));
+  log_low = blend(is_finite_nonzero, log_low, ScalarType(0));
+  ScalarType product_high, product_low;
+  two_product(y, log_high, product_high, product_low);
+  // the low part is meaningless (or NaN) when exp overflows or underflows
+  ScalarType const limit = polynomial_traits<ScalarType>::exp_argument_limit;
+  bool const is_moderate = (product_high > -limit) & (product_high < limit);
+  product_low = product_low + blend(is_finite_nonzero, y * log_low, ScalarType(0));
+  ScalarType const exp_high = polynomial_exp<Accuracy>(product_high);
+  ScalarType const magnitude = blend(is_moderate, exp_high + exp_high * product_low, exp_high);
+  // y is an integer when t - 2 round(t / 2) is -1, 0 or 1 and odd when it
+  // is nonzero, where t = |y| below 2^mantissa_bits and |y| - 2^mantissa_bits
+  // above it, where every y is an integer and those past
+  // 2^(mantissa_bits + 1) are even. bitwise rather than logical operators
+  // keep the loop free of branches
+  using traits = polynomial_traits<ScalarType>;
+  ScalarType const abs_y = blend(y < ScalarType(0), -y, y);
+  bool const is_small = abs_y < traits::integer_threshold;
+  ScalarType const t = blend(is_small, abs_y, abs_y - traits::integer_threshold);
+  typename traits::integer_type half_t;
+  ScalarType const remainder = t - ScalarType(2) * round_to_integer(ScalarType(0.5) * t, half_t);
+  bool const y_is_integer = (!is_small) | (remainder == ScalarType(0)) |
+    (remainder == ScalarType(1)) | (remainder == ScalarType(-1));
+  bool const y_is_odd = y_is_integer & (remainder != ScalarType(0)) &
+    (abs_y < ScalarType(2) * traits::integer_threshold);
+  using std::copysign;
+  bool const x_is_negative = copysign(ScalarType(1), x) < ScalarType(0);
+  ScalarType const infinity = std::numeric_limits<ScalarType>::infinity();
+  ScalarType const negative_x_result = blend(
+      y_is_integer | (abs_x == infinity) | (abs_x == ScalarType(0)),
+      blend(y_is_odd, -magnitude, magnitude),
+      std::numeric_limits<ScalarType>::quiet_NaN());
+  bool const is_one = (y == ScalarType(0)) | (x == ScalarType(1)) |
+    ((x == ScalarType(-1)) & (abs_y == infinity));
+  return blend(is_one, ScalarType(1), blend(x_is_negative, negative_x_result, magnitude));
+}
+
+// adding +0 turns -0 into +0, the only other case where sqrt and pow differ
+template <class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType pow_half(ScalarType x)
+{
+  using std::sqrt;
+  ScalarType const infinity = std::numeric_limits<ScalarType>::infinity();
+  return blend(x == -infinity, infinity, ScalarType(sqrt(x + ScalarType(0))));
+}
+
+class sin_function {
+ public:
+  template <math_accuracy Accuracy, class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  static inline bool is_in_polynomial_range(ScalarType x, ScalarType)
+  {
+    return is_reducible_trigonometric_argument<Accuracy>(x);
+  }
+  template <math_accuracy Accuracy, class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  static inline ScalarType evaluate(ScalarType x, ScalarType)
+  {
+    if constexpr (Accuracy == math_accuracy::library) return p3a::sin(x);
+    else return polynomial_sin<Accuracy>(x);
+  }
+};
+
+class cos_function {
+ public:
+  template <math_accuracy Accuracy, class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  static inline bool is_in_polynomial_range(ScalarType x, ScalarType)
+  {
+    return is_reducible_trigonometric_argument<Accuracy>(x);
+  }
+  template <math_accuracy Accuracy, class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  static inline ScalarType evaluate(ScalarType x, ScalarType)
+  {
+    if constexpr (Accuracy == math_accuracy::library) return p3a::cos(x);
+    else return polynomial_cos<Accuracy>(x);
+  }
+};
+
+class exp_function {
+ public:
+  template <math_accuracy Accuracy, class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  static inline bool is_in_polynomial_range(ScalarType, ScalarType)
+  {
+    return true;
+  }
+  template <math_accuracy Accuracy, class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  static inline ScalarType evaluate(ScalarType x, ScalarType)
+  {
+    if constexpr (Accuracy == math_accuracy::library) return p3a::exp(x);
+    else return polynomial_exp<Accuracy>(x);
+  }
+};
+
+class log_function {
+ public:
+  template <math_accuracy Accuracy, class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  static inline bool is_in_polynomial_range(ScalarType, ScalarType)
+  {
+    return true;
+  }
+  template <math_accuracy Accuracy, class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  static inline ScalarType evaluate(ScalarType x, ScalarType)
+  {
+    using std::log;
+    if constexpr (Accuracy == math_accuracy::library) return log(x);
+    else return polynomial_log<Accuracy>(x);
+  }
+};
+
+class pow_function {
+ public:
+  template <math_accuracy Accuracy, class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  static inline bool is_in_polynomial_range(ScalarType, ScalarType)
+  {
+    return true;
+  }
+  template <math_accuracy Accuracy, class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  static inline ScalarType evaluate(ScalarType x, ScalarType y)
+  {
+    if constexpr (Accuracy == math_accuracy::library) return p3a::pow(x, y);
+    else return polynomial_pow<Accuracy>(x, y);
+  }
+};
+
+template <class Function, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType evaluate_math_function(math_accuracy accuracy, ScalarType x, ScalarType y)
+{
+  switch (accuracy) {
+    case math_accuracy::one_ulp:
+      if (!Function::template is_in_polynomial_range<math_accuracy::one_ulp>(x, y)) break;
+      return Function::template evaluate<math_accuracy::one_ulp>(x, y);
+    case math_accuracy::four_ulp:
+      if (!Function::template is_in_polynomial_range<math_accuracy::four_ulp>(x, y)) break;
+      return Function::template evaluate<math_accuracy::four_ulp>(x, y);
+    case math_accuracy::library:
+      break;
+  }
+  return Function::template evaluate<math_accuracy::library>(x, y);
+}
+
+// whether every point of a batch is within the range of the polynomial
+template <class Function, math_accuracy Accuracy, class FastType, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline bool is_in_polynomial_range(
+    int count,
+    ScalarType const* left,
+    ScalarType const* right)
+{
+  bool result = true;
+  for (int i = 0; i < count; ++i) {
+    result &= Function::template is_in_polynomial_range<Accuracy>(
+        FastType(left[i]), FastType(right[i]));
+  }
+  return result;
+}
+
+// the switch is outside the loop so that the loop can vectorize. A batch
+// with any point outside the range of the polynomial uses the library for
+// every point, which keeps the polynomial loops free of branches
+template <class Function, class FastType, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline void evaluate_math_function(
+    math_accuracy accuracy,
+    int count,
+    ScalarType* result,
+    ScalarType const* left,
+    ScalarType const* right)
+{
+  switch (accuracy) {
+    case math_accuracy::one_ulp:
+      if (!is_in_polynomial_range<Function, math_accuracy::one_ulp, FastType>(
+            count, left, right)) break;
+      for (int i = 0; i < count; ++i) {
+        result[i] = ScalarType(Function::template evaluate<math_accuracy::one_ulp>(
+              FastType(left[i]), FastType(right[i])));
+      }
+      return;
+    case math_accuracy::four_ulp:
+      if (!is_in_polynomial_range<Function, math_accuracy::four_ulp, FastType>(
+            count, left, right)) break;
+      for (int i = 0; i < count; ++i) {
+        result[i] = ScalarType(Function::template evaluate<math_accuracy::four_ulp>(
+              FastType(left[i]), FastType(right[i])));
+      }
+      return;
+    case math_accuracy::library:
+      break;
+  }
+  for (int i = 0; i < count; ++i) {
+    result[i] = ScalarType(Function::template evaluate<math_accuracy::library>(
+          FastType(left[i]), FastType(right[i])));
+  }
+}
+
+enum class interpolation : std::int32_t {
+  linear,
+  cubic
+};
+
+// where a table lives in the data pool of a compiled_function. Each axis is
+// stored as its abscissas followed by their inverse spacing (zero when the
+// spacing is not uniform), then come the values, x varying fastest
+class table_descriptor {
+ public:
+  std::int32_t offset;
+  std::int32_t x_count;
+  std::int32_t y_count;
+  interpolation method;
+};
+
+// the interval of the axis containing x, which must be within the axis
+template <class ScalarType, class DataType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline int find_table_interval(DataType const* axis, int count, ScalarType x)
+{
+  ScalarType const inverse_spacing(axis[count]);
+  if (inverse_spacing != ScalarType(0.0)) {
+    int const i = int((x - ScalarType(axis[0])) * inverse_spacing);
+    return i < count - 2 ? i : count - 2;
+  }
+  int low = 0;
+  int high = count - 1;
+  while (high - low > 1) {
+    int const middle = (low + high) / 2;
+    if (x < ScalarType(axis[middle])) high = middle;
+    else low = middle;
+  }
+  return low;
+}
+
+// nodes[k] is the value at abscissa i - 1 + k, or zero past the ends
+template <class ScalarType, class DataType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline void gather_table_nodes(DataType const* values, int count, int i, ScalarType* nodes)
+{
+  for (int k = 0; k < 4; ++k) {
+    int const node = i - 1 + k;
+    nodes[k] = (node >= 0 && node < count) ? ScalarType(values[node]) : ScalarType(0.0);
+  }
+}
+
+// cubic is a Hermite spline with finite difference slopes
+template <class ScalarType, class DataType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType interpolate_table_interval(
+    DataType const* axis,
+    int count,
+    int i,
+    ScalarType x,
+    interpolation method,
+    ScalarType const* nodes)
+{
+  ScalarType const width = ScalarType(axis[i + 1]) - ScalarType(axis[i]);
+  ScalarType const t = (x - ScalarType(axis[i])) / width;
+  ScalarType const difference = nodes[2] - nodes[1];
+  if (method == interpolation::linear) return nodes[1] + t * difference;
+  ScalarType const left_slope = (i > 0) ?
+    (nodes[2] - nodes[0]) / (ScalarType(axis[i + 1]) - ScalarType(axis[i - 1])) :
+    difference / width;
+  ScalarType const right_slope = (i + 2 < count) ?
+    (nodes[3] - nodes[1]) / (ScalarType(axis[i + 2]) - ScalarType(axis[i])) :
+    difference / width;
+  ScalarType const t2 = t * t;
+  ScalarType const t3 = t2 * t;
+  return
+    (ScalarType(2.0) * t3 - ScalarType(3.0) * t2 + ScalarType(1.0)) * nodes[1] +
+    (t3 - ScalarType(2.0) * t2 + t) * width * left_slope +
+    (ScalarType(3.0) * t2 - ScalarType(2.0) * t3) * nodes[2] +
+    (t3 - t2) * width * right_slope;
+}
+
+template <class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType clamp_to_axis(ScalarType x, ScalarType first, ScalarType last)
+{
+  return p3a::condition(x < first, first, p3a::condition(x > last, last, x));
+}
+
+// outside the table the nearest tabulated value is used
+template <class ScalarType, class DataType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType evaluate_table1d(
+    table_descriptor const& table,
+    DataType const* data,
+    ScalarType x)
+{
+  if (x != x) return x;
+  DataType const* const axis = data + table.offset;
+  DataType const* const values = axis + table.x_count + 1;
+  x = clamp_to_axis(x, ScalarType(axis[0]), ScalarType(axis[table.x_count - 1]));
+  int const i = find_table_interval(axis, table.x_count, x);
+  ScalarType nodes[4];
+  gather_table_nodes(values, table.x_count, i, nodes);
+  return interpolate_table_interval(axis, table.x_count, i, x, table.method, nodes);
+}
+
+template <class ScalarType, class DataType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline ScalarType evaluate_table2d(
+    table_descriptor const& table,
+    DataType const* data,
+    ScalarType x,
+    ScalarType y)
+{
+  if (x != x) return x;
+  if (y != y) return y;
+  DataType const* const x_axis = data + table.offset;
+  DataType const* const y_axis = x_axis + table.x_count + 1;
+  DataType const* const values = y_axis + table.y_count + 1;
+  x = clamp_to_axis(x, ScalarType(x_axis[0]), ScalarType(x_axis[table.x_count - 1]));
+  y = clamp_to_axis(y, ScalarType(y_axis[0]), ScalarType(y_axis[table.y_count - 1]));
+  int const i = find_table_interval(x_axis, table.x_count, x);
+  int const j = find_table_interval(y_axis, table.y_count, y);
+  // interpolate along x in the rows the y interpolation needs
+  ScalarType rows[4];
+  for (int k = 0; k < 4; ++k) {
+    int const row = j - 1 + k;
+    rows[k] = ScalarType(0.0);
+    if (row < 0 || row >= table.y_count) continue;
+    if (table.method == interpolation::linear && (k == 0 || k == 3)) continue;
+    ScalarType nodes[4];
+    gather_table_nodes(values + std::ptrdiff_t(row) * table.x_count, table.x_count, i, nodes);
+    rows[k] = interpolate_table_interval(x_axis, table.x_count, i, x, table.method, nodes);
+  }
+  return interpolate_table_interval(y_axis, table.y_count, j, y, table.method, rows);
+}
+
+// what instructions need besides their registers
+template <class ConstantType>
+class execution_context {
+ public:
+  math_accuracy accuracy{math_accuracy::library};
+  table_descriptor const* tables{nullptr};
+  ConstantType const* table_data{nullptr};
 };
 
-class instruction {
+// ConstantType is how constants are stored, and FastType (if different)
+// is the precision that division and the math functions are evaluated in
+template <class ConstantType, class FastType = ConstantType>
+class basic_instruction {
  public:
+  using constant_type = ConstantType;
+  template <class ScalarType>
+  using fast_type = std::conditional_t<
+    std::is_same_v<ConstantType, FastType>, ScalarType, FastType>;
   std::int32_t result_register;
   instruction_code code;
   union {
@@ -45,219 +934,1252 @@ class instruction {
       std::int32_t left;
       std::int32_t right;
     } input_registers;
-    double constant;
+    ConstantType constant;
   };
   template <class ScalarType>
   P3A_HOST_DEVICE P3A_ALWAYS_INLINE
-  inline void execute(ScalarType* registers) const;
+  inline void execute(
+      ScalarType* registers,
+      execution_context<ConstantType> const& context = execution_context<ConstantType>()) const;
+  // executes the instruction as if its code were code, which lets the
+  // dispatch fold away when code is known at compile time
+  template <class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  inline void execute_as(
+      instruction_code code,
+      ScalarType* registers,
+      execution_context<ConstantType> const& context) const;
+  // register r of point p is registers[r * stride + p]. A scalar
+  // instruction given a destination writes its results there instead
+  template <class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  inline void execute_batch(
+      ScalarType* registers,
+      int count,
+      int stride,
+      execution_context<ConstantType> const& context = execution_context<ConstantType>(),
+      ScalarType* destination = nullptr) const;
+  // the interpreters behind execute_as and execute_batch, which read the
+  // registers and constant of the instruction group through fields (see
+  // instruction_fields) so that other layouts share them
+  template <class Fields, class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  static inline void execute_fields(
+      instruction_code code,
+      Fields const& fields,
+      ScalarType* registers,
+      execution_context<ConstantType> const& context);
+  template <class Fields, class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  static inline void execute_batch_fields(
+      instruction_code code,
+      Fields const& fields,
+      ScalarType* registers,
+      int count,
+      int stride,
+      execution_context<ConstantType> const& context,
+      ScalarType* destination);
+};
+
+// the fields of a group of instructions stored one after another: k is 1
+// and 2 for the operands instructions after a vector3 instruction, and
+// at(k) is the group that starts k instructions later
+template <class Instruction>
+class instruction_fields {
+ public:
+  using instruction_type = Instruction;
+  Instruction const* instructions;
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  int result(int k) const { return instructions[k].result_register; }
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  int left(int k) const { return instructions[k].input_registers.left; }
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  int right(int k) const { return instructions[k].input_registers.right; }
+  // the right operand of a table lookup
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  int table() const { return instructions->input_registers.right; }
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  typename Instruction::constant_type constant() const { return instructions->constant; }
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  instruction_fields at(int k) const { return {instructions + k}; }
+};
+
+// register r is registers[r * stride], for a register file interleaved
+// with those of other threads
+template <class Fields>
+class strided_fields {
+ public:
+  using instruction_type = typename Fields::instruction_type;
+  Fields fields;
+  int stride;
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  int result(int k) const { return fields.result(k) * stride; }
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  int left(int k) const { return fields.left(k) * stride; }
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  int right(int k) const { return fields.right(k) * stride; }
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  int table() const { return fields.table(); }
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  typename instruction_type::constant_type constant() const { return fields.constant(); }
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  strided_fields at(int k) const { return {fields.at(k), stride}; }
 };
 
+using instruction = basic_instruction<double>;
+using single_instruction = basic_instruction<float>;
+using mixed_instruction = basic_instruction<double, float>;
+
+template <class ConstantType, class FastType>
+template <class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline void basic_instruction<ConstantType, FastType>::execute(
+    ScalarType* registers,
+    execution_context<ConstantType> const& context) const {
+  execute_as(primitive_code(this->code), registers, context);
+}
+
+template <class ConstantType, class FastType>
+template <class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline void basic_instruction<ConstantType, FastType>::execute_as(
+    instruction_code code,
+    ScalarType* registers,
+    execution_context<ConstantType> const& context) const {
+  execute_fields(code, instruction_fields<basic_instruction>{this}, registers, context);
+}
+
+template <class ConstantType, class FastType>
+template <class Fields, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline void basic_instruction<ConstantType, FastType>::execute_fields(
+    instruction_code code,
+    Fields const& fields,
+    ScalarType* registers,
+    execution_context<ConstantType> const& context) {
+  using fast_scalar_type = fast_type<ScalarType>;
+  math_accuracy const accuracy = context.accuracy;
+  switch (code) {
+    case instruction_code::copy:
+    {
+      registers[fields.result(0)] =
+        registers[fields.left(0)];
+      break;
+    }
+    case instruction_code::add:
+    {
+      registers[fields.result(0)] =
+        registers[fields.left(0)] +
+        registers[fields.right(0)];
+      break;
+    }
+    case instruction_code::subtract:
+    {
+      registers[fields.result(0)] =
+        registers[fields.left(0)] -
+        registers[fields.right(0)];
+      break;
+    }
+    case instruction_code::multiply:
+    {
+      registers[fields.result(0)] =
+        registers[fields.left(0)] *
+        registers[fields.right(0)];
+      break;
+    }
+    case instruction_code::divide:
+    {
+      registers[fields.result(0)] = ScalarType(
+        fast_scalar_type(registers[fields.left(0)]) /
+        fast_scalar_type(registers[fields.right(0)]));
+      break;
+    }
+    case instruction_code::negate:
+    {
+      registers[fields.result(0)] =
+        -registers[fields.left(0)];
+      break;
+    }
+    case instruction_code::assign_constant:
+    {
+      registers[fields.result(0)] = fields.constant();
+      break;
+    }
+    case instruction_code::sqrt:
+    {
+      using std::sqrt;
+      registers[fields.result(0)] = ScalarType(
+        sqrt(fast_scalar_type(registers[fields.left(0)])));
+      break;
+    }
+    case instruction_code::pow_half:
+    {
+      registers[fields.result(0)] = ScalarType(
+        pow_half(fast_scalar_type(registers[fields.left(0)])));
+      break;
+    }
+    case instruction_code::sin:
+    {
+      fast_scalar_type const x(registers[fields.left(0)]);
+      registers[fields.result(0)] = ScalarType(
+        evaluate_math_function<sin_function>(accuracy, x, x));
+      break;
+    }
+    case instruction_code::cos:
+    {
+      fast_scalar_type const x(registers[fields.left(0)]);
+      registers[fields.result(0)] = ScalarType(
+        evaluate_math_function<cos_function>(accuracy, x, x));
+      break;
+    }
+    case instruction_code::exp:
+    {
+      fast_scalar_type const x(registers[fields.left(0)]);
+      registers[fields.result(0)] = ScalarType(
+        evaluate_math_function<exp_function>(accuracy, x, x));
+      break;
+    }
+    case instruction_code::log:
+    {
+      fast_scalar_type const x(registers[fields.left(0)]);
+      registers[fields.result(0)] = ScalarType(
+        evaluate_math_function<log_function>(accuracy, x, x));
+      break;
+    }
+    case instruction_code::pow:
+    {
+      registers[fields.result(0)] =
+        evaluate_math_function<pow_function>(accuracy,
+            registers[fields.left(0)],
+            registers[fields.right(0)]);
+      break;
+    }
+    case instruction_code::conditional_copy:
+    {
+      registers[fields.result(0)] =
+        p3a::condition(
+            registers[fields.left(0)] != ScalarType(0.0),
+            registers[fields.right(0)],
+            registers[fields.result(0)]);
+      break;
+    }
+    case instruction_code::logical_or:
+    {
+      registers[fields.result(0)] =
+        p3a::condition(
+            (registers[fields.left(0)] != ScalarType(0.0)) ||
+            (registers[fields.right(0)] != ScalarType(0.0)),
+            ScalarType(1.0),
+            ScalarType(0.0));
+      break;
+    }
+    case instruction_code::logical_and:
+    {
+      registers[fields.result(0)] =
+        p3a::condition(
+            (registers[fields.left(0)] != ScalarType(0.0)) &&
+            (registers[fields.right(0)] != ScalarType(0.0)),
+            ScalarType(1.0),
+            ScalarType(0.0));
+      break;
+    }
+    case instruction_code::logical_not:
+    {
+      registers[fields.result(0)] =
+        p3a::condition(
+            registers[fields.left(0)] != ScalarType(0.0),
+            ScalarType(0.0),
+            ScalarType(1.0));
+      break;
+    }
+    case instruction_code::equal:
+    {
+      registers[fields.result(0)] =
+        p3a::condition(
+            registers[fields.left(0)] ==
+            registers[fields.right(0)],
+            ScalarType(1.0),
+            ScalarType(0.0));
+      break;
+    }
+    case instruction_code::not_equal:
+    {
+      registers[fields.result(0)] =
+        p3a::condition(
+            registers[fields.left(0)] !=
+            registers[fields.right(0)],
+            ScalarType(1.0),
+            ScalarType(0.0));
+      break;
+    }
+    case instruction_code::less:
+    {
+      registers[fields.result(0)] =
+        p3a::condition(
+            registers[fields.left(0)] <
+            registers[fields.right(0)],
+            ScalarType(1.0),
+            ScalarType(0.0));
+      break;
+    }
+    case instruction_code::less_or_equal:
+    {
+      registers[fields.result(0)] =
+        p3a::condition(
+            registers[fields.left(0)] <=
+            registers[fields.right(0)],
+            ScalarType(1.0),
+            ScalarType(0.0));
+      break;
+    }
+    case instruction_code::greater:
+    {
+      registers[fields.result(0)] =
+        p3a::condition(
+            registers[fields.left(0)] >
+            registers[fields.right(0)],
+            ScalarType(1.0),
+            ScalarType(0.0));
+      break;
+    }
+    case instruction_code::greater_or_equal:
+    {
+      registers[fields.result(0)] =
+        p3a::condition(
+            registers[fields.left(0)] >=
+            registers[fields.right(0)],
+            ScalarType(1.0),
+            ScalarType(0.0));
+      break;
+    }
+    case instruction_code::min:
+    {
+      ScalarType const a = registers[fields.left(0)];
+      ScalarType const b = registers[fields.right(0)];
+      registers[fields.result(0)] = p3a::condition(b < a, b, a);
+      break;
+    }
+    case instruction_code::max:
+    {
+      ScalarType const a = registers[fields.left(0)];
+      ScalarType const b = registers[fields.right(0)];
+      registers[fields.result(0)] = p3a::condition(a < b, b, a);
+      break;
+    }
+    case instruction_code::abs:
+    {
+      using std::abs;
+      registers[fields.result(0)] = abs(registers[fields.left(0)]);
+      break;
+    }
+    // the upper bound is read from the result register, like conditional_copy
+    case instruction_code::clamp:
+    {
+      ScalarType const x = registers[fields.left(0)];
+      ScalarType const lower = registers[fields.right(0)];
+      ScalarType const upper = registers[fields.result(0)];
+      registers[fields.result(0)] =
+        p3a::condition(x < lower, lower, p3a::condition(upper < x, upper, x));
+      break;
+    }
+    // the right operand is the table index
+    case instruction_code::table1d:
+    {
+      registers[fields.result(0)] =
+        evaluate_table1d(
+            context.tables[fields.table()],
+            context.table_data,
+            registers[fields.left(0)]);
+      break;
+    }
+    // y is read from the result register, like conditional_copy
+    case instruction_code::table2d:
+    {
+      registers[fields.result(0)] =
+        evaluate_table2d(
+            context.tables[fields.table()],
+            context.table_data,
+            registers[fields.left(0)],
+            registers[fields.result(0)]);
+      break;
+    }
+    case instruction_code::dot:
+    {
+      registers[fields.result(0)] =
+        registers[fields.left(0)] * registers[fields.right(0)] +
+        registers[fields.left(1)] * registers[fields.right(1)] +
+        registers[fields.left(2)] * registers[fields.right(2)];
+      break;
+    }
+    case instruction_code::norm:
+    {
+      using std::sqrt;
+      ScalarType const a0 = registers[fields.left(0)];
+      ScalarType const a1 = registers[fields.left(1)];
+      ScalarType const a2 = registers[fields.left(2)];
+      registers[fields.result(0)] = ScalarType(
+        sqrt(fast_scalar_type(a0 * a0 + a1 * a1 + a2 * a2)));
+      break;
+    }
+    // all components are read before any is written, so results may
+    // share registers with operands
+    case instruction_code::cross:
+    {
+      ScalarType const a0 = registers[fields.left(0)];
+      ScalarType const b0 = registers[fields.right(0)];
+      ScalarType const a1 = registers[fields.left(1)];
+      ScalarType const b1 = registers[fields.right(1)];
+      ScalarType const a2 = registers[fields.left(2)];
+      ScalarType const b2 = registers[fields.right(2)];
+      registers[fields.result(0)] = a1 * b2 - a2 * b1;
+      registers[fields.result(1)] = a2 * b0 - a0 * b2;
+      registers[fields.result(2)] = a0 * b1 - a1 * b0;
+      break;
+    }
+    case instruction_code::normalize:
+    {
+      using std::sqrt;
+      ScalarType const a0 = registers[fields.left(0)];
+      ScalarType const a1 = registers[fields.left(1)];
+      ScalarType const a2 = registers[fields.left(2)];
+      fast_scalar_type const length = sqrt(fast_scalar_type(a0 * a0 + a1 * a1 + a2 * a2));
+      registers[fields.result(0)] = ScalarType(fast_scalar_type(a0) / length);
+      registers[fields.result(1)] = ScalarType(fast_scalar_type(a1) / length);
+      registers[fields.result(2)] = ScalarType(fast_scalar_type(a2) / length);
+      break;
+    }
+    // executed by the vector3 instruction before it
+    case instruction_code::operands:
+      break;
+  }
+}
+
+template <class ConstantType, class FastType>
 template <class ScalarType>
 P3A_HOST_DEVICE P3A_ALWAYS_INLINE
-inline void instruction::execute(ScalarType* registers) const {
-  switch (this->code) {
+inline void basic_instruction<ConstantType, FastType>::execute_batch(
+    ScalarType* registers,
+    int count,
+    int stride,
+    execution_context<ConstantType> const& context,
+    ScalarType* destination) const {
+  execute_batch_fields(primitive_code(this->code), instruction_fields<basic_instruction>{this},
+      registers, count, stride, context, destination);
+}
+
+template <class ConstantType, class FastType>
+template <class Fields, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline void basic_instruction<ConstantType, FastType>::execute_batch_fields(
+    instruction_code code,
+    Fields const& fields,
+    ScalarType* registers,
+    int count,
+    int stride,
+    execution_context<ConstantType> const& context,
+    ScalarType* destination) {
+  using fast_scalar_type = fast_type<ScalarType>;
+  math_accuracy const accuracy = context.accuracy;
+  ScalarType* const result = destination != nullptr ? destination :
+    registers + std::ptrdiff_t(fields.result(0)) * stride;
+  if (code == instruction_code::assign_constant) {
+    for (int i = 0; i < count; ++i) result[i] = fields.constant();
+    return;
+  }
+  ScalarType const* const left = registers + std::ptrdiff_t(fields.left(0)) * stride;
+  ScalarType const* const right = registers + std::ptrdiff_t(fields.right(0)) * stride;
+  switch (code) {
     case instruction_code::copy:
-    {
-      registers[this->result_register] =
-        registers[this->input_registers.left];
+      for (int i = 0; i < count; ++i) result[i] = left[i];
       break;
-    }
     case instruction_code::add:
-    {
-      registers[this->result_register] =
-        registers[this->input_registers.left] +
-        registers[this->input_registers.right];
+      for (int i = 0; i < count; ++i) result[i] = left[i] + right[i];
       break;
-    }
     case instruction_code::subtract:
-    {
-      registers[this->result_register] =
-        registers[this->input_registers.left] -
-        registers[this->input_registers.right];
+      for (int i = 0; i < count; ++i) result[i] = left[i] - right[i];
       break;
-    }
     case instruction_code::multiply:
-    {
-      registers[this->result_register] =
-        registers[this->input_registers.left] *
-        registers[this->input_registers.right];
+      for (int i = 0; i < count; ++i) result[i] = left[i] * right[i];
       break;
-    }
     case instruction_code::divide:
-    {
-      registers[this->result_register] =
-        registers[this->input_registers.left] /
-        registers[this->input_registers.right];
+      for (int i = 0; i < count; ++i) {
+        result[i] = ScalarType(fast_scalar_type(left[i]) / fast_scalar_type(right[i]));
+      }
       break;
-    }
     case instruction_code::negate:
-    {
-      registers[this->result_register] =
-        -registers[this->input_registers.left];
+      for (int i = 0; i < count; ++i) result[i] = -left[i];
       break;
-    }
     case instruction_code::assign_constant:
-    {
-      registers[this->result_register] = this->constant;
       break;
-    }
     case instruction_code::sqrt:
-    {
-      using std::sqrt;
-      registers[this->result_register] =
-        sqrt(registers[this->input_registers.left]);
+      for (int i = 0; i < count; ++i) {
+        using std::sqrt;
+        result[i] = ScalarType(sqrt(fast_scalar_type(left[i])));
+      }
+      break;
+    case instruction_code::pow_half:
+      for (int i = 0; i < count; ++i) {
+        result[i] = ScalarType(pow_half(fast_scalar_type(left[i])));
+      }
       break;
-    }
     case instruction_code::sin:
-    {
-      registers[this->result_register] =
-        p3a::sin(registers[this->input_registers.left]);
+      evaluate_math_function<sin_function, fast_scalar_type>(accuracy, count, result, left, left);
       break;
-    }
     case instruction_code::cos:
-    {
-      registers[this->result_register] =
-        p3a::cos(registers[this->input_registers.left]);
+      evaluate_math_function<cos_function, fast_scalar_type>(accuracy, count, result, left, left);
       break;
-    }
     case instruction_code::exp:
-    {
-      registers[this->result_register] =
-        p3a::exp(registers[this->input_registers.left]);
+      evaluate_math_function<exp_function, fast_scalar_type>(accuracy, count, result, left, left);
+      break;
+    case instruction_code::log:
+      evaluate_math_function<log_function, fast_scalar_type>(accuracy, count, result, left, left);
       break;
-    }
     case instruction_code::pow:
-    {
-      registers[this->result_register] =
-        p3a::pow(
-            registers[this->input_registers.left],
-            registers[this->input_registers.right]);
+      evaluate_math_function<pow_function, ScalarType>(accuracy, count, result, left, right);
       break;
-    }
     case instruction_code::conditional_copy:
-    {
-      registers[this->result_register] =
-        p3a::condition(
-            registers[this->input_registers.left] != ScalarType(0.0),
-            registers[this->input_registers.right],
-            registers[this->result_register]);
+      for (int i = 0; i < count; ++i) {
+        result[i] = p3a::condition(left[i] != ScalarType(0.0), right[i], result[i]);
+      }
       break;
-    }
     case instruction_code::logical_or:
-    {
-      registers[this->result_register] =
-        p3a::condition(
-            (registers[this->input_registers.left] != ScalarType(0.0)) ||
-            (registers[this->input_registers.right] != ScalarType(0.0)),
-            ScalarType(1.0),
-            ScalarType(0.0));
+      for (int i = 0; i < count; ++i) {
+        result[i] = p3a::condition(
+            (left[i] != ScalarType(0.0)) || (right[i] != ScalarType(0.0)),
+            ScalarType(1.0), ScalarType(0.0));
+      }
       break;
-    }
     case instruction_code::logical_and:
-    {
-      registers[this->result_register] =
-        p3a::condition(
-            (registers[this->input_registers.left] != ScalarType(0.0)) &&
-            (registers[this->input_registers.right] != ScalarType(0.0)),
-            ScalarType(1.0),
-            ScalarType(0.0));
+      for (int i = 0; i < count; ++i) {
+        result[i] = p3a::condition(
+            (left[i] != ScalarType(0.0)) && (right[i] != ScalarType(0.0)),
+            ScalarType(1.0), ScalarType(0.0));
+      }
       break;
-    }
     case instruction_code::logical_not:
-    {
-      registers[this->result_register] =
-        p3a::condition(
-            registers[this->input_registers.left] != ScalarType(0.0),
-            ScalarType(0.0),
-            ScalarType(1.0));
+      for (int i = 0; i < count; ++i) {
+        result[i] = p3a::condition(left[i] != ScalarType(0.0), ScalarType(0.0), ScalarType(1.0));
+      }
       break;
-    }
     case instruction_code::equal:
+      for (int i = 0; i < count; ++i) {
+        result[i] = p3a::condition(left[i] == right[i], ScalarType(1.0), ScalarType(0.0));
+      }
+      break;
+    case instruction_code::not_equal:
+      for (int i = 0; i < count; ++i) {
+        result[i] = p3a::condition(left[i] != right[i], ScalarType(1.0), ScalarType(0.0));
+      }
+      break;
+    case instruction_code::less:
+      for (int i = 0; i < count; ++i) {
+        result[i] = p3a::condition(left[i] < right[i], ScalarType(1.0), ScalarType(0.0));
+      }
+      break;
+    case instruction_code::less_or_equal:
+      for (int i = 0; i < count; ++i) {
+        result[i] = p3a::condition(left[i] <= right[i], ScalarType(1.0), ScalarType(0.0));
+      }
+      break;
+    case instruction_code::greater:
+      for (int i = 0; i < count; ++i) {
+        result[i] = p3a::condition(left[i] > right[i], ScalarType(1.0), ScalarType(0.0));
+      }
+      break;
+    case instruction_code::greater_or_equal:
+      for (int i = 0; i < count; ++i) {
+        result[i] = p3a::condition(left[i] >= right[i], ScalarType(1.0), ScalarType(0.0));
+      }
+      break;
+    case instruction_code::min:
+      for (int i = 0; i < count; ++i) {
+        result[i] = p3a::condition(right[i] < left[i], right[i], left[i]);
+      }
+      break;
+    case instruction_code::max:
+      for (int i = 0; i < count; ++i) {
+        result[i] = p3a::condition(left[i] < right[i], right[i], left[i]);
+      }
+      break;
+    case instruction_code::abs:
+      for (int i = 0; i < count; ++i) {
+        using std::abs;
+        result[i] = abs(left[i]);
+      }
+      break;
+    case instruction_code::clamp:
+      for (int i = 0; i < count; ++i) {
+        result[i] = p3a::condition(left[i] < right[i], right[i],
+            p3a::condition(result[i] < left[i], result[i], left[i]));
+      }
+      break;
+    case instruction_code::table1d:
     {
-      registers[this->result_register] =
-        p3a::condition(
-            registers[this->input_registers.left] ==
-            registers[this->input_registers.right],
-            ScalarType(1.0),
-            ScalarType(0.0));
+      auto const& table = context.tables[fields.table()];
+      for (int i = 0; i < count; ++i) {
+        result[i] = evaluate_table1d(table, context.table_data, left[i]);
+      }
       break;
     }
-    case instruction_code::not_equal:
+    case instruction_code::table2d:
     {
-      registers[this->result_register] =
-        p3a::condition(
-            registers[this->input_registers.left] !=
-            registers[this->input_registers.right],
-            ScalarType(1.0),
-            ScalarType(0.0));
+      auto const& table = context.tables[fields.table()];
+      for (int i = 0; i < count; ++i) {
+        result[i] = evaluate_table2d(table, context.table_data, left[i], result[i]);
+      }
       break;
     }
-    case instruction_code::less:
+    case instruction_code::dot:
     {
-      registers[this->result_register] =
-        p3a::condition(
-            registers[this->input_registers.left] <
-            registers[this->input_registers.right],
-            ScalarType(1.0),
-            ScalarType(0.0));
+      ScalarType const* const a1 = registers + std::ptrdiff_t(fields.left(1)) * stride;
+      ScalarType const* const b1 = registers + std::ptrdiff_t(fields.right(1)) * stride;
+      ScalarType const* const a2 = registers + std::ptrdiff_t(fields.left(2)) * stride;
+      ScalarType const* const b2 = registers + std::ptrdiff_t(fields.right(2)) * stride;
+      for (int i = 0; i < count; ++i) {
+        result[i] = left[i] * right[i] + a1[i] * b1[i] + a2[i] * b2[i];
+      }
       break;
     }
-    case instruction_code::less_or_equal:
+    case instruction_code::norm:
     {
-      registers[this->result_register] =
-        p3a::condition(
-            registers[this->input_registers.left] <=
-            registers[this->input_registers.right],
-            ScalarType(1.0),
-            ScalarType(0.0));
+      using std::sqrt;
+      ScalarType const* const a1 = registers + std::ptrdiff_t(fields.left(1)) * stride;
+      ScalarType const* const a2 = registers + std::ptrdiff_t(fields.left(2)) * stride;
+      for (int i = 0; i < count; ++i) {
+        result[i] = ScalarType(sqrt(fast_scalar_type(
+                left[i] * left[i] + a1[i] * a1[i] + a2[i] * a2[i])));
+      }
       break;
     }
-    case instruction_code::greater:
+    case instruction_code::cross:
     {
-      registers[this->result_register] =
-        p3a::condition(
-            registers[this->input_registers.left] >
-            registers[this->input_registers.right],
-            ScalarType(1.0),
-            ScalarType(0.0));
+      ScalarType const* const a1 = registers + std::ptrdiff_t(fields.left(1)) * stride;
+      ScalarType const* const b1 = registers + std::ptrdiff_t(fields.right(1)) * stride;
+      ScalarType const* const a2 = registers + std::ptrdiff_t(fields.left(2)) * stride;
+      ScalarType const* const b2 = registers + std::ptrdiff_t(fields.right(2)) * stride;
+      ScalarType* const result1 = registers + std::ptrdiff_t(fields.result(1)) * stride;
+      ScalarType* const result2 = registers + std::ptrdiff_t(fields.result(2)) * stride;
+      for (int i = 0; i < count; ++i) {
+        ScalarType const x = a1[i] * b2[i] - a2[i] * b1[i];
+        ScalarType const y = a2[i] * right[i] - left[i] * b2[i];
+        ScalarType const z = left[i] * b1[i] - a1[i] * right[i];
+        result[i] = x;
+        result1[i] = y;
+        result2[i] = z;
+      }
       break;
     }
-    case instruction_code::greater_or_equal:
+    case instruction_code::normalize:
     {
-      registers[this->result_register] =
-        p3a::condition(
-            registers[this->input_registers.left] >=
-            registers[this->input_registers.right],
-            ScalarType(1.0),
-            ScalarType(0.0));
+      using std::sqrt;
+      ScalarType const* const a1 = registers + std::ptrdiff_t(fields.left(1)) * stride;
+      ScalarType const* const a2 = registers + std::ptrdiff_t(fields.left(2)) * stride;
+      ScalarType* const result1 = registers + std::ptrdiff_t(fields.result(1)) * stride;
+      ScalarType* const result2 = registers + std::ptrdiff_t(fields.result(2)) * stride;
+      for (int i = 0; i < count; ++i) {
+        fast_scalar_type const x(left[i]);
+        fast_scalar_type const y(a1[i]);
+        fast_scalar_type const z(a2[i]);
+        fast_scalar_type const length = sqrt(fast_scalar_type(
+              left[i] * left[i] + a1[i] * a1[i] + a2[i] * a2[i]));
+        result[i] = ScalarType(x / length);
+        result1[i] = ScalarType(y / length);
+        result2[i] = ScalarType(z / length);
+      }
+      break;
+    }
+    case instruction_code::operands:
       break;
+  }
+}
+
+template <instruction_code... Codes, class Fields, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline int execute_sequence(
+    Fields const& fields,
+    ScalarType* registers,
+    execution_context<typename Fields::instruction_type::constant_type> const& context)
+{
+  using instruction_type = typename Fields::instruction_type;
+  int i = 0;
+  ((instruction_type::execute_fields(Codes, fields.at(i), registers, context),
+    i += instruction_width(Codes)), ...);
+  return i;
+}
+
+// executes the instruction or superinstruction with the given code whose
+// fields are fields, and returns how many instructions it covered
+template <class Fields, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline int execute_superinstruction(
+    instruction_code code,
+    Fields const& fields,
+    ScalarType* registers,
+    execution_context<typename Fields::instruction_type::constant_type> const& context)
+{
+#define MATH_BYTECODE_SUPERINSTRUCTION_CASE(name, ...) \
+  case instruction_code_count + int(superinstruction::name): \
+    return execute_sequence<__VA_ARGS__>(fields, registers, context);
+  switch (int(code)) {
+    MATH_BYTECODE_SUPERINSTRUCTIONS(MATH_BYTECODE_SUPERINSTRUCTION_CASE)
+  }
+#undef MATH_BYTECODE_SUPERINSTRUCTION_CASE
+  Fields::instruction_type::execute_fields(code, fields, registers, context);
+  return instruction_width(code);
+}
+
+template <class Instruction, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline int execute_superinstruction(
+    Instruction const* instructions,
+    ScalarType* registers,
+    execution_context<typename Instruction::constant_type> const& context)
+{
+  return execute_superinstruction(instructions->code, instruction_fields<Instruction>{instructions},
+      registers, context);
+}
+
+#ifdef MATH_BYTECODE_ENABLE_COUNTERS
+
+class function_counters {
+ public:
+  function_counters()
+  {
+    reset();
+  }
+  void reset()
+  {
+    evaluation_count = 0;
+    total_nanoseconds = 0;
+    for (int i = 0; i < dispatch_code_count; ++i) {
+      dispatch_counts[i] = 0;
+      dispatch_cycles[i] = 0;
+    }
+  }
+  void record_dispatch(instruction_code code, std::uint64_t cycles)
+  {
+    dispatch_counts[int(code)].fetch_add(1, std::memory_order_relaxed);
+    dispatch_cycles[int(code)].fetch_add(cycles, std::memory_order_relaxed);
+  }
+  void record_evaluation(std::chrono::steady_clock::duration duration)
+  {
+    evaluation_count.fetch_add(1, std::memory_order_relaxed);
+    total_nanoseconds.fetch_add(std::uint64_t(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count()),
+        std::memory_order_relaxed);
+  }
+  std::string name;
+  std::atomic<std::uint64_t> evaluation_count;
+  std::atomic<std::uint64_t> total_nanoseconds;
+  std::atomic<std::uint64_t> dispatch_counts[dispatch_code_count];
+  // only nonzero when MATH_BYTECODE_ENABLE_CYCLE_COUNTERS is defined
+  std::atomic<std::uint64_t> dispatch_cycles[dispatch_code_count];
+  // the instructions of the function without superinstructions, from
+  // which profile_counters() derives the sequences that ran
+  std::vector<instruction_code> instruction_codes;
+};
+
+inline std::uint64_t read_cycle_counter()
+{
+#if defined(MATH_BYTECODE_ENABLE_CYCLE_COUNTERS) && (defined(__x86_64__) || defined(__i386__))
+  return __rdtsc();
+#elif defined(MATH_BYTECODE_ENABLE_CYCLE_COUNTERS)
+  return std::uint64_t(std::chrono::steady_clock::now().time_since_epoch().count());
+#else
+  return 0;
+#endif
+}
+
+// the counters are registered so that dump_counters() can find them
+[[nodiscard]]
+std::shared_ptr<function_counters> make_function_counters();
+void dump_counters(std::ostream& stream);
+void reset_counters();
+
+#endif
+
+// the instruction whose result execute_batch can write straight to an
+// output, because it is the last to write the output's register and nothing
+// reads that register afterwards
+class output_store {
+ public:
+  std::int32_t instruction;
+  std::int32_t output;
+};
+
+// instructions as separate arrays of codes, result registers, left and
+// right operands and constants, so that threads of a device that read the
+// same field of consecutive instructions make narrow, coalesced loads.
+// The codes are primitive ones, and the left operand of an assign_constant
+// is the index of its constant
+template <class Instruction>
+class instruction_arrays {
+ public:
+  using constant_type = typename Instruction::constant_type;
+  instruction_code const* codes{nullptr};
+  int const* results{nullptr};
+  int const* lefts{nullptr};
+  int const* rights{nullptr};
+  constant_type const* constants{nullptr};
+};
+
+// the contents of the instruction_arrays of some instructions, built in
+// host memory before being copied to wherever the arrays live
+template <class Instruction>
+class instruction_array_values {
+ public:
+  std::vector<instruction_code> codes;
+  std::vector<int> results;
+  std::vector<int> lefts;
+  std::vector<int> rights;
+  std::vector<typename Instruction::constant_type> constants;
+};
+
+// host_instructions are in host memory
+template <class Instruction, class Instructions>
+[[nodiscard]]
+instruction_array_values<Instruction> split_instructions(Instructions const& host_instructions)
+{
+  instruction_array_values<Instruction> values;
+  for (auto const& in : host_instructions) {
+    instruction_code const code = primitive_code(in.code);
+    values.codes.push_back(code);
+    values.results.push_back(in.result_register);
+    if (code == instruction_code::assign_constant) {
+      values.lefts.push_back(int(values.constants.size()));
+      values.rights.push_back(0);
+      values.constants.push_back(in.constant);
+    } else {
+      values.lefts.push_back(in.input_registers.left);
+      values.rights.push_back(in.input_registers.right);
     }
   }
+  return values;
+}
+
+// the stream that starts at instruction first of instructions. The constants
+// of instruction_arrays are found through the left operands, so they stay put
+template <class Instruction>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline Instruction const* stream_from(Instruction const* instructions, int first)
+{
+  return instructions + first;
+}
+
+template <class Instruction>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline instruction_arrays<Instruction> stream_from(instruction_arrays<Instruction> const& arrays, int first)
+{
+  instruction_arrays<Instruction> result = arrays;
+  result.codes += first;
+  result.results += first;
+  result.lefts += first;
+  result.rights += first;
+  return result;
+}
+
+// the fields of the instruction group at first, read from the arrays
+// one at a time as the interpreter needs them
+template <class Instruction>
+class instruction_array_fields {
+ public:
+  using instruction_type = Instruction;
+  instruction_arrays<Instruction> const& arrays;
+  int first;
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  int result(int k) const { return arrays.results[first + k]; }
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  int left(int k) const { return arrays.lefts[first + k]; }
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  int right(int k) const { return arrays.rights[first + k]; }
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  int table() const { return arrays.rights[first]; }
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  typename Instruction::constant_type constant() const
+  {
+    return arrays.constants[arrays.lefts[first]];
+  }
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  instruction_array_fields at(int k) const { return {arrays, first + k}; }
+};
+
+// the interpreters read instructions through these, which take either a
+// pointer to instructions or instruction_arrays
+template <class Instruction>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline instruction_code code_at(Instruction const* instructions, int i)
+{
+  return instructions[i].code;
+}
+
+template <class Instruction>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline instruction_code code_at(instruction_arrays<Instruction> const& arrays, int i)
+{
+  return arrays.codes[i];
+}
+
+// executes the instruction (or superinstruction) at i and returns how
+// many instructions it covered
+template <class Instruction, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline int execute_at(
+    Instruction const* instructions,
+    int i,
+    ScalarType* registers,
+    execution_context<typename Instruction::constant_type> const& context)
+{
+  return execute_superinstruction(instructions + i, registers, context);
+}
+
+template <class Instruction, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline int execute_at(
+    instruction_arrays<Instruction> const& arrays,
+    int i,
+    ScalarType* registers,
+    execution_context<typename Instruction::constant_type> const& context)
+{
+  instruction_code const code = arrays.codes[i];
+  Instruction::execute_fields(code, instruction_array_fields<Instruction>{arrays, i},
+      registers, context);
+  return instruction_width(code);
+}
+
+// as above, with register r at registers[r * stride]
+template <class Instruction, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline int execute_at(
+    Instruction const* instructions,
+    int i,
+    ScalarType* registers,
+    int stride,
+    execution_context<typename Instruction::constant_type> const& context)
+{
+  using fields_type = strided_fields<instruction_fields<Instruction>>;
+  return execute_superinstruction(instructions[i].code,
+      fields_type{{instructions + i}, stride}, registers, context);
+}
+
+template <class Instruction, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline int execute_at(
+    instruction_arrays<Instruction> const& arrays,
+    int i,
+    ScalarType* registers,
+    int stride,
+    execution_context<typename Instruction::constant_type> const& context)
+{
+  using fields_type = strided_fields<instruction_array_fields<Instruction>>;
+  instruction_code const code = arrays.codes[i];
+  Instruction::execute_fields(code, fields_type{{arrays, i}, stride}, registers, context);
+  return instruction_width(code);
+}
+
+template <class Instruction, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline int execute_batch_at(
+    Instruction const* instructions,
+    int i,
+    ScalarType* registers,
+    int count,
+    int stride,
+    execution_context<typename Instruction::constant_type> const& context,
+    ScalarType* destination = nullptr)
+{
+  instructions[i].execute_batch(registers, count, stride, context, destination);
+  return instruction_width(primitive_code(instructions[i].code));
+}
+
+template <class Instruction, class ScalarType>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline int execute_batch_at(
+    instruction_arrays<Instruction> const& arrays,
+    int i,
+    ScalarType* registers,
+    int count,
+    int stride,
+    execution_context<typename Instruction::constant_type> const& context,
+    ScalarType* destination = nullptr)
+{
+  instruction_code const code = arrays.codes[i];
+  Instruction::execute_batch_fields(code, instruction_array_fields<Instruction>{arrays, i},
+      registers, count, stride, context, destination);
+  return instruction_width(code);
+}
+
+// where the registers start in the team scratch of evaluate_team, after
+// the staged instructions
+template <class Stream>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline std::size_t team_registers_offset(int instruction_count)
+{
+  std::size_t bytes;
+  if constexpr (std::is_pointer_v<Stream>) {
+    bytes = sizeof(std::remove_pointer_t<Stream>) * std::size_t(instruction_count);
+  } else {
+    bytes = (sizeof(instruction_code) + 3 * sizeof(int)) * std::size_t(instruction_count);
+  }
+  std::size_t const alignment = 16;
+  return (bytes + alignment - 1) / alignment * alignment;
+}
+
+// copies the instructions into scratch, the thread of the given rank in a
+// team of size threads copying every size-th one
+template <class Instruction>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline Instruction const* stage_instructions(
+    Instruction const* instructions,
+    int instruction_count,
+    void* scratch,
+    int rank,
+    int size)
+{
+  Instruction* const staged = static_cast<Instruction*>(scratch);
+  for (int i = rank; i < instruction_count; i += size) staged[i] = instructions[i];
+  return staged;
+}
+
+// the constants are few and stay where they are
+template <class Instruction>
+P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+inline instruction_arrays<Instruction> stage_instructions(
+    instruction_arrays<Instruction> const& arrays,
+    int instruction_count,
+    void* scratch,
+    int rank,
+    int size)
+{
+  instruction_code* const codes = static_cast<instruction_code*>(scratch);
+  int* const results = reinterpret_cast<int*>(codes + instruction_count);
+  int* const lefts = results + instruction_count;
+  int* const rights = lefts + instruction_count;
+  for (int i = rank; i < instruction_count; i += size) {
+    codes[i] = arrays.codes[i];
+    results[i] = arrays.results[i];
+    lefts[i] = arrays.lefts[i];
+    rights[i] = arrays.rights[i];
+  }
+  instruction_arrays<Instruction> staged = arrays;
+  staged.codes = codes;
+  staged.results = results;
+  staged.lefts = lefts;
+  staged.rights = rights;
+  return staged;
 }
 
-class executable_function {
+// Stream is how the instructions are read: a pointer to them or
+// instruction_arrays
+template <class Instruction, class Stream = Instruction const*>
+class basic_executable_function {
  public:
-  P3A_ALWAYS_INLINE executable_function() = default;
-  executable_function(
-      instruction const* instructions_in,
+  P3A_ALWAYS_INLINE basic_executable_function() = default;
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  basic_executable_function(
+      Stream instructions_in,
       int instruction_count_in,
       int const* input_registers_in,
-      int,
+      int input_count_in,
       int const* output_registers_in,
-      int)
+      int output_count_in,
+      execution_context<typename Instruction::constant_type> const& context_in =
+        execution_context<typename Instruction::constant_type>(),
+      int prologue_count_in = 0,
+      int const* uniform_registers_in = nullptr,
+      int uniform_count_in = 0,
+      bool has_pinned_inputs_in = false,
+      output_store const* output_stores_in = nullptr,
+      int output_store_count_in = 0
+#ifdef MATH_BYTECODE_ENABLE_COUNTERS
+      , function_counters* counters_in = nullptr
+#endif
+      )
     :instructions(instructions_in)
     ,instruction_count(instruction_count_in)
     ,input_registers(input_registers_in)
+    ,input_count(input_count_in)
     ,output_registers(output_registers_in)
+    ,output_count(output_count_in)
+    ,context(context_in)
+    ,prologue_count(prologue_count_in)
+    ,uniform_registers(uniform_registers_in)
+    ,uniform_count(uniform_count_in)
+    ,has_pinned_inputs(has_pinned_inputs_in)
+    ,output_stores(output_stores_in)
+    ,output_store_count(output_store_count_in)
+#ifdef MATH_BYTECODE_ENABLE_COUNTERS
+    ,counters(counters_in)
+#endif
   {
   }
   template <class ScalarType>
   P3A_HOST_DEVICE P3A_ALWAYS_INLINE
   inline void execute(ScalarType* registers) const
   {
-    for (int i = 0; i < instruction_count; ++i) {
-      instructions[i].execute(registers);
+#ifdef MATH_BYTECODE_COUNT_ON_HOST
+    if (counters != nullptr) {
+      auto const start = std::chrono::steady_clock::now();
+      for (int i = 0; i < instruction_count;) {
+        auto const cycles = read_cycle_counter();
+        int const covered = execute_at(instructions, i, registers, context);
+        counters->record_dispatch(code_at(instructions, i), read_cycle_counter() - cycles);
+        i += covered;
+      }
+      counters->record_evaluation(std::chrono::steady_clock::now() - start);
+      return;
+    }
+#endif
+    for (int i = 0; i < instruction_count;) {
+      i += execute_at(instructions, i, registers, context);
+    }
+  }
+  // register r of point p is registers[r * count + p]. The prologue only
+  // depends on uniform inputs, so it runs for the first point and the
+  // uniform registers the rest of the function needs are copied to the others
+  template <class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  inline void execute_batch(ScalarType* registers, int count) const
+  {
+    execute_batch(registers, count, static_cast<ScalarType*>(nullptr), 0);
+  }
+  // as above, but unless outputs is null the output_stores after the
+  // prologue write output scalar j of point p to outputs[j * output_stride + p]
+  // instead of to its register
+  template <class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  inline void execute_batch(
+      ScalarType* registers,
+      int count,
+      ScalarType* outputs,
+      int output_stride) const
+  {
+    for (int i = 0; i < prologue_count;) {
+      i += execute_batch_at(instructions, i, registers, 1, count, context);
+    }
+    for (int j = 0; j < uniform_count; ++j) {
+      ScalarType* const values = registers + std::ptrdiff_t(uniform_registers[j]) * count;
+      for (int p = 1; p < count; ++p) values[p] = values[0];
+    }
+    int s = 0;
+    while (s < output_store_count && output_stores[s].instruction < prologue_count) ++s;
+    if (outputs == nullptr) s = output_store_count;
+    for (int i = prologue_count; i < instruction_count;) {
+      if (s < output_store_count && output_stores[s].instruction == i) {
+        ScalarType* const destination =
+          outputs + std::ptrdiff_t(output_stores[s].output) * output_stride;
+        i += execute_batch_at(instructions, i, registers, count, count, context, destination);
+        ++s;
+      } else {
+        i += execute_batch_at(instructions, i, registers, count, count, context);
+      }
+    }
+  }
+  // evaluates count points at once, input (output) scalar j of point p
+  // being inputs[j * count + p] (outputs[j * count + p])
+  template <class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  inline void evaluate_batch(
+      ScalarType* registers,
+      int count,
+      ScalarType const* inputs,
+      ScalarType* outputs) const
+  {
+    evaluate_batch(registers, count, inputs, count, outputs, count);
+  }
+  // as above with input (output) scalar j of point p being
+  // inputs[j * input_stride + p] (outputs[j * output_stride + p]), so that
+  // count points within larger arrays are evaluated in place. Outputs with
+  // an output_store are written by their last instruction, not copied
+  template <class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  inline void evaluate_batch(
+      ScalarType* registers,
+      int count,
+      ScalarType const* inputs,
+      int input_stride,
+      ScalarType* outputs,
+      int output_stride) const
+  {
+    if (has_pinned_inputs && input_stride == count) {
+      // the inputs already have the layout of the first input_count registers
+      std::ptrdiff_t const size = std::ptrdiff_t(input_count) * count;
+      for (std::ptrdiff_t k = 0; k < size; ++k) registers[k] = inputs[k];
+    } else {
+      for (int j = 0; j < input_count; ++j) {
+        ScalarType* const destination = registers + std::ptrdiff_t(input_registers[j]) * count;
+        for (int p = 0; p < count; ++p) destination[p] = inputs[std::ptrdiff_t(j) * input_stride + p];
+      }
+    }
+    execute_batch(registers, count, outputs, output_stride);
+    for (int j = 0; j < output_count; ++j) {
+      bool is_stored = false;
+      for (int s = 0; s < output_store_count; ++s) {
+        if (output_stores[s].output == j && output_stores[s].instruction >= prologue_count) {
+          is_stored = true;
+        }
+      }
+      if (is_stored) continue;
+      ScalarType const* const source = registers + std::ptrdiff_t(output_registers[j]) * count;
+      for (int p = 0; p < count; ++p) outputs[std::ptrdiff_t(j) * output_stride + p] = source[p];
+    }
+  }
+  // evaluates point p of inputs and outputs laid out as in evaluate_batch
+  // with the scalar interpreter, registers holding a single point
+  template <class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  inline void evaluate_point(
+      ScalarType* registers,
+      int count,
+      int p,
+      ScalarType const* inputs,
+      ScalarType* outputs) const
+  {
+    for (int j = 0; j < input_count; ++j) {
+      registers[input_registers[j]] = inputs[std::ptrdiff_t(j) * count + p];
+    }
+    execute(registers);
+    for (int j = 0; j < output_count; ++j) {
+      outputs[std::ptrdiff_t(j) * count + p] = registers[output_registers[j]];
+    }
+  }
+  // the threads of team evaluate points first through last - 1 of inputs
+  // and outputs laid out as in evaluate_batch, all of them calling this.
+  // Team is a Kokkos team member or anything else with team_rank(),
+  // team_size() and team_barrier(). scratch is team_scratch_bytes of
+  // shared memory, into which the team first copies the instructions.
+  // Register r of the thread of rank t is the (r * team_size + t)th scalar
+  // after them, so that the threads of a warp access consecutive addresses.
+  // The team waits for all of its threads before returning, so the scratch
+  // can be reused right away
+  template <class Team, class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  inline void evaluate_team(
+      Team const& team,
+      void* scratch,
+      int count,
+      int first,
+      int last,
+      ScalarType const* inputs,
+      ScalarType* outputs) const
+  {
+    int const rank = team.team_rank();
+    int const size = team.team_size();
+    Stream const staged = stage_instructions(instructions, instruction_count, scratch, rank, size);
+    team.team_barrier();
+    ScalarType* const registers = reinterpret_cast<ScalarType*>(
+        static_cast<char*>(scratch) + team_registers_offset<Stream>(instruction_count)) + rank;
+    for (int p = first + rank; p < last; p += size) {
+      for (int j = 0; j < input_count; ++j) {
+        registers[std::ptrdiff_t(input_registers[j]) * size] = inputs[std::ptrdiff_t(j) * count + p];
+      }
+      for (int i = 0; i < instruction_count;) {
+        i += execute_at(staged, i, registers, size, context);
+      }
+      for (int j = 0; j < output_count; ++j) {
+        outputs[std::ptrdiff_t(j) * count + p] = registers[std::ptrdiff_t(output_registers[j]) * size];
+      }
     }
+    team.team_barrier();
   }
   template <class ScalarType, class ... ArgumentTypes>
   P3A_HOST_DEVICE P3A_ALWAYS_INLINE
@@ -306,10 +2228,7 @@ class executable_function {
       int input_scalar_count,
       const ScalarType& argument) const
   {
-    int const input_register = input_registers[input_scalar_count];
-    if (input_register >= 0) {
-      registers[input_register] = argument;
-    }
+    registers[input_registers[input_scalar_count]] = argument;
     return input_scalar_count + 1;
   }
   template <class ScalarType, std::size_t N>
@@ -320,10 +2239,7 @@ class executable_function {
       const ScalarType (&argument) [N]) const
   {
     for (std::size_t i = 0; i < N; ++i) {
-      int const input_register = input_registers[input_scalar_count];
-      if (input_register >= 0) {
-        registers[input_register] = argument[i];
-      }
+      registers[input_registers[input_scalar_count]] = argument[i];
       ++input_scalar_count;
     }
     return input_scalar_count;
@@ -477,62 +2393,438 @@ class executable_function {
     return output_scalar_count;
   }
  private:
-  instruction const* instructions;
+  Stream instructions;
   int instruction_count;
   int const* input_registers;
+  int input_count;
   int const* output_registers;
+  int output_count;
+  execution_context<typename Instruction::constant_type> context;
+  int prologue_count;
+  int const* uniform_registers;
+  int uniform_count;
+  bool has_pinned_inputs;
+  output_store const* output_stores;
+  int output_store_count;
+#ifdef MATH_BYTECODE_ENABLE_COUNTERS
+  function_counters* counters{nullptr};
+#endif
+};
+
+using executable_function = basic_executable_function<instruction>;
+
+// whether the size instructions starting at instructions hold the whole
+// sequence of a superinstruction with these codes
+template <instruction_code... Codes, class Instruction>
+bool holds_sequence(Instruction const* instructions, std::size_t size)
+{
+  instruction_code const codes[] = {Codes...};
+  std::size_t i = 0;
+  for (instruction_code code : codes) {
+    if (i >= size || (i > 0 && instructions[i].code != code)) return false;
+    i += std::size_t(instruction_width(code));
+  }
+  return i <= size;
+}
+
+// whether the value each register has before the instructions run can be
+// read by them or be an output
+template <class Instruction>
+std::vector<bool> find_live_on_entry(
+    std::vector<Instruction> const& instructions,
+    std::vector<int> const& outputs,
+    int register_count)
+{
+  std::vector<bool> is_live(std::size_t(register_count), false);
+  std::vector<bool> is_written(std::size_t(register_count), false);
+  auto read = [&] (int r) {
+    if (r >= 0 && !is_written[std::size_t(r)]) is_live[std::size_t(r)] = true;
+  };
+  for (std::size_t first = 0; first < instructions.size();) {
+    std::size_t const width =
+      std::size_t(instruction_width(primitive_code(instructions[first].code)));
+    for (std::size_t k = first; k < first + width; ++k) {
+      auto const& in = instructions[k];
+      instruction_code const code = primitive_code(in.code);
+      if (code == instruction_code::assign_constant) continue;
+      read(in.input_registers.left);
+      if (has_right_operand(code)) read(in.input_registers.right);
+      if (reads_result(code)) read(in.result_register);
+    }
+    for (std::size_t k = first; k < first + width; ++k) {
+      int const r = instructions[k].result_register;
+      if (r >= 0) is_written[std::size_t(r)] = true;
+    }
+    first += width;
+  }
+  for (int r : outputs) read(r);
+  return is_live;
+}
+
+// checks that the instructions only use known codes, that their registers
+// and table indices are in range, and that every register they read (and
+// every output) is defined by an instruction before it or is an input.
+// The interpreters trust all of this and check none of it per call
+template <class Instruction>
+void verify_bytecode(
+    std::vector<Instruction> const& instructions,
+    std::vector<int> const& inputs,
+    std::vector<int> const& outputs,
+    int register_count,
+    int table_count)
+{
+  auto fail = [] (std::size_t i, std::string const& what) {
+    throw std::invalid_argument(
+        "math_bytecode: instruction " + std::to_string(i) + " " + what);
+  };
+  if (register_count < 0) {
+    throw std::invalid_argument("math_bytecode: negative register count");
+  }
+  auto is_register = [&] (int r) { return 0 <= r && r < register_count; };
+  for (std::size_t i = 0; i < instructions.size(); ++i) {
+    instruction_code const code = instructions[i].code;
+    if (int(code) < 0 || int(code) >= dispatch_code_count) {
+      fail(i, "has unknown code " + std::to_string(int(code)));
+    }
+#define MATH_BYTECODE_SUPERINSTRUCTION_CHECK(name, ...) \
+    case instruction_code_count + int(superinstruction::name): \
+      if (!holds_sequence<__VA_ARGS__>(&instructions[i], instructions.size() - i)) { \
+        fail(i, "does not start the sequence of superinstruction " #name); \
+      } \
+      break;
+    switch (int(code)) {
+      MATH_BYTECODE_SUPERINSTRUCTIONS(MATH_BYTECODE_SUPERINSTRUCTION_CHECK)
+    }
+#undef MATH_BYTECODE_SUPERINSTRUCTION_CHECK
+  }
+  for (std::size_t first = 0; first < instructions.size();) {
+    instruction_code const first_code = primitive_code(instructions[first].code);
+    std::size_t const width = std::size_t(instruction_width(first_code));
+    if (first_code == instruction_code::operands) {
+      fail(first, "is an operands instruction outside of a vector3 instruction");
+    }
+    if (first + width > instructions.size()) {
+      fail(first, "is a vector3 instruction cut short by the end of the function");
+    }
+    for (std::size_t k = first; k < first + width; ++k) {
+      auto const& in = instructions[k];
+      instruction_code const code = primitive_code(in.code);
+      if (k > first && code != instruction_code::operands) {
+        fail(k, "should be an operands instruction");
+      }
+      // the instructions of a vector3 group use -1 for registers they lack
+      auto check = [&] (int r, char const* role) {
+        if (!is_register(r) && !(width > 1 && r == -1)) {
+          fail(k, std::string("has ") + role + " register " + std::to_string(r) +
+              " out of range");
+        }
+      };
+      check(in.result_register, "result");
+      if (code == instruction_code::assign_constant) continue;
+      check(in.input_registers.left, "left");
+      if (has_right_operand(code)) check(in.input_registers.right, "right");
+      if ((code == instruction_code::table1d || code == instruction_code::table2d) &&
+          (in.input_registers.right < 0 || in.input_registers.right >= table_count)) {
+        fail(k, "has table index " + std::to_string(in.input_registers.right) +
+            " out of range");
+      }
+    }
+    first += width;
+  }
+  for (int r : inputs) {
+    if (!is_register(r) && r != -1) {
+      throw std::invalid_argument(
+          "math_bytecode: input register " + std::to_string(r) + " out of range");
+    }
+  }
+  for (int r : outputs) {
+    if (!is_register(r)) {
+      throw std::invalid_argument(
+          "math_bytecode: output register " + std::to_string(r) + " out of range");
+    }
+  }
+  auto const is_live = find_live_on_entry(instructions, outputs, register_count);
+  for (int r = 0; r < register_count; ++r) {
+    if (is_live[std::size_t(r)] &&
+        std::find(inputs.cbegin(), inputs.cend(), r) == inputs.cend()) {
+      throw std::invalid_argument(
+          "math_bytecode: register " + std::to_string(r) +
+          " is read before it is defined");
+    }
+  }
+}
+
+// gives each input the function does not use (register -1) a register whose
+// value on entry is never read, so that loading inputs needs no checks.
+// Adds one register if there is no such register
+template <class Instruction>
+void assign_unused_inputs(
+    std::vector<Instruction> const& instructions,
+    std::vector<int>& inputs,
+    std::vector<int> const& outputs,
+    int& register_count)
+{
+  if (std::find(inputs.cbegin(), inputs.cend(), -1) == inputs.cend()) return;
+  auto const is_live = find_live_on_entry(instructions, outputs, register_count);
+  int scratch = 0;
+  while (scratch < register_count &&
+      (is_live[std::size_t(scratch)] ||
+       std::find(inputs.cbegin(), inputs.cend(), scratch) != inputs.cend())) {
+    ++scratch;
+  }
+  if (scratch == register_count) ++register_count;
+  for (int& r : inputs) {
+    if (r == -1) r = scratch;
+  }
+}
+
+// dependencies[o * inputs.size() + i] is whether output scalar o can
+// depend on input scalar i. The results of a vector3 instruction are taken
+// to depend on all of its operands
+template <class Instruction>
+std::vector<bool> find_dependencies(
+    std::vector<Instruction> const& instructions,
+    std::vector<int> const& inputs,
+    std::vector<int> const& outputs,
+    int register_count)
+{
+  std::size_t const input_count = inputs.size();
+  std::vector<bool> sources(std::size_t(register_count) * input_count, false);
+  for (std::size_t i = 0; i < input_count; ++i) {
+    if (inputs[i] >= 0) sources[std::size_t(inputs[i]) * input_count + i] = true;
+  }
+  std::vector<bool> group_sources(input_count);
+  auto add_sources = [&] (int r) {
+    if (r < 0) return;
+    for (std::size_t i = 0; i < input_count; ++i) {
+      if (sources[std::size_t(r) * input_count + i]) group_sources[i] = true;
+    }
+  };
+  for (std::size_t first = 0; first < instructions.size();) {
+    std::size_t const width =
+      std::size_t(instruction_width(primitive_code(instructions[first].code)));
+    std::fill(group_sources.begin(), group_sources.end(), false);
+    for (std::size_t k = first; k < first + width; ++k) {
+      auto const& in = instructions[k];
+      instruction_code const code = primitive_code(in.code);
+      if (code == instruction_code::assign_constant) continue;
+      add_sources(in.input_registers.left);
+      if (has_right_operand(code)) add_sources(in.input_registers.right);
+      if (reads_result(code)) add_sources(in.result_register);
+    }
+    for (std::size_t k = first; k < first + width; ++k) {
+      int const r = instructions[k].result_register;
+      if (r < 0) continue;
+      for (std::size_t i = 0; i < input_count; ++i) {
+        sources[std::size_t(r) * input_count + i] = group_sources[i];
+      }
+    }
+    first += width;
+  }
+  std::vector<bool> dependencies(outputs.size() * input_count);
+  for (std::size_t o = 0; o < outputs.size(); ++o) {
+    for (std::size_t i = 0; i < input_count; ++i) {
+      dependencies[o * input_count + i] = sources[std::size_t(outputs[o]) * input_count + i];
+    }
+  }
+  return dependencies;
+}
+
+// the output_stores of the instructions, by instruction. An output qualifies
+// if its register is its own, and the last instruction writing it is a
+// scalar one that does not read its result register
+template <class Instruction>
+std::vector<output_store> find_output_stores(
+    std::vector<Instruction> const& instructions,
+    std::vector<int> const& outputs,
+    int register_count)
+{
+  std::vector<int> last_write(std::size_t(register_count), -1);
+  std::vector<int> last_read(std::size_t(register_count), -1);
+  auto read = [&] (int r, std::size_t k) {
+    if (r >= 0) last_read[std::size_t(r)] = int(k);
+  };
+  for (std::size_t first = 0; first < instructions.size();) {
+    std::size_t const width =
+      std::size_t(instruction_width(primitive_code(instructions[first].code)));
+    for (std::size_t k = first; k < first + width; ++k) {
+      auto const& in = instructions[k];
+      instruction_code const code = primitive_code(in.code);
+      if (code != instruction_code::assign_constant) {
+        read(in.input_registers.left, k);
+        if (has_right_operand(code)) read(in.input_registers.right, k);
+      }
+      if (reads_result(code)) read(in.result_register, k);
+      if (in.result_register >= 0) last_write[std::size_t(in.result_register)] = int(k);
+    }
+    first += width;
+  }
+  std::vector<output_store> stores;
+  for (std::size_t j = 0; j < outputs.size(); ++j) {
+    int const r = outputs[j];
+    int const writer = last_write[std::size_t(r)];
+    if (writer < 0 || last_read[std::size_t(r)] > writer) continue;
+    if (std::count(outputs.cbegin(), outputs.cend(), r) != 1) continue;
+    instruction_code const code = primitive_code(instructions[std::size_t(writer)].code);
+    if (instruction_width(code) != 1 || code == instruction_code::operands ||
+        reads_result(code)) {
+      continue;
+    }
+    stores.push_back({std::int32_t(writer), std::int32_t(j)});
+  }
+  std::sort(stores.begin(), stores.end(), [] (output_store const& a, output_store const& b) {
+    return a.instruction < b.instruction;
+  });
+  return stores;
+}
+
+enum class instruction_layout {
+  array_of_structs,
+  structure_of_arrays
 };
 
+// with structure_of_arrays, the executables of a compiled function read
+// instruction_arrays, which may suit devices whose threads fetch each field
+// of the instructions together. Those arrays hold primitive codes, so
+// superinstructions are not dispatched, and instructions() stays in host
+// memory for the transforms instead of being copied next to them
 template <
   class Allocator,
-  class ExecutionPolicy>
+  class ExecutionPolicy,
+  instruction_layout Layout = instruction_layout::array_of_structs>
 class compiled_function {
  public:
-  using instructions_type = p3a::dynamic_array<::math_bytecode::instruction, Allocator, ExecutionPolicy>;
+  using instruction_type = typename Allocator::value_type;
+  static constexpr instruction_layout layout = Layout;
+  using instructions_type = std::conditional_t<layout == instruction_layout::structure_of_arrays,
+        p3a::dynamic_array<instruction_type, p3a::host_allocator<instruction_type>,
+          p3a::execution::sequenced_policy>,
+        p3a::dynamic_array<instruction_type, Allocator, ExecutionPolicy>>;
+  using stream_type = std::conditional_t<layout == instruction_layout::structure_of_arrays,
+        instruction_arrays<instruction_type>, instruction_type const*>;
+  using executable_type = basic_executable_function<instruction_type, stream_type>;
   using registers_type = p3a::dynamic_array<int, typename Allocator::template rebind<int>::other, ExecutionPolicy>;
+  using constant_type = typename instruction_type::constant_type;
+  using tables_type = p3a::dynamic_array<table_descriptor,
+        typename Allocator::template rebind<table_descriptor>::other, ExecutionPolicy>;
+  using table_data_type = p3a::dynamic_array<constant_type,
+        typename Allocator::template rebind<constant_type>::other, ExecutionPolicy>;
+  using output_stores_type = p3a::dynamic_array<output_store,
+        typename Allocator::template rebind<output_store>::other, ExecutionPolicy>;
+  using codes_type = p3a::dynamic_array<instruction_code,
+        typename Allocator::template rebind<instruction_code>::other, ExecutionPolicy>;
   compiled_function() = default;
   compiled_function(
-      std::vector<instruction> const& instructions_in,
+      std::vector<instruction_type> const& instructions_in,
       std::vector<int> const& input_registers_in,
       std::vector<int> const& output_registers_in,
-      int register_count_in)
+      int register_count_in,
+      std::vector<table_descriptor> const& tables_in = {},
+      std::vector<constant_type> const& table_data_in = {})
     :m_register_count(register_count_in)
   {
+    verify_bytecode(instructions_in, input_registers_in, output_registers_in,
+        register_count_in, int(tables_in.size()));
+    std::vector<int> input_registers = input_registers_in;
+    assign_unused_inputs(instructions_in, input_registers, output_registers_in, m_register_count);
+#ifdef MATH_BYTECODE_ENABLE_COUNTERS
+    m_counters = make_function_counters();
+    for (auto& in : instructions_in) {
+      m_counters->instruction_codes.push_back(primitive_code(in.code));
+    }
+#endif
     m_instructions.resize(instructions_in.size());
     p3a::copy(m_instructions.get_execution_policy(),
         instructions_in.cbegin(),
         instructions_in.cend(),
         m_instructions.begin());
-    m_input_registers.resize(input_registers_in.size());
+    m_input_registers.resize(input_registers.size());
     p3a::copy(m_input_registers.get_execution_policy(),
-        input_registers_in.cbegin(),
-        input_registers_in.cend(),
+        input_registers.cbegin(),
+        input_registers.cend(),
         m_input_registers.begin());
     m_output_registers.resize(output_registers_in.size());
     p3a::copy(m_output_registers.get_execution_policy(),
         output_registers_in.cbegin(),
         output_registers_in.cend(),
         m_output_registers.begin());
+    m_tables.resize(tables_in.size());
+    p3a::copy(m_tables.get_execution_policy(),
+        tables_in.cbegin(),
+        tables_in.cend(),
+        m_tables.begin());
+    m_table_data.resize(table_data_in.size());
+    p3a::copy(m_table_data.get_execution_policy(),
+        table_data_in.cbegin(),
+        table_data_in.cend(),
+        m_table_data.begin());
+    m_dependencies = find_dependencies(
+        instructions_in, input_registers, output_registers_in, m_register_count);
+    m_has_pinned_inputs = true;
+    for (std::size_t i = 0; i < input_registers.size(); ++i) {
+      if (input_registers[i] != int(i)) m_has_pinned_inputs = false;
+    }
+    auto const output_stores = find_output_stores(
+        instructions_in, output_registers_in, m_register_count);
+    m_output_stores.resize(output_stores.size());
+    p3a::copy(m_output_stores.get_execution_policy(),
+        output_stores.cbegin(),
+        output_stores.cend(),
+        m_output_stores.begin());
+    build_instruction_arrays(instructions_in);
   }
-  template <class Allocator2, class ExecutionPolicy2>
+  template <class Allocator2, class ExecutionPolicy2, instruction_layout Layout2>
   explicit
-  compiled_function(compiled_function<Allocator2, ExecutionPolicy2> const& other)
+  compiled_function(compiled_function<Allocator2, ExecutionPolicy2, Layout2> const& other)
     :m_register_count(other.register_count())
     ,m_instructions(other.instructions())
     ,m_input_registers(other.input_registers())
     ,m_output_registers(other.output_registers())
+    ,m_tables(other.tables())
+    ,m_table_data(other.table_data())
+    ,m_uniform_registers(other.uniform_registers())
+    ,m_prologue_count(other.prologue_count())
+    ,m_accuracy(other.accuracy())
+    ,m_dependencies(other.dependencies())
+    ,m_has_pinned_inputs(other.has_pinned_inputs())
+    ,m_output_stores(other.output_stores())
+#ifdef MATH_BYTECODE_ENABLE_COUNTERS
+    ,m_counters(other.counters())
+#endif
   {
+    build_instruction_arrays(m_instructions);
   }
   [[nodiscard]]
-  executable_function executable() const
+  executable_type executable() const
   {
-    return executable_function(
-        m_instructions.data(),
+    stream_type stream;
+    if constexpr (layout == instruction_layout::structure_of_arrays) {
+      stream.codes = m_codes.data();
+      stream.results = m_results.data();
+      stream.lefts = m_lefts.data();
+      stream.rights = m_rights.data();
+      stream.constants = m_constants.data();
+    } else {
+      stream = m_instructions.data();
+    }
+    return executable_type(
+        stream,
         int(m_instructions.size()),
         m_input_registers.data(),
         int(m_input_registers.size()),
         m_output_registers.data(),
-        int(m_output_registers.size()));
+        int(m_output_registers.size()),
+        {m_accuracy, m_tables.data(), m_table_data.data()},
+        m_prologue_count,
+        m_uniform_registers.data(),
+        int(m_uniform_registers.size()),
+        m_has_pinned_inputs,
+        m_output_stores.data(),
+        int(m_output_stores.size())
+#ifdef MATH_BYTECODE_ENABLE_COUNTERS
+        , m_counters.get()
+#endif
+        );
   }
   [[nodiscard]]
   instructions_type const&
@@ -545,17 +2837,793 @@ class compiled_function {
   output_registers() const { return m_output_registers; }
   [[nodiscard]]
   int register_count() const { return m_register_count; }
+  [[nodiscard]]
+  tables_type const&
+  tables() const { return m_tables; }
+  [[nodiscard]]
+  table_data_type const&
+  table_data() const { return m_table_data; }
+  [[nodiscard]]
+  math_accuracy accuracy() const { return m_accuracy; }
+  void set_accuracy(math_accuracy accuracy_in) { m_accuracy = accuracy_in; }
+  // whether output scalar output can change when input scalar input does.
+  // A function none of whose outputs depend on an input (time, say) can
+  // be evaluated once and its results reused
+  [[nodiscard]]
+  bool depends_on(int output, int input) const
+  {
+    return m_dependencies[std::size_t(output) * m_input_registers.size() + std::size_t(input)];
+  }
+  [[nodiscard]]
+  bool any_output_depends_on(int input) const
+  {
+    for (std::size_t o = 0; o < m_output_registers.size(); ++o) {
+      if (depends_on(int(o), input)) return true;
+    }
+    return false;
+  }
+  // output-major, as in find_dependencies
+  [[nodiscard]]
+  std::vector<bool> const& dependencies() const { return m_dependencies; }
+  // whether input scalar i is in register i, so that a register file for
+  // execute_batch can start with the inputs laid out as for evaluate_batch
+  [[nodiscard]]
+  bool has_pinned_inputs() const { return m_has_pinned_inputs; }
+  // the team shared memory evaluate_team needs for team_size threads
+  template <class ScalarType = double>
+  [[nodiscard]]
+  std::size_t team_scratch_bytes(int team_size) const
+  {
+    return team_registers_offset<stream_type>(int(m_instructions.size())) +
+      sizeof(ScalarType) * std::size_t(m_register_count) * std::size_t(team_size);
+  }
+  // the outputs evaluate_batch writes without copying them from registers
+  [[nodiscard]]
+  output_stores_type const&
+  output_stores() const { return m_output_stores; }
+  // the first prologue_count instructions only depend on uniform inputs, and
+  // uniform_registers are the ones they write that the rest of the batch reads
+  [[nodiscard]]
+  int prologue_count() const { return m_prologue_count; }
+  [[nodiscard]]
+  registers_type const&
+  uniform_registers() const { return m_uniform_registers; }
+  void set_prologue(int prologue_count_in, std::vector<int> const& uniform_registers_in)
+  {
+    m_prologue_count = prologue_count_in;
+    m_uniform_registers.resize(uniform_registers_in.size());
+    p3a::copy(m_uniform_registers.get_execution_policy(),
+        uniform_registers_in.cbegin(),
+        uniform_registers_in.cend(),
+        m_uniform_registers.begin());
+  }
+#ifdef MATH_BYTECODE_ENABLE_COUNTERS
+  [[nodiscard]]
+  std::shared_ptr<function_counters> const&
+  counters() const { return m_counters; }
+#endif
  private:
+  template <class T, class Array>
+  static void assign(Array& array, std::vector<T> const& values)
+  {
+    array.resize(values.size());
+    p3a::copy(array.get_execution_policy(), values.cbegin(), values.cend(), array.begin());
+  }
+  // host_instructions are in host memory
+  template <class Instructions>
+  void build_instruction_arrays(Instructions const& host_instructions)
+  {
+    if constexpr (layout == instruction_layout::structure_of_arrays) {
+      auto const values = split_instructions<instruction_type>(host_instructions);
+      assign(m_codes, values.codes);
+      assign(m_results, values.results);
+      assign(m_lefts, values.lefts);
+      assign(m_rights, values.rights);
+      assign(m_constants, values.constants);
+    }
+  }
   instructions_type m_instructions;
+  codes_type m_codes;
+  registers_type m_results;
+  registers_type m_lefts;
+  registers_type m_rights;
+  table_data_type m_constants;
   registers_type m_input_registers;
   registers_type m_output_registers;
+  tables_type m_tables;
+  table_data_type m_table_data;
+  registers_type m_uniform_registers;
+  int m_prologue_count{0};
   int m_register_count;
+  math_accuracy m_accuracy{math_accuracy::library};
+  std::vector<bool> m_dependencies;
+  bool m_has_pinned_inputs{false};
+  output_stores_type m_output_stores;
+#ifdef MATH_BYTECODE_ENABLE_COUNTERS
+  std::shared_ptr<function_counters> m_counters;
+#endif
 };
 
 using host_function = compiled_function<p3a::host_allocator<instruction>, p3a::execution::sequenced_policy>;
 using device_function = compiled_function<p3a::device_allocator<instruction>, p3a::execution::parallel_policy>;
+using host_single_function = compiled_function<p3a::host_allocator<single_instruction>, p3a::execution::sequenced_policy>;
+using device_single_function = compiled_function<p3a::device_allocator<single_instruction>, p3a::execution::parallel_policy>;
+using host_mixed_function = compiled_function<p3a::host_allocator<mixed_instruction>, p3a::execution::sequenced_policy>;
+using device_mixed_function = compiled_function<p3a::device_allocator<mixed_instruction>, p3a::execution::parallel_policy>;
+
+// where the pieces of one function of a table are in its shared arrays
+class function_table_entry {
+ public:
+  std::int32_t instruction_offset;
+  std::int32_t instruction_count;
+  std::int32_t input_offset;
+  std::int32_t output_offset;
+  std::int32_t uniform_offset;
+  std::int32_t uniform_count;
+  std::int32_t prologue_count;
+  std::int32_t table_offset;
+  std::int32_t table_data_offset;
+  std::int32_t output_store_offset;
+  std::int32_t output_store_count;
+  bool has_pinned_inputs;
+  math_accuracy accuracy;
+#ifdef MATH_BYTECODE_ENABLE_COUNTERS
+  function_counters* counters;
+#endif
+};
+
+// the elements order[first] through order[first + count - 1], which all
+// evaluate the same function of a table
+class function_work_item {
+ public:
+  std::int32_t function;
+  std::int32_t first;
+  std::int32_t count;
+};
+
+// the elements that evaluate function f of a table are
+// order[offsets[f]] through order[offsets[f + 1] - 1], in increasing order.
+// work_items cuts them into runs of at most batch_size, function by function
+class function_schedule {
+ public:
+  std::vector<int> order;
+  std::vector<int> offsets;
+  std::vector<function_work_item> work_items;
+};
+
+// a counting sort of the elements by function_ids[element]
+[[nodiscard]]
+function_schedule schedule_by_function(
+    int function_count,
+    int element_count,
+    int const* function_ids,
+    int batch_size);
+
+// what evaluate_bucket reads of a compiled_function_schedule
+class executable_function_schedule {
+ public:
+  int const* order{nullptr};
+  function_work_item const* work_items{nullptr};
+  int work_item_count{0};
+  int batch_size{0};
+  int element_count{0};
+};
+
+// Stream is how the instructions are read, as for basic_executable_function
+template <class Instruction, class Stream = Instruction const*>
+class basic_executable_function_table {
+ public:
+  P3A_ALWAYS_INLINE basic_executable_function_table() = default;
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  basic_executable_function_table(
+      function_table_entry const* entries_in,
+      int function_count_in,
+      Stream instructions_in,
+      int const* input_registers_in,
+      int input_count_in,
+      int const* output_registers_in,
+      int output_count_in,
+      int const* uniform_registers_in,
+      table_descriptor const* tables_in,
+      typename Instruction::constant_type const* table_data_in,
+      output_store const* output_stores_in,
+      int register_count_in)
+    :entries(entries_in)
+    ,function_count(function_count_in)
+    ,instructions(instructions_in)
+    ,input_registers(input_registers_in)
+    ,input_count(input_count_in)
+    ,output_registers(output_registers_in)
+    ,output_count(output_count_in)
+    ,uniform_registers(uniform_registers_in)
+    ,tables(tables_in)
+    ,table_data(table_data_in)
+    ,output_stores(output_stores_in)
+    ,register_count(register_count_in)
+  {
+  }
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  basic_executable_function<Instruction, Stream> operator[](int function_id) const
+  {
+    function_table_entry const& entry = entries[function_id];
+    return basic_executable_function<Instruction, Stream>(
+        stream_from(instructions, entry.instruction_offset),
+        entry.instruction_count,
+        input_registers + entry.input_offset,
+        input_count,
+        output_registers + entry.output_offset,
+        output_count,
+        {entry.accuracy, tables + entry.table_offset, table_data + entry.table_data_offset},
+        entry.prologue_count,
+        uniform_registers + entry.uniform_offset,
+        entry.uniform_count,
+        entry.has_pinned_inputs,
+        output_stores + entry.output_store_offset,
+        entry.output_store_count
+#ifdef MATH_BYTECODE_ENABLE_COUNTERS
+        , entry.counters
+#endif
+        );
+  }
+  [[nodiscard]] P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  int size() const { return function_count; }
+  // enough for any function of the table
+  [[nodiscard]] P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  int registers_per_point() const { return register_count; }
+  // evaluates the elements of work item w of schedule, input (output)
+  // scalar j of element e being inputs[j * schedule.element_count + e]
+  // (outputs[j * schedule.element_count + e]), with registers holding
+  // registers_per_point() * schedule.batch_size values for this work item
+  // alone. The work items are independent, so a kernel runs one per index
+  // in [0, schedule.work_item_count), each with its own slice of registers;
+  // work items are in function order, so neighbouring ones run the same
+  // instruction stream except where one function's work items end. The
+  // elements are gathered into the registers and scattered back through
+  // schedule.order, which is why the outputs are copied from registers
+  // rather than written by the output_stores of the function
+  template <class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  inline void evaluate_bucket(
+      int w,
+      executable_function_schedule const& schedule,
+      ScalarType* registers,
+      ScalarType const* inputs,
+      ScalarType* outputs) const
+  {
+    function_work_item const item = schedule.work_items[w];
+    function_table_entry const& entry = entries[item.function];
+    int const* const order = schedule.order + item.first;
+    std::ptrdiff_t const element_count = schedule.element_count;
+    for (int j = 0; j < input_count; ++j) {
+      int const r = input_registers[entry.input_offset + j];
+      ScalarType* const destination = registers + std::ptrdiff_t(r) * item.count;
+      for (int p = 0; p < item.count; ++p) {
+        destination[p] = inputs[j * element_count + order[p]];
+      }
+    }
+    (*this)[item.function].execute_batch(registers, item.count);
+    for (int j = 0; j < output_count; ++j) {
+      int const r = output_registers[entry.output_offset + j];
+      ScalarType const* const source = registers + std::ptrdiff_t(r) * item.count;
+      for (int p = 0; p < item.count; ++p) {
+        outputs[j * element_count + order[p]] = source[p];
+      }
+    }
+  }
+  // runs every work item of schedule in turn with the same registers
+  template <class ScalarType>
+  P3A_HOST_DEVICE P3A_ALWAYS_INLINE
+  inline void evaluate_batch(
+      ScalarType* registers,
+      executable_function_schedule const& schedule,
+      ScalarType const* inputs,
+      ScalarType* outputs) const
+  {
+    for (int w = 0; w < schedule.work_item_count; ++w) {
+      evaluate_bucket(w, schedule, registers, inputs, outputs);
+    }
+  }
+ private:
+  function_table_entry const* entries{nullptr};
+  int function_count{0};
+  Stream instructions{};
+  int const* input_registers{nullptr};
+  int input_count{0};
+  int const* output_registers{nullptr};
+  int output_count{0};
+  int const* uniform_registers{nullptr};
+  table_descriptor const* tables{nullptr};
+  typename Instruction::constant_type const* table_data{nullptr};
+  output_store const* output_stores{nullptr};
+  int register_count{0};
+};
+
+// a schedule_by_function in the memory of a compiled_function_table. The
+// function IDs of a field seldom change, so it is built once on the host
+// and reused by every evaluation of the field
+template <
+  class Allocator,
+  class ExecutionPolicy>
+class compiled_function_schedule {
+ public:
+  using order_type = p3a::dynamic_array<int,
+        typename Allocator::template rebind<int>::other, ExecutionPolicy>;
+  using work_items_type = p3a::dynamic_array<function_work_item,
+        typename Allocator::template rebind<function_work_item>::other, ExecutionPolicy>;
+  compiled_function_schedule() = default;
+  // function_ids are in host memory
+  compiled_function_schedule(
+      int function_count,
+      int element_count,
+      int const* function_ids,
+      int batch_size)
+    :m_element_count(element_count)
+    ,m_batch_size(batch_size)
+  {
+    auto const schedule = schedule_by_function(
+        function_count, element_count, function_ids, batch_size);
+    copy_in(schedule.order, m_order);
+    copy_in(schedule.work_items, m_work_items);
+  }
+  [[nodiscard]]
+  executable_function_schedule executable() const
+  {
+    executable_function_schedule result;
+    result.order = m_order.data();
+    result.work_items = m_work_items.data();
+    result.work_item_count = int(m_work_items.size());
+    result.batch_size = m_batch_size;
+    result.element_count = m_element_count;
+    return result;
+  }
+  [[nodiscard]]
+  order_type const& order() const { return m_order; }
+  [[nodiscard]]
+  work_items_type const& work_items() const { return m_work_items; }
+  [[nodiscard]]
+  int work_item_count() const { return int(m_work_items.size()); }
+  [[nodiscard]]
+  int element_count() const { return m_element_count; }
+  [[nodiscard]]
+  int batch_size() const { return m_batch_size; }
+ private:
+  template <class T, class Array>
+  static void copy_in(std::vector<T> const& values, Array& array)
+  {
+    array.resize(values.size());
+    p3a::copy(array.get_execution_policy(), values.cbegin(), values.cend(), array.begin());
+  }
+  order_type m_order;
+  work_items_type m_work_items;
+  int m_element_count{0};
+  int m_batch_size{0};
+};
+
+// many functions with the same inputs and outputs in one set of arrays, so
+// that a field can pick one per element without a launch per function.
+// Layout is that of the functions it returns, as for compiled_function
+template <
+  class Allocator,
+  class ExecutionPolicy,
+  instruction_layout Layout = instruction_layout::array_of_structs>
+class compiled_function_table {
+ public:
+  using instruction_type = typename Allocator::value_type;
+  static constexpr instruction_layout layout = Layout;
+  using function_type = compiled_function<Allocator, ExecutionPolicy, Layout>;
+  using host_function_type = compiled_function<
+    p3a::host_allocator<instruction_type>, p3a::execution::sequenced_policy>;
+  using instructions_type = typename function_type::instructions_type;
+  using stream_type = typename function_type::stream_type;
+  using registers_type = typename function_type::registers_type;
+  using tables_type = typename function_type::tables_type;
+  using table_data_type = typename function_type::table_data_type;
+  using output_stores_type = typename function_type::output_stores_type;
+  using codes_type = typename function_type::codes_type;
+  using constant_type = typename function_type::constant_type;
+  using entries_type = p3a::dynamic_array<function_table_entry,
+        typename Allocator::template rebind<function_table_entry>::other, ExecutionPolicy>;
+  using executable_type = basic_executable_function_table<instruction_type, stream_type>;
+  using schedule_type = compiled_function_schedule<Allocator, ExecutionPolicy>;
+  compiled_function_table() = default;
+  explicit compiled_function_table(std::vector<host_function_type> const& functions)
+  {
+    std::vector<function_table_entry> entries;
+    std::vector<instruction_type> instructions;
+    std::vector<int> input_registers;
+    std::vector<int> output_registers;
+    std::vector<int> uniform_registers;
+    std::vector<table_descriptor> tables;
+    std::vector<constant_type> table_data;
+    std::vector<output_store> output_stores;
+    for (auto const& function : functions) {
+      if (entries.empty()) {
+        m_input_count = int(function.input_registers().size());
+        m_output_count = int(function.output_registers().size());
+      } else if (int(function.input_registers().size()) != m_input_count ||
+          int(function.output_registers().size()) != m_output_count) {
+        throw std::invalid_argument(
+            "the functions of a table need the same numbers of inputs and outputs");
+      }
+      function_table_entry entry;
+      entry.instruction_offset = std::int32_t(instructions.size());
+      entry.instruction_count = std::int32_t(function.instructions().size());
+      entry.input_offset = std::int32_t(input_registers.size());
+      entry.output_offset = std::int32_t(output_registers.size());
+      entry.uniform_offset = std::int32_t(uniform_registers.size());
+      entry.uniform_count = std::int32_t(function.uniform_registers().size());
+      entry.prologue_count = std::int32_t(function.prologue_count());
+      entry.table_offset = std::int32_t(tables.size());
+      entry.table_data_offset = std::int32_t(table_data.size());
+      entry.output_store_offset = std::int32_t(output_stores.size());
+      entry.output_store_count = std::int32_t(function.output_stores().size());
+      entry.has_pinned_inputs = function.has_pinned_inputs();
+      entry.accuracy = function.accuracy();
+#ifdef MATH_BYTECODE_ENABLE_COUNTERS
+      entry.counters = function.counters().get();
+      m_counters.push_back(function.counters());
+#endif
+      entries.push_back(entry);
+      instructions.insert(instructions.end(),
+          function.instructions().cbegin(), function.instructions().cend());
+      input_registers.insert(input_registers.end(),
+          function.input_registers().cbegin(), function.input_registers().cend());
+      output_registers.insert(output_registers.end(),
+          function.output_registers().cbegin(), function.output_registers().cend());
+      uniform_registers.insert(uniform_registers.end(),
+          function.uniform_registers().cbegin(), function.uniform_registers().cend());
+      tables.insert(tables.end(),
+          function.tables().cbegin(), function.tables().cend());
+      table_data.insert(table_data.end(),
+          function.table_data().cbegin(), function.table_data().cend());
+      output_stores.insert(output_stores.end(),
+          function.output_stores().cbegin(), function.output_stores().cend());
+      m_register_count = std::max(m_register_count, function.register_count());
+    }
+    copy_in(entries, m_entries);
+    copy_in(instructions, m_instructions);
+    copy_in(input_registers, m_input_registers);
+    copy_in(output_registers, m_output_registers);
+    copy_in(uniform_registers, m_uniform_registers);
+    copy_in(tables, m_tables);
+    copy_in(table_data, m_table_data);
+    copy_in(output_stores, m_output_stores);
+    build_instruction_arrays(instructions);
+  }
+  template <class Allocator2, class ExecutionPolicy2, instruction_layout Layout2>
+  explicit
+  compiled_function_table(compiled_function_table<Allocator2, ExecutionPolicy2, Layout2> const& other)
+    :m_entries(other.entries())
+    ,m_instructions(other.instructions())
+    ,m_input_registers(other.input_registers())
+    ,m_output_registers(other.output_registers())
+    ,m_uniform_registers(other.uniform_registers())
+    ,m_tables(other.tables())
+    ,m_table_data(other.table_data())
+    ,m_output_stores(other.output_stores())
+    ,m_input_count(other.input_count())
+    ,m_output_count(other.output_count())
+    ,m_register_count(other.register_count())
+#ifdef MATH_BYTECODE_ENABLE_COUNTERS
+    ,m_counters(other.counters())
+#endif
+  {
+    build_instruction_arrays(m_instructions);
+  }
+  [[nodiscard]]
+  executable_type executable() const
+  {
+    stream_type stream;
+    if constexpr (layout == instruction_layout::structure_of_arrays) {
+      stream.codes = m_codes.data();
+      stream.results = m_results.data();
+      stream.lefts = m_lefts.data();
+      stream.rights = m_rights.data();
+      stream.constants = m_constants.data();
+    } else {
+      stream = m_instructions.data();
+    }
+    return executable_type(
+        m_entries.data(),
+        int(m_entries.size()),
+        stream,
+        m_input_registers.data(),
+        m_input_count,
+        m_output_registers.data(),
+        m_output_count,
+        m_uniform_registers.data(),
+        m_tables.data(),
+        m_table_data.data(),
+        m_output_stores.data(),
+        m_register_count);
+  }
+  // sorts element_count elements by their function_ids (in host memory)
+  // into work items of at most batch_size elements for evaluate_bucket
+  [[nodiscard]]
+  schedule_type schedule(int element_count, int const* function_ids, int batch_size) const
+  {
+    return schedule_type(size(), element_count, function_ids, batch_size);
+  }
+  [[nodiscard]]
+  int size() const { return int(m_entries.size()); }
+  [[nodiscard]]
+  entries_type const& entries() const { return m_entries; }
+  [[nodiscard]]
+  instructions_type const& instructions() const { return m_instructions; }
+  [[nodiscard]]
+  registers_type const& input_registers() const { return m_input_registers; }
+  [[nodiscard]]
+  registers_type const& output_registers() const { return m_output_registers; }
+  [[nodiscard]]
+  registers_type const& uniform_registers() const { return m_uniform_registers; }
+  [[nodiscard]]
+  tables_type const& tables() const { return m_tables; }
+  [[nodiscard]]
+  table_data_type const& table_data() const { return m_table_data; }
+  [[nodiscard]]
+  output_stores_type const& output_stores() const { return m_output_stores; }
+  [[nodiscard]]
+  int input_count() const { return m_input_count; }
+  [[nodiscard]]
+  int output_count() const { return m_output_count; }
+  // the most registers any of the functions needs
+  [[nodiscard]]
+  int register_count() const { return m_register_count; }
+#ifdef MATH_BYTECODE_ENABLE_COUNTERS
+  [[nodiscard]]
+  std::vector<std::shared_ptr<function_counters>> const&
+  counters() const { return m_counters; }
+#endif
+ private:
+  template <class T, class Array>
+  static void copy_in(std::vector<T> const& values, Array& array)
+  {
+    array.resize(values.size());
+    p3a::copy(array.get_execution_policy(), values.cbegin(), values.cend(), array.begin());
+  }
+  // host_instructions are in host memory. The left operands of the
+  // assign_constants index the constants of the whole table, so the
+  // arrays of one function are found by offsetting the others only
+  template <class Instructions>
+  void build_instruction_arrays(Instructions const& host_instructions)
+  {
+    if constexpr (layout == instruction_layout::structure_of_arrays) {
+      auto const values = split_instructions<instruction_type>(host_instructions);
+      copy_in(values.codes, m_codes);
+      copy_in(values.results, m_results);
+      copy_in(values.lefts, m_lefts);
+      copy_in(values.rights, m_rights);
+      copy_in(values.constants, m_constants);
+    }
+  }
+  entries_type m_entries;
+  instructions_type m_instructions;
+  codes_type m_codes;
+  registers_type m_results;
+  registers_type m_lefts;
+  registers_type m_rights;
+  table_data_type m_constants;
+  registers_type m_input_registers;
+  registers_type m_output_registers;
+  registers_type m_uniform_registers;
+  tables_type m_tables;
+  table_data_type m_table_data;
+  output_stores_type m_output_stores;
+  int m_input_count{0};
+  int m_output_count{0};
+  int m_register_count{0};
+#ifdef MATH_BYTECODE_ENABLE_COUNTERS
+  std::vector<std::shared_ptr<function_counters>> m_counters;
+#endif
+};
+
+using host_function_table = compiled_function_table<p3a::host_allocator<instruction>, p3a::execution::sequenced_policy>;
+using device_function_table = compiled_function_table<p3a::device_allocator<instruction>, p3a::execution::parallel_policy>;
+
+// tabulated data for the table1d(name, x) and table2d(name, x, y) builtins.
+// The abscissas must be increasing and values[j * x.size() + i] is the
+// value at (x[i], y[j]); y is left empty for a one-dimensional table
+class table {
+ public:
+  std::vector<double> x;
+  std::vector<double> y;
+  std::vector<double> values;
+  interpolation method{interpolation::linear};
+};
+
+class compile_options {
+ public:
+  bool verbose{false};
+  math_accuracy accuracy{math_accuracy::library};
+  std::map<std::string, table> tables;
+  // puts input scalar i in register i (see has_pinned_inputs)
+  bool pin_inputs{false};
+  // applies reduce_strength to the compiled function
+  bool reduce_strength{false};
+  bool reciprocal_division{false};
+};
 
 [[nodiscard]]
 host_function compile(std::string const& source_code, bool verbose = false);
+[[nodiscard]]
+host_function compile(std::string const& source_code, compile_options const& options);
+
+// the file is memory-mapped and lexed in place where the platform allows
+[[nodiscard]]
+host_function compile_file(
+    std::string const& path,
+    compile_options const& options = compile_options());
+
+class compile_result {
+ public:
+  host_function function;
+  // empty if compilation succeeded
+  std::string error;
+};
+
+// compiles the sources on thread_count threads (zero means one per core),
+// returning the results in the same order
+[[nodiscard]]
+std::vector<compile_result> compile_many(
+    std::vector<std::string> const& source_codes,
+    compile_options const& options = compile_options(),
+    int thread_count = 0);
+
+// the result computes the same outputs followed by the derivative of
+// each output with respect to each input in wrt (output-major order)
+[[nodiscard]]
+host_function differentiate(
+    host_function const& function,
+    std::vector<int> const& wrt,
+    bool verbose = false);
+
+// reorders the function so that what only depends on the uniform inputs
+// (the same for every point of a batch) comes first, and execute_batch
+// then computes it once per batch
+[[nodiscard]]
+host_function hoist_uniform(
+    host_function const& function,
+    std::vector<int> const& uniform_inputs,
+    bool verbose = false);
+
+// the inputs in bound_inputs are replaced by the given values, which are
+// propagated through the function, and whatever no longer affects the
+// outputs is removed. The bound inputs are still accepted but ignored
+[[nodiscard]]
+host_function specialize(
+    host_function const& function,
+    std::map<int, double> const& bound_inputs,
+    bool verbose = false);
+
+// rewrites pow with a constant exponent: small integer exponents become
+// multiplications by repeated squaring (and a reciprocal if negative) while
+// the rounding errors stay within the accuracy of pow: x^2 and x^-1, or up to
+// x^5 and x^-4 with math_accuracy::four_ulp. 0.5 becomes the single pow_half
+// instruction, a sqrt that gives +0 and +infinity for -0 and -infinity as pow
+// does. Division by a constant becomes multiplication by its reciprocal if
+// that is exact (a power of two), or for any constant with
+// reciprocal_division, which rounds differently
+[[nodiscard]]
+host_function reduce_strength(
+    host_function const& function,
+    bool reciprocal_division = false,
+    bool verbose = false);
+
+// constants are rounded to float and everything runs in single precision
+[[nodiscard]]
+host_single_function to_single_precision(host_function const& function);
+
+// constants and registers stay double, but division and the math
+// functions other than pow are evaluated in single precision
+[[nodiscard]]
+host_mixed_function to_mixed_precision(host_function const& function);
+
+enum class evaluation_strategy {
+  scalar,
+  batch
+};
+
+char const* strategy_name(evaluation_strategy strategy);
+
+// how an auto_function evaluates, and what that cost during calibration
+class evaluation_plan {
+ public:
+  evaluation_strategy strategy{evaluation_strategy::scalar};
+  int batch_size{1};
+  double nanoseconds_per_point{0.0};
+};
+
+std::ostream& operator<<(std::ostream& stream, evaluation_plan const& plan);
+
+// evaluates points with whichever of the scalar interpreter or
+// execute_batch (at a few batch sizes) was fastest on this machine. The
+// first call with at least calibration_points points times each of them
+// on those points, and the choice is kept from then on
+class auto_function {
+ public:
+  explicit auto_function(host_function function_in, int calibration_points_in = 1024);
+  // input (output) scalar j of point p is inputs[j * count + p]
+  // (outputs[j * count + p]), as in evaluate_batch
+  void evaluate(int count, double const* inputs, double* outputs);
+  [[nodiscard]]
+  bool is_calibrated() const { return calibrated; }
+  [[nodiscard]]
+  evaluation_plan const& plan() const { return chosen_plan; }
+  // every plan that was timed, in the order they were tried
+  [[nodiscard]]
+  std::vector<evaluation_plan> const& candidates() const { return timed_plans; }
+  [[nodiscard]]
+  host_function const& function() const { return wrapped; }
+ private:
+  // evaluates points first through last - 1
+  void evaluate_with(
+      evaluation_plan const& plan,
+      int count,
+      int first,
+      int last,
+      double const* inputs,
+      double* outputs);
+  void calibrate(int count, double const* inputs, double* outputs);
+  host_function wrapped;
+  int calibration_points;
+  bool calibrated{false};
+  evaluation_plan chosen_plan;
+  std::vector<evaluation_plan> timed_plans;
+  std::vector<double> registers;
+};
+
+// host threads that are started once and reused by evaluate_parallel. The
+// calling thread takes part as thread zero, so a pool of size one has no
+// threads of its own
+class thread_pool {
+ public:
+  // zero means one thread per core
+  explicit thread_pool(int thread_count = 0);
+  thread_pool(thread_pool const&) = delete;
+  thread_pool& operator=(thread_pool const&) = delete;
+  ~thread_pool();
+  [[nodiscard]]
+  int size() const;
+  // calls task(thread_index) once on each thread and waits for all of them.
+  // Calls from different threads run one after another; a task must not
+  // call run on its own pool, which would wait for itself
+  void run(std::function<void(int)> const& task);
+ private:
+  class state;
+  std::unique_ptr<state> m_state;
+};
+
+// evaluates count points laid out as in evaluate_batch on the threads of
+// the pool, each with its own registers. The points are cut into chunks of
+// chunk_size (zero picks one whose registers fit in a level one cache).
+// Every thread starts with an equal share of the chunks and, once it has
+// run out, steals half of what another thread has left
+void evaluate_parallel(
+    host_function const& function,
+    thread_pool& pool,
+    int count,
+    double const* inputs,
+    double* outputs,
+    int chunk_size = 0);
+
+// how many times each sequence of two or three consecutive instructions ran
+class sequence_profile {
+ public:
+  void add(host_function const& function, std::uint64_t evaluation_count = 1);
+  std::map<std::vector<instruction_code>, std::uint64_t> counts;
+};
+
+#ifdef MATH_BYTECODE_ENABLE_COUNTERS
+// the sequences that ran in the functions evaluated since the last reset
+[[nodiscard]]
+sequence_profile profile_counters();
+#endif
+
+// writes a math_bytecode_superinstructions.hpp that fuses the count
+// sequences that save the most dispatches in the profile
+void write_superinstructions(
+    std::ostream& stream,
+    sequence_profile const& profile,
+    int count);
 
 }
@@ -0,0 +1,70 @@
+#include "math_bytecode.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+// compiles generated functions of growing size and prints the heap
+// allocations and time per statement, which stay flat when compiling
+// allocates amortized O(1) per statement
+
+static std::atomic<long long> allocation_count{0};
+
+void* operator new(std::size_t size)
+{
+  ++allocation_count;
+  if (void* pointer = std::malloc(size == 0 ? 1 : size)) return pointer;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept
+{
+  std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept
+{
+  std::free(pointer);
+}
+
+static std::string generate_source(int statement_count)
+{
+  std::string source = "void f(double x, double y, double& result) {\n";
+  source += "  double v0 = x * y + 1.0;\n";
+  for (int i = 1; i < statement_count; ++i) {
+    std::string const previous = "v" + std::to_string(i - 1);
+    source += "  double v" + std::to_string(i) + " = " + previous + " * x + sin(" +
+      previous + ") * y - 0.5;\n";
+  }
+  source += "  result = v" + std::to_string(statement_count - 1) + ";\n}\n";
+  return source;
+}
+
+int main()
+{
+  int const repetitions = 5;
+  std::printf("%10s %12s %12s %12s\n", "statements", "allocations", "per stmt", "ms");
+  for (int statement_count : {100, 400, 1600, 6400}) {
+    std::string const source = generate_source(statement_count);
+    long long allocations = 0;
+    double best_milliseconds = 0.0;
+    for (int r = 0; r < repetitions; ++r) {
+      long long const first_count = allocation_count;
+      auto const start = std::chrono::steady_clock::now();
+      auto const function = math_bytecode::compile(source);
+      auto const stop = std::chrono::steady_clock::now();
+      allocations = allocation_count - first_count;
+      double const milliseconds =
+        std::chrono::duration<double, std::milli>(stop - start).count();
+      best_milliseconds = (r == 0) ? milliseconds : std::min(best_milliseconds, milliseconds);
+      if (function.instructions().size() == 0) return 1;
+    }
+    std::printf("%10d %12lld %12.2f %12.3f\n", statement_count, allocations,
+        double(allocations) / statement_count, best_milliseconds);
+  }
+  return 0;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+// generated by math_bytecode::write_superinstructions from an opcode
+// sequence profile; regenerate it from the profile of another workload
+#define MATH_BYTECODE_SUPERINSTRUCTIONS(X) \
+  X(assign_constant_multiply_multiply, instruction_code::assign_constant, instruction_code::multiply, instruction_code::multiply) \
+  X(multiply_multiply_add, instruction_code::multiply, instruction_code::multiply, instruction_code::add) \
+  X(multiply_multiply_multiply, instruction_code::multiply, instruction_code::multiply, instruction_code::multiply) \
+  X(add_assign_constant_multiply, instruction_code::add, instruction_code::assign_constant, instruction_code::multiply) \
+  X(multiply_add_assign_constant, instruction_code::multiply, instruction_code::add, instruction_code::assign_constant) \
+  X(multiply_multiply, instruction_code::multiply, instruction_code::multiply) \
+  X(multiply_add, instruction_code::multiply, instruction_code::add) \
+  X(assign_constant_multiply, instruction_code::assign_constant, instruction_code::multiply)
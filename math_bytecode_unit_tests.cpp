@@ -1,8 +1,35 @@
 #include <gtest/gtest.h>
 #include <Kokkos_Core.hpp>
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
 #include "math_bytecode.hpp"
 
+// the number of doubles between a and b
+static std::int64_t ulp_distance(double a, double b)
+{
+  auto const ordered = [] (double x) {
+    std::int64_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    return bits < 0 ? std::numeric_limits<std::int64_t>::min() - bits : bits;
+  };
+  return std::abs(ordered(a) - ordered(b));
+}
+
+using soa_function = math_bytecode::compiled_function<
+  p3a::host_allocator<math_bytecode::instruction>,
+  p3a::execution::sequenced_policy,
+  math_bytecode::instruction_layout::structure_of_arrays>;
+
 TEST(compiled_function, copy_to_device)
 {
   math_bytecode::host_function hf = math_bytecode::compile(
@@ -13,6 +40,107 @@ TEST(compiled_function, copy_to_device)
   math_bytecode::device_function df(hf);
 }
 
+TEST(execute, instruction_arrays)
+{
+  auto host_function = math_bytecode::compile(
+      "void f(const double x[3], const double n[3], double a, double out[5]) {\n"
+      "  out[0] = a * x[0] * x[0] + 2.5 * x[1];\n"
+      "  out[1] = norm(x);\n"
+      "  double c = cross(x, n);\n"
+      "  out[2] = c[0] - 1.0;\n"
+      "  out[3] = c[2];\n"
+      "  out[4] = 0.0;\n"
+      "  if (a > x[2]) { out[4] = sin(a); }\n"
+      "}\n");
+  static_assert(math_bytecode::device_function::layout ==
+      math_bytecode::instruction_layout::array_of_structs);
+  soa_function const arrays_function(host_function);
+  int const count = 3;
+  std::vector<double> registers(std::size_t(host_function.register_count() * count));
+  double inputs[7 * count];
+  for (int k = 0; k < 7 * count; ++k) inputs[k] = 0.3 * k - 1.0;
+  double expected[5 * count];
+  double outputs[5 * count];
+  host_function.executable().evaluate_batch(registers.data(), count, inputs, expected);
+  arrays_function.executable().evaluate_batch(registers.data(), count, inputs, outputs);
+  for (int k = 0; k < 5 * count; ++k) EXPECT_EQ(outputs[k], expected[k]);
+  for (int p = 0; p < count; ++p) {
+    arrays_function.executable().evaluate_point(registers.data(), count, p, inputs, outputs);
+  }
+  for (int k = 0; k < 5 * count; ++k) EXPECT_EQ(outputs[k], expected[k]);
+}
+
+// host threads standing in for the threads of a device team
+class host_team {
+ public:
+  class shared_state {
+   public:
+    std::mutex mutex;
+    std::condition_variable arrived;
+    int waiting{0};
+    int generation{0};
+  };
+  int rank;
+  int size;
+  shared_state* state;
+  int team_rank() const { return rank; }
+  int team_size() const { return size; }
+  void team_barrier() const
+  {
+    std::unique_lock<std::mutex> lock(state->mutex);
+    int const generation = state->generation;
+    if (++state->waiting == size) {
+      state->waiting = 0;
+      ++state->generation;
+      state->arrived.notify_all();
+    } else {
+      state->arrived.wait(lock, [&] { return state->generation != generation; });
+    }
+  }
+};
+
+TEST(execute, evaluate_team)
+{
+  auto host_function = math_bytecode::compile(
+      "void f(const double x[3], double a, double out[2]) {\n"
+      "  out[0] = a * norm(x) + exp(-a);\n"
+      "  out[1] = pow(x[1], 3) - x[2] / a;\n"
+      "}\n");
+  soa_function const arrays_function(host_function);
+  int const count = 11;
+  std::vector<double> inputs(4 * count);
+  for (std::size_t k = 0; k < inputs.size(); ++k) inputs[k] = 0.25 * double(k) + 0.5;
+  std::vector<double> expected(2 * count);
+  std::vector<double> registers(std::size_t(host_function.register_count() * count));
+  host_function.executable().evaluate_batch(registers.data(), count, inputs.data(), expected.data());
+  int const team_size = 4;
+  auto const run = [&] (auto const& function) {
+    std::vector<double> outputs(2 * count, 0.0);
+    // doubles keep the scratch aligned
+    std::vector<double> scratch(function.template team_scratch_bytes<double>(team_size) / sizeof(double) + 1);
+    host_team::shared_state state;
+    auto const executable = function.executable();
+    std::vector<std::thread> threads;
+    for (int rank = 0; rank < team_size; ++rank) {
+      threads.emplace_back([&, rank] {
+        host_team const team{rank, team_size, &state};
+        // two chunks through the same scratch
+        int const middle = count / 2;
+        executable.evaluate_team(team, scratch.data(), count, 1, middle, inputs.data(), outputs.data());
+        executable.evaluate_team(team, scratch.data(), count, middle, count, inputs.data(), outputs.data());
+      });
+    }
+    for (auto& thread : threads) thread.join();
+    EXPECT_EQ(outputs[0], 0.0);
+    for (int p = 1; p < count; ++p) {
+      EXPECT_EQ(outputs[std::size_t(p)], expected[std::size_t(p)]);
+      EXPECT_EQ(outputs[std::size_t(count + p)], expected[std::size_t(count + p)]);
+    }
+  };
+  run(host_function);
+  run(arrays_function);
+}
+
 TEST(execute, on_host)
 {
   auto host_function = math_bytecode::compile(
@@ -27,6 +155,25 @@ TEST(execute, on_host)
   EXPECT_EQ(rho, 1.0);
 }
 
+TEST(compiled_function, coalesce_copies)
+{
+  auto host_function = math_bytecode::compile(
+      "void density(const double x[3], double& rho) {\n"
+      "  double a = 2.0 * x[1];\n"
+      "  rho = 1.0 + x[0];\n"
+      "  rho = rho + a;\n"
+      "}\n");
+  for (auto& instruction : host_function.instructions()) {
+    EXPECT_NE(instruction.code, math_bytecode::instruction_code::copy);
+  }
+  auto exe_function = host_function.executable();
+  double registers[10];
+  double const x[3] = {1, 2, 0};
+  double rho;
+  exe_function(registers, x, rho);
+  EXPECT_EQ(rho, 6.0);
+}
+
 TEST(execute, vector3_double)
 {
   auto host_function = math_bytecode::compile(
@@ -71,6 +218,713 @@ TEST(language, comments)
       "}\n"));
 }
 
+TEST(language, for_loops)
+{
+  auto host_function = math_bytecode::compile(
+      "void fourier(const double a[3], double t, double& result) {\n"
+      "  result = 0.0;\n"
+      "  for (int k = 0; k < 3; ++k) {\n"
+      "    result = result + a[k] * sin((2.0 * k + 1.0) * t);\n"
+      "    for (int j = 1; j < 3; j++) { result = result + 0.5 * a[j]; }\n"
+      "  }\n"
+      "}\n");
+  // 2.0 * k is folded, leaving four multiplications per value of k
+  EXPECT_EQ(std::count_if(host_function.instructions().begin(), host_function.instructions().end(),
+        [] (math_bytecode::instruction const& in) {
+          return math_bytecode::primitive_code(in.code) == math_bytecode::instruction_code::multiply;
+        }), 12);
+  std::vector<double> registers(std::size_t(host_function.register_count()));
+  double const a[3] = {1.0, 0.5, 0.25};
+  double const t = 0.3;
+  double result;
+  host_function.executable()(registers.data(), a, t, result);
+  double expected = 0.0;
+  for (int k = 0; k < 3; ++k) {
+    expected += a[k] * std::sin((2.0 * k + 1.0) * t) + 0.5 * (a[1] + a[2]);
+  }
+  EXPECT_DOUBLE_EQ(result, expected);
+  EXPECT_THROW(static_cast<void>(math_bytecode::compile(
+      "void f(const double a[2], double& s) { s = a[j]; }\n")),
+      std::invalid_argument);
+  EXPECT_THROW(static_cast<void>(math_bytecode::compile(
+      "void f(double x, double& s) { for (int k = 0; k < 2; ++k) { k = x; } }\n")),
+      std::invalid_argument);
+}
+
+TEST(differentiate, gradient)
+{
+  auto host_function = math_bytecode::differentiate(math_bytecode::compile(
+      "void f(const double x[2], double& result) {\n"
+      "  result = x[0] * sin(x[1]) + pow(x[0], 2) + exp(x[1]) / x[0];\n"
+      "  if (x[0] < 0.0) { result = -x[0] * x[1]; }\n"
+      "}\n"), {0, 1});
+  auto exe_function = host_function.executable();
+  double registers[20];
+  double const x[2] = {1.5, 0.7};
+  double result[3];
+  exe_function(registers, x, result);
+  EXPECT_DOUBLE_EQ(result[0], 1.5 * std::sin(0.7) + 1.5 * 1.5 + std::exp(0.7) / 1.5);
+  EXPECT_DOUBLE_EQ(result[1], std::sin(0.7) + 2.0 * 1.5 - std::exp(0.7) / (1.5 * 1.5));
+  EXPECT_DOUBLE_EQ(result[2], 1.5 * std::cos(0.7) + std::exp(0.7) / 1.5);
+  double const y[2] = {-2.0, 0.7};
+  exe_function(registers, y, result);
+  EXPECT_DOUBLE_EQ(result[1], -0.7);
+  EXPECT_DOUBLE_EQ(result[2], 2.0);
+}
+
+TEST(execute, single_and_mixed_precision)
+{
+  auto host_function = math_bytecode::compile(
+      "void f(const double x[2], double& result) {\n"
+      "  result = 0.1 * x[0] + sin(x[1]) / 3.0;\n"
+      "}\n");
+  auto single_function = math_bytecode::to_single_precision(host_function);
+  EXPECT_EQ(single_function.instructions()[0].constant, 0.1f);
+  float single_registers[10];
+  float const y[2] = {2.0f, 0.5f};
+  float single_result;
+  single_function.executable()(single_registers, y, single_result);
+  EXPECT_FLOAT_EQ(single_result, 0.1f * 2.0f + std::sin(0.5f) / 3.0f);
+  auto mixed_function = math_bytecode::to_mixed_precision(host_function);
+  double registers[10];
+  double const x[2] = {2.0, 0.5};
+  double result;
+  mixed_function.executable()(registers, x, result);
+  EXPECT_NEAR(result, 0.1 * 2.0 + std::sin(0.5) / 3.0, 1.0e-6);
+}
+
+TEST(execute, polynomial_math_batch)
+{
+  math_bytecode::compile_options options;
+  options.accuracy = math_bytecode::math_accuracy::one_ulp;
+  auto host_function = math_bytecode::compile(
+      "void f(const double x[2], double& result) {\n"
+      "  result = sin(x[0]) * exp(x[1]) + cos(x[0]) * log(x[1] + 2.0) + pow(x[1] + 2.0, x[0]);\n"
+      "}\n", options);
+  EXPECT_EQ(host_function.accuracy(), math_bytecode::math_accuracy::one_ulp);
+  int const count = 8;
+  std::vector<double> registers(std::size_t(host_function.register_count() * count));
+  double inputs[2 * count];
+  double outputs[count];
+  for (int p = 0; p < count; ++p) {
+    inputs[p] = -20.0 + 5.3 * p;
+    inputs[count + p] = -1.5 + 0.4 * p;
+  }
+  host_function.executable().evaluate_batch(registers.data(), count, inputs, outputs);
+  for (int p = 0; p < count; ++p) {
+    double const x = inputs[p];
+    double const y = inputs[count + p];
+    EXPECT_NEAR(outputs[p],
+        std::sin(x) * std::exp(y) + std::cos(x) * std::log(y + 2.0) + std::pow(y + 2.0, x),
+        1.0e-14 * (1.0 + std::abs(std::pow(y + 2.0, x))));
+  }
+  EXPECT_EQ(math_bytecode::polynomial_exp<math_bytecode::math_accuracy::four_ulp>(1000.0),
+      std::numeric_limits<double>::infinity());
+  EXPECT_EQ(math_bytecode::polynomial_pow<math_bytecode::math_accuracy::four_ulp>(-2.0, 3.0), -8.0);
+  EXPECT_NEAR(math_bytecode::polynomial_sin<math_bytecode::math_accuracy::four_ulp>(0.5f),
+      std::sin(0.5f), 4.0f * std::numeric_limits<float>::epsilon());
+}
+
+TEST(execute, polynomial_trigonometric_range)
+{
+  math_bytecode::compile_options options;
+  options.accuracy = math_bytecode::math_accuracy::one_ulp;
+  auto host_function = math_bytecode::compile(
+      "void f(double x, double& s, double& c) { s = sin(x); c = cos(x); }\n", options);
+  int const count = 4;
+  double const inputs[count] = {1.49e6, -1.0e20, 1.0e300, 0.75};
+  std::vector<double> registers(std::size_t(host_function.register_count() * count));
+  double outputs[2 * count];
+  host_function.executable().evaluate_batch(registers.data(), count, inputs, outputs);
+  for (int p = 0; p < count; ++p) {
+    double const x = inputs[p];
+    EXPECT_LE(ulp_distance(outputs[p], std::sin(x)), 1);
+    EXPECT_LE(ulp_distance(outputs[count + p], std::cos(x)), 1);
+    double s, c;
+    host_function.executable()(registers.data(), x, s, c);
+    EXPECT_LE(ulp_distance(s, std::sin(x)), 1);
+    EXPECT_LE(ulp_distance(c, std::cos(x)), 1);
+  }
+  using math_bytecode::math_accuracy;
+  EXPECT_EQ(math_bytecode::evaluate_math_function<math_bytecode::sin_function>(
+        math_accuracy::four_ulp, 1.0e10f, 1.0e10f), std::sin(1.0e10f));
+  EXPECT_TRUE(std::isnan(math_bytecode::evaluate_math_function<math_bytecode::cos_function>(
+        math_accuracy::one_ulp, std::numeric_limits<double>::infinity(), 0.0)));
+}
+
+TEST(execute, output_stores)
+{
+  auto host_function = math_bytecode::compile(
+      "void f(double x, double y, double out[3]) {\n"
+      "  out[0] = x * y;\n"
+      "  out[1] = out[0] + sin(y);\n"
+      "  out[2] = x;\n"
+      "}\n");
+  EXPECT_FALSE(host_function.output_stores().empty());
+  // points 2 through 5 of fields of 8 points
+  int const field_size = 8;
+  int const first = 2;
+  int const count = 4;
+  std::vector<double> inputs(2 * field_size);
+  std::vector<double> outputs(3 * field_size, -1.0);
+  for (int p = 0; p < field_size; ++p) {
+    inputs[std::size_t(p)] = 0.5 * p;
+    inputs[std::size_t(field_size + p)] = 1.0 + p;
+  }
+  std::vector<double> registers(std::size_t(host_function.register_count() * count));
+  host_function.executable().evaluate_batch(registers.data(), count,
+      inputs.data() + first, field_size, outputs.data() + first, field_size);
+  for (int p = 0; p < field_size; ++p) {
+    bool const is_evaluated = first <= p && p < first + count;
+    double const x = 0.5 * p;
+    double const y = 1.0 + p;
+    EXPECT_EQ(outputs[std::size_t(p)], is_evaluated ? x * y : -1.0);
+    EXPECT_EQ(outputs[std::size_t(field_size + p)], is_evaluated ? x * y + std::sin(y) : -1.0);
+    EXPECT_EQ(outputs[std::size_t(2 * field_size + p)], is_evaluated ? x : -1.0);
+  }
+}
+
+TEST(execute, tables)
+{
+  math_bytecode::compile_options options;
+  auto& profile = options.tables["profile"];
+  profile.x = {0.0, 1.0, 2.0, 3.0};
+  profile.values = {0.0, 10.0, 40.0, 90.0};
+  auto& eos = options.tables["eos"];
+  eos.x = {0.0, 1.0, 3.0};
+  eos.y = {0.0, 2.0};
+  eos.values = {0.0, 1.0, 3.0, 2.0, 3.0, 5.0};
+  eos.method = math_bytecode::interpolation::cubic;
+  auto host_function = math_bytecode::compile(
+      "void f(const double x[2], double out[2]) {\n"
+      "  out[0] = table1d(profile, x[0]);\n"
+      "  out[1] = table2d(eos, x[0] * 0.5, x[1] + 1.0);\n"
+      "}\n", options);
+  EXPECT_EQ(host_function.tables().size(), 2u);
+  auto exe_function = host_function.executable();
+  double registers[10];
+  double const x[2] = {2.5, 0.0};
+  double result[2];
+  exe_function(registers, x, result);
+  EXPECT_DOUBLE_EQ(result[0], 65.0);
+  // the eos table is linear in both x and y, which the cubic reproduces
+  EXPECT_DOUBLE_EQ(result[1], 1.25 + 1.0);
+  double const outside[2] = {-1.0, 5.0};
+  exe_function(registers, outside, result);
+  EXPECT_DOUBLE_EQ(result[0], 0.0);
+  EXPECT_DOUBLE_EQ(result[1], 2.0);
+  auto single_function = math_bytecode::to_single_precision(host_function);
+  float single_registers[10];
+  float const y[2] = {0.5f, 0.0f};
+  float single_result[2];
+  single_function.executable()(single_registers, y, single_result);
+  EXPECT_FLOAT_EQ(single_result[0], 5.0f);
+  EXPECT_THROW(static_cast<void>(math_bytecode::compile(
+      "void f(double x, double& y) { y = table1d(missing, x); }\n", options)),
+      std::invalid_argument);
+}
+
+TEST(execute, hoist_uniform)
+{
+  auto host_function = math_bytecode::hoist_uniform(math_bytecode::compile(
+      "void f(const double x[2], double t, double out[2]) {\n"
+      "  out[0] = x[0] * sin(2.0 * t) + x[1] / (t + 1.0);\n"
+      "  out[1] = cos(t);\n"
+      "}\n"), {2});
+  EXPECT_EQ(host_function.prologue_count(), 6);
+  int const count = 4;
+  std::vector<double> registers(std::size_t(host_function.register_count() * count));
+  double inputs[3 * count];
+  double outputs[2 * count];
+  for (int p = 0; p < count; ++p) {
+    inputs[p] = 1.0 + p;
+    inputs[count + p] = 0.5 * p;
+    inputs[2 * count + p] = 0.3;
+  }
+  host_function.executable().evaluate_batch(registers.data(), count, inputs, outputs);
+  for (int p = 0; p < count; ++p) {
+    EXPECT_DOUBLE_EQ(outputs[p], (1.0 + p) * std::sin(0.6) + 0.5 * p / 1.3);
+    EXPECT_DOUBLE_EQ(outputs[count + p], std::cos(0.3));
+  }
+}
+
+TEST(compiled_function, pin_inputs)
+{
+  math_bytecode::compile_options options;
+  options.pin_inputs = true;
+  std::string const source =
+      "void f(double unused, const double x[2], double t, double& y) {\n"
+      "  y = x[1] * sin(t) - x[0];\n"
+      "  for (int i = 0; i < 2; ++i) { y = y * x[i]; }\n"
+      "}\n";
+  auto host_function = math_bytecode::compile(source, options);
+  EXPECT_TRUE(host_function.has_pinned_inputs());
+  for (int i = 0; i < 4; ++i) EXPECT_EQ(host_function.input_registers()[i], i);
+  EXPECT_TRUE(math_bytecode::hoist_uniform(host_function, {3}).has_pinned_inputs());
+  EXPECT_TRUE(math_bytecode::differentiate(host_function, {1}).has_pinned_inputs());
+  // the register file starts out as the inputs, with no copies
+  int const count = 3;
+  std::vector<double> registers(std::size_t(host_function.register_count() * count));
+  for (int p = 0; p < count; ++p) {
+    registers[std::size_t(count + p)] = 1.0 + p;
+    registers[std::size_t(2 * count + p)] = 2.0;
+    registers[std::size_t(3 * count + p)] = 0.5;
+  }
+  host_function.executable().execute_batch(registers.data(), count);
+  int const y_register = host_function.output_registers()[0];
+  for (int p = 0; p < count; ++p) {
+    double const expected = (2.0 * std::sin(0.5) - (1.0 + p)) * (1.0 + p) * 2.0;
+    EXPECT_DOUBLE_EQ(registers[std::size_t(y_register * count + p)], expected);
+  }
+}
+
+TEST(compiled_function, specialize)
+{
+  auto host_function = math_bytecode::compile(
+      "void f(const double x[2], double mode, double& r) {\n"
+      "  r = x[0];\n"
+      "  if (mode > 0.5) { r = sin(x[0]) * x[1] + mode; }\n"
+      "}\n");
+  auto off_function = math_bytecode::specialize(host_function, {{2, 0.0}});
+  EXPECT_FALSE(off_function.any_output_depends_on(2));
+  EXPECT_LE(off_function.instructions().size(), 1u);
+  auto on_function = math_bytecode::specialize(host_function, {{2, 1.0}});
+  for (auto& instruction : on_function.instructions()) {
+    EXPECT_NE(instruction.code, math_bytecode::instruction_code::conditional_copy);
+    EXPECT_NE(instruction.code, math_bytecode::instruction_code::greater);
+  }
+  double registers[10];
+  double const x[2] = {0.5, 3.0};
+  double const mode = 7.0;
+  double r;
+  off_function.executable()(registers, x, mode, r);
+  EXPECT_EQ(r, 0.5);
+  on_function.executable()(registers, x, mode, r);
+  EXPECT_DOUBLE_EQ(r, std::sin(0.5) * 3.0 + 1.0);
+}
+
+TEST(compiled_function, reduce_strength)
+{
+  std::string const source =
+      "void f(double x, double out[9]) {\n"
+      "  out[0] = pow(x, 2);\n"
+      "  out[1] = pow(x, 5);\n"
+      "  out[2] = pow(x, -2);\n"
+      "  out[3] = pow(x, 0.5);\n"
+      "  out[4] = x / 4.0;\n"
+      "  out[5] = x / 3.0;\n"
+      "  out[6] = pow(x, 64);\n"
+      "  out[7] = 2.0 * pow(x, 0) + x;\n"
+      "  out[8] = 0.0;\n"
+      "  for (int k = 0; k < 3; ++k) { out[8] = out[8] + pow(x, k); }\n"
+      "}\n";
+  auto const count_code = [] (auto const& function, math_bytecode::instruction_code code) {
+    return std::count_if(function.instructions().begin(), function.instructions().end(),
+        [&] (auto const& in) { return math_bytecode::primitive_code(in.code) == code; });
+  };
+  using math_bytecode::instruction_code;
+  math_bytecode::compile_options options;
+  EXPECT_EQ(count_code(math_bytecode::compile(source, options), instruction_code::pow), 9);
+  options.reduce_strength = true;
+  auto const host_function = math_bytecode::compile(source, options);
+  EXPECT_EQ(count_code(host_function, instruction_code::pow), 3);
+  EXPECT_EQ(count_code(host_function, instruction_code::pow_half), 1);
+  EXPECT_EQ(count_code(host_function, instruction_code::divide), 1);
+  options.reciprocal_division = true;
+  EXPECT_EQ(count_code(math_bytecode::compile(source, options), instruction_code::divide), 0);
+  options.reciprocal_division = false;
+  options.accuracy = math_bytecode::math_accuracy::four_ulp;
+  auto const four_ulp_function = math_bytecode::compile(source, options);
+  EXPECT_EQ(count_code(four_ulp_function, instruction_code::pow), 1);
+  std::vector<double> registers(std::size_t(std::max(
+          host_function.register_count(), four_ulp_function.register_count())));
+  double out[9];
+  for (double point = 0.01; point < 1000.0; point *= 1.37) {
+    double const x = point;
+    host_function.executable()(registers.data(), x, out);
+    EXPECT_EQ(out[0], x * x);
+    EXPECT_EQ(out[3], std::sqrt(x));
+    EXPECT_EQ(out[4], x / 4.0);
+    EXPECT_EQ(out[5], x / 3.0);
+    EXPECT_EQ(out[7], 2.0 + x);
+    EXPECT_EQ(out[8], 1.0 + x + x * x);
+    four_ulp_function.executable()(registers.data(), x, out);
+    EXPECT_LE(ulp_distance(out[1], std::pow(x, 5.0)), 4);
+    EXPECT_LE(ulp_distance(out[2], std::pow(x, -2.0)), 4);
+  }
+  for (double const x : {-0.0, -std::numeric_limits<double>::infinity()}) {
+    host_function.executable()(registers.data(), x, out);
+    EXPECT_EQ(out[3], std::pow(x, 0.5));
+    EXPECT_FALSE(std::signbit(out[3]));
+  }
+}
+
+TEST(compiled_function, compile_many)
+{
+  std::vector<std::string> sources;
+  for (int i = 0; i < 16; ++i) {
+    sources.push_back(
+        "void f(double x, double& y) {\n"
+        "  y = x + " + std::to_string(i) + ".0;\n"
+        "}\n");
+  }
+  sources[5] = "void f(double x, double& y) { y = x +; }\n";
+  auto results = math_bytecode::compile_many(sources, math_bytecode::compile_options(), 4);
+  ASSERT_EQ(results.size(), sources.size());
+  EXPECT_FALSE(results[5].error.empty());
+  double registers[10];
+  double const x = 1.0;
+  for (int i = 0; i < 16; ++i) {
+    if (i == 5) continue;
+    EXPECT_TRUE(results[std::size_t(i)].error.empty());
+    double y;
+    results[std::size_t(i)].function.executable()(registers, x, y);
+    EXPECT_EQ(y, 1.0 + i);
+  }
+}
+
+TEST(compiled_function, compile_file)
+{
+  std::string const path = ::testing::TempDir() + "math_bytecode_compile_file.c";
+  {
+    std::ofstream file(path);
+    file << "\n  void f(double x, double& y) {\n  y = 2.0 * x;\n}\n";
+  }
+  auto host_function = math_bytecode::compile_file(path);
+  std::remove(path.c_str());
+  double registers[10];
+  double const x = 3.0;
+  double y;
+  host_function.executable()(registers, x, y);
+  EXPECT_EQ(y, 6.0);
+  EXPECT_THROW(static_cast<void>(math_bytecode::compile_file(path)), std::runtime_error);
+}
+
+TEST(execute, vector3_builtins)
+{
+  auto host_function = math_bytecode::compile(
+      "void f(const double x[3], const double n[3], double out[4]) {\n"
+      "  double c = cross(x, n);\n"
+      "  double u = normalize(c);\n"
+      "  out[0] = norm(x);\n"
+      "  out[1] = dot(x, n);\n"
+      "  out[2] = u[2];\n"
+      "  out[3] = dot(normalize(n), x);\n"
+      "}\n");
+  double registers[20];
+  double const x[3] = {3.0, 0.0, 4.0};
+  double const n[3] = {0.0, 2.0, 0.0};
+  double out[4];
+  host_function.executable()(registers, x, n, out);
+  EXPECT_DOUBLE_EQ(out[0], 5.0);
+  EXPECT_DOUBLE_EQ(out[1], 0.0);
+  EXPECT_DOUBLE_EQ(out[2], 0.6);
+  EXPECT_DOUBLE_EQ(out[3], 0.0);
+  auto derivative = math_bytecode::differentiate(host_function, {0});
+  double d_registers[60];
+  double d_out[8];
+  derivative.executable()(d_registers, x, n, d_out);
+  EXPECT_DOUBLE_EQ(d_out[4], 0.6);
+  EXPECT_DOUBLE_EQ(d_out[5], 0.0);
+  EXPECT_THROW(static_cast<void>(math_bytecode::compile(
+      "void f(double x, double& y) { y = norm(x + 1.0); }\n")),
+      std::invalid_argument);
+}
+
+TEST(execute, min_max_abs_clamp_select)
+{
+  auto host_function = math_bytecode::compile(
+      "void f(double x, double& result) {\n"
+      "  result = min(x, 1.0) + max(x, -1.0) + abs(x) + clamp(2.0 * x, -0.5, 0.5)\n"
+      "    + select(x < 0.0 || x > 2.0, 10.0, x * x);\n"
+      "}\n");
+  for (auto const& in : host_function.instructions()) {
+    EXPECT_NE(in.code, math_bytecode::instruction_code::logical_not);
+  }
+  int const count = 4;
+  std::vector<double> registers(std::size_t(host_function.register_count() * count));
+  double inputs[count] = {-3.0, 0.125, 1.5, 4.0};
+  double outputs[count];
+  host_function.executable().evaluate_batch(registers.data(), count, inputs, outputs);
+  auto expected = [] (double x) {
+    return std::min(x, 1.0) + std::max(x, -1.0) + std::abs(x) + std::clamp(2.0 * x, -0.5, 0.5)
+      + ((x < 0.0 || x > 2.0) ? 10.0 : x * x);
+  };
+  for (int p = 0; p < count; ++p) {
+    EXPECT_DOUBLE_EQ(outputs[p], expected(inputs[p]));
+    double scalar_registers[32];
+    double const x = inputs[p];
+    double result;
+    host_function.executable()(scalar_registers, x, result);
+    EXPECT_DOUBLE_EQ(result, expected(x));
+  }
+  auto derivative = math_bytecode::differentiate(host_function, {0});
+  double d_registers[64];
+  double const x = 0.125;
+  double d_out[2];
+  derivative.executable()(d_registers, x, d_out[0], d_out[1]);
+  EXPECT_DOUBLE_EQ(d_out[1], 1.0 + 1.0 + 1.0 + 2.0 + 2.0 * x);
+  auto abs_function = math_bytecode::compile(
+      "void f(double x, double& result) { result = abs(x); }\n");
+  double const negative_zero = -0.0;
+  double abs_result;
+  abs_function.executable()(d_registers, negative_zero, abs_result);
+  EXPECT_FALSE(std::signbit(abs_result));
+  double abs_registers[8];
+  abs_function.executable().evaluate_batch(abs_registers, 1, &negative_zero, &abs_result);
+  EXPECT_FALSE(std::signbit(abs_result));
+}
+
+TEST(execute, function_table)
+{
+  math_bytecode::compile_options options;
+  auto& profile = options.tables["profile"];
+  profile.x = {0.0, 1.0, 2.0};
+  profile.values = {0.0, 10.0, 40.0};
+  std::vector<math_bytecode::host_function> functions = {
+    math_bytecode::compile("void f(double x, double y, double& z) { z = x + y; }\n"),
+    math_bytecode::compile("void f(double x, double y, double& z) { z = table1d(profile, x) * y; }\n", options),
+    math_bytecode::hoist_uniform(math_bytecode::compile(
+          "void f(double x, double y, double& z) { z = exp(y) - x; }\n"), {1})};
+  math_bytecode::host_function_table host_table(functions);
+  math_bytecode::device_function_table device_table(host_table);
+  EXPECT_EQ(device_table.size(), 3);
+  EXPECT_THROW(math_bytecode::host_function_table({functions[0],
+        math_bytecode::compile("void f(double x, double& z) { z = x; }\n")}),
+      std::invalid_argument);
+  int const element_count = 11;
+  int function_ids[element_count];
+  double inputs[2 * element_count];
+  for (int e = 0; e < element_count; ++e) {
+    function_ids[e] = (e * 7) % 3;
+    inputs[e] = 0.15 * e;
+    inputs[element_count + e] = 0.5;
+  }
+  auto const sorted = math_bytecode::schedule_by_function(3, element_count, function_ids, 3);
+  EXPECT_EQ(sorted.offsets, std::vector<int>({0, 4, 8, 11}));
+  EXPECT_EQ(sorted.work_items.size(), 5u);
+  EXPECT_THROW(static_cast<void>(math_bytecode::schedule_by_function(
+          3, element_count, function_ids, 0)), std::invalid_argument);
+  auto const table = host_table.executable();
+  int const batch_size = 3;
+  auto const schedule = host_table.schedule(element_count, function_ids, batch_size);
+  EXPECT_EQ(schedule.work_item_count(), 5);
+  std::vector<double> registers(std::size_t(table.registers_per_point() * batch_size));
+  double outputs[element_count];
+  table.evaluate_batch(registers.data(), schedule.executable(), inputs, outputs);
+  for (int e = 0; e < element_count; ++e) {
+    double scalar_registers[16];
+    double const x = inputs[e];
+    double const y = inputs[element_count + e];
+    double z;
+    table[function_ids[e]](scalar_registers, x, y, z);
+    EXPECT_DOUBLE_EQ(outputs[e], z);
+  }
+  // one work item per index, each with its own registers, as a kernel would
+  math_bytecode::compiled_function_table<
+    p3a::host_allocator<math_bytecode::instruction>,
+    p3a::execution::sequenced_policy,
+    math_bytecode::instruction_layout::structure_of_arrays> const arrays_table(device_table);
+  auto const arrays = arrays_table.executable();
+  int const slice = arrays.registers_per_point() * batch_size;
+  std::vector<double> slices(std::size_t(slice * schedule.work_item_count()));
+  double bucket_outputs[element_count];
+  for (int w = 0; w < schedule.work_item_count(); ++w) {
+    arrays.evaluate_bucket(w, schedule.executable(), slices.data() + w * slice, inputs, bucket_outputs);
+  }
+  for (int e = 0; e < element_count; ++e) {
+    EXPECT_DOUBLE_EQ(bucket_outputs[e], outputs[e]);
+  }
+  // the functions of a table write their outputs through their output_stores
+  double batch_outputs[2];
+  double const batch_inputs[4] = {0.25, 0.75, 0.5, 0.5};
+  table[0].evaluate_batch(registers.data(), 2, batch_inputs, batch_outputs);
+  EXPECT_DOUBLE_EQ(batch_outputs[0], 0.75);
+  EXPECT_DOUBLE_EQ(batch_outputs[1], 1.25);
+}
+
+TEST(execute, auto_function)
+{
+  math_bytecode::auto_function function(math_bytecode::compile(
+      "void f(double x, double y, double& z) { z = sin(x) * y + exp(-y); }\n"), 256);
+  int const count = 1000;
+  std::vector<double> inputs(2 * count);
+  std::vector<double> outputs(count);
+  for (int p = 0; p < count; ++p) {
+    inputs[std::size_t(p)] = 0.01 * p;
+    inputs[std::size_t(count + p)] = 1.0 - 0.002 * p;
+  }
+  function.evaluate(100, inputs.data(), outputs.data());
+  EXPECT_FALSE(function.is_calibrated());
+  function.evaluate(count, inputs.data(), outputs.data());
+  EXPECT_TRUE(function.is_calibrated());
+  EXPECT_EQ(function.candidates().size(), 4u);
+  EXPECT_GT(function.plan().nanoseconds_per_point, 0.0);
+  for (int p = 0; p < count; ++p) {
+    double const x = inputs[std::size_t(p)];
+    double const y = inputs[std::size_t(count + p)];
+    EXPECT_DOUBLE_EQ(outputs[std::size_t(p)], std::sin(x) * y + std::exp(-y));
+  }
+  std::stringstream stream;
+  stream << function.plan();
+  EXPECT_NE(stream.str().find(math_bytecode::strategy_name(function.plan().strategy)), std::string::npos);
+}
+
+TEST(execute, evaluate_parallel)
+{
+  auto host_function = math_bytecode::compile(
+      "void f(double x, double y, double& z) {\n"
+      "  z = x * y;\n"
+      "  if (x > 0.5) { z = exp(sin(x) * cos(y)) + pow(x, y); }\n"
+      "}\n");
+  math_bytecode::thread_pool pool(4);
+  EXPECT_EQ(pool.size(), 4);
+  int const count = 10007;
+  std::vector<double> inputs(2 * count);
+  for (int p = 0; p < count; ++p) {
+    inputs[std::size_t(p)] = (p % 97) / 97.0;
+    inputs[std::size_t(count + p)] = 1.0 + p * 1.0e-4;
+  }
+  for (int chunk_size : {0, 16}) {
+    std::vector<double> outputs(count, -1.0);
+    math_bytecode::evaluate_parallel(host_function, pool, count, inputs.data(), outputs.data(), chunk_size);
+    for (int p = 0; p < count; ++p) {
+      double registers[16];
+      double const x = inputs[std::size_t(p)];
+      double const y = inputs[std::size_t(count + p)];
+      double z;
+      host_function.executable()(registers, x, y, z);
+      ASSERT_EQ(outputs[std::size_t(p)], z);
+    }
+  }
+  // callers on two threads share the pool by taking turns
+  std::vector<double> first_outputs(count);
+  std::vector<double> second_outputs(count);
+  std::thread other([&] {
+    math_bytecode::evaluate_parallel(host_function, pool, count, inputs.data(), first_outputs.data());
+  });
+  math_bytecode::evaluate_parallel(host_function, pool, count, inputs.data(), second_outputs.data());
+  other.join();
+  EXPECT_EQ(first_outputs, second_outputs);
+}
+
+TEST(compiled_function, depends_on)
+{
+  auto host_function = math_bytecode::compile(
+      "void bc(const double x[3], double t, double out[3]) {\n"
+      "  out[0] = 2.0 * x[0];\n"
+      "  out[1] = norm(x);\n"
+      "  out[2] = 1.0;\n"
+      "  if (x[2] > 0.0) { out[2] = sin(t); }\n"
+      "}\n");
+  EXPECT_TRUE(host_function.depends_on(0, 0));
+  EXPECT_FALSE(host_function.depends_on(0, 1));
+  EXPECT_FALSE(host_function.depends_on(0, 3));
+  for (int i = 0; i < 3; ++i) EXPECT_TRUE(host_function.depends_on(1, i));
+  EXPECT_FALSE(host_function.depends_on(1, 3));
+  EXPECT_TRUE(host_function.depends_on(2, 2));
+  EXPECT_TRUE(host_function.depends_on(2, 3));
+  EXPECT_FALSE(host_function.depends_on(2, 0));
+  EXPECT_TRUE(host_function.any_output_depends_on(3));
+  auto const steady = math_bytecode::specialize(host_function, {{2, -1.0}});
+  EXPECT_FALSE(steady.any_output_depends_on(3));
+  math_bytecode::device_function device_function(steady);
+  EXPECT_EQ(device_function.dependencies(), steady.dependencies());
+}
+
+TEST(compiled_function, verifier)
+{
+  using math_bytecode::instruction_code;
+  math_bytecode::instruction add;
+  add.result_register = 1;
+  add.code = instruction_code::add;
+  add.input_registers = {0, 0};
+  EXPECT_NO_THROW(math_bytecode::host_function({add}, {0}, {1}, 2));
+  EXPECT_THROW(math_bytecode::host_function({add}, {0}, {1}, 1), std::invalid_argument);
+  EXPECT_THROW(math_bytecode::host_function({add}, {}, {1}, 2), std::invalid_argument);
+  EXPECT_THROW(math_bytecode::host_function({add}, {0}, {0, 1, 2}, 2), std::invalid_argument);
+  auto bad_code = add;
+  bad_code.code = instruction_code(math_bytecode::dispatch_code_count);
+  EXPECT_THROW(math_bytecode::host_function({bad_code}, {0}, {1}, 2), std::invalid_argument);
+  auto lookup = add;
+  lookup.code = instruction_code::table1d;
+  EXPECT_THROW(math_bytecode::host_function({lookup}, {0}, {1}, 2), std::invalid_argument);
+  auto dot = add;
+  dot.code = instruction_code::dot;
+  EXPECT_THROW(math_bytecode::host_function({dot}, {0}, {1}, 2), std::invalid_argument);
+  // unused inputs get a register whose value is never read
+  auto host_function = math_bytecode::compile(
+      "void f(double a, double b, double& y) {\n"
+      "  y = 2.0 * b;\n"
+      "}\n");
+  int const a_register = host_function.input_registers()[0];
+  EXPECT_GE(a_register, 0);
+  EXPECT_LT(a_register, host_function.register_count());
+  EXPECT_NE(a_register, host_function.input_registers()[1]);
+  std::vector<double> registers(std::size_t(host_function.register_count()));
+  double const a = 5.0;
+  double const b = 3.0;
+  double y;
+  host_function.executable()(registers.data(), a, b, y);
+  EXPECT_DOUBLE_EQ(y, 6.0);
+  auto const gradient = math_bytecode::differentiate(host_function, {0, 1});
+  registers.resize(std::size_t(gradient.register_count()));
+  double result[3];
+  double const inputs[2] = {5.0, 3.0};
+  gradient.executable()(registers.data(), inputs, result);
+  EXPECT_DOUBLE_EQ(result[0], 6.0);
+  EXPECT_DOUBLE_EQ(result[1], 0.0);
+  EXPECT_DOUBLE_EQ(result[2], 2.0);
+}
+
+TEST(execute, superinstructions)
+{
+  auto host_function = math_bytecode::compile(
+      "void f(double a, double b, double x, double& y) {\n"
+      "  y = a * x * x + b * x;\n"
+      "}\n");
+  double registers[10];
+  double const a = 2.0;
+  double const b = 3.0;
+  double const x = 5.0;
+  double y;
+  host_function.executable()(registers, a, b, x, y);
+  EXPECT_EQ(y, 65.0);
+  math_bytecode::sequence_profile profile;
+  profile.add(host_function, 10);
+  using math_bytecode::instruction_code;
+  EXPECT_EQ((profile.counts[{instruction_code::multiply, instruction_code::add}]), 10u);
+  std::stringstream stream;
+  math_bytecode::write_superinstructions(stream, profile, 2);
+  EXPECT_NE(stream.str().find(
+        "X(multiply_multiply_add, instruction_code::multiply, "
+        "instruction_code::multiply, instruction_code::add)"), std::string::npos);
+}
+
+#ifdef MATH_BYTECODE_ENABLE_COUNTERS
+TEST(execute, counters)
+{
+  auto host_function = math_bytecode::compile(
+      "void density(const double x[3], double& rho) {\n"
+      "  rho = 1.0 + x[0];\n"
+      "}\n");
+  host_function.counters()->name = "density";
+  auto exe_function = host_function.executable();
+  double registers[10];
+  double const x[3] = {0, 0, 0};
+  double rho;
+  exe_function(registers, x, rho);
+  exe_function(registers, x, rho);
+  EXPECT_EQ(host_function.counters()->evaluation_count, 2);
+  EXPECT_EQ(host_function.counters()->dispatch_counts[int(math_bytecode::instruction_code::add)], 2);
+  std::stringstream stream;
+  math_bytecode::dump_counters(stream);
+  EXPECT_NE(stream.str().find("density: 2 evaluations"), std::string::npos);
+  math_bytecode::reset_counters();
+  EXPECT_EQ(host_function.counters()->evaluation_count, 0);
+}
+#endif
+
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);
   Kokkos::ScopeGuard kokkos_library_state(argc, argv);